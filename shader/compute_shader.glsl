@@ -2,7 +2,27 @@
 
 #define MAX_NUM_SPHERES 10
 
+// BVH branching factor, set by the application: 2 uses the binary BVH with skip links,
+// 4 or 8 the collapsed wide BVH. BVH_QUANTIZED (wide only) switches to the compressed node format.
+// INSTANCING (binary only) traces a TLAS over instances of per object BVHs.
+// TRIANGLES adds a triangle mesh with its own binary BVH, traced after the spheres.
+// MIXED_PRIMITIVES makes leaves index typed primitive references (spheres and quads) instead of spheres.
+// PACKED_MATERIALS reads materials in the 16 byte half float encoding of material_palette.h.
+// SPHERE_SOA splits spheres into a vec4 (center, radius) buffer for intersection and a material buffer.
+// NEXT_EVENT_ESTIMATION samples an emitter with a shadow ray at every diffuse hit, weighted against
+// BSDF sampling by multiple importance sampling.
+// WAVEFRONT builds one pass of the wavefront path tracer (wavefront.h) instead of the megakernel main.
+// PERSISTENT_THREADS launches a fixed number of groups whose invocations pull pixels from a shared
+// counter until the frame's work runs out (persistent_threads.h), instead of an invocation per pixel.
+#ifndef BVH_WIDTH
+#define BVH_WIDTH 2
+#endif
+
+#if defined(WAVEFRONT) || defined(PERSISTENT_THREADS)
+layout (local_size_x = 64, local_size_y = 1, local_size_z = 1) in; // flat lists of paths or pixels
+#else
 layout (local_size_x = 16, local_size_y = 16, local_size_z = 1) in;
+#endif
 
 /* Uniforms */
 
@@ -16,6 +36,7 @@ layout(location = 7) uniform int bvh_size;
 layout(location = 8) uniform int root_index;
 layout(location = 9) uniform int samples_per_pixel;
 layout(location = 10) uniform int max_bounces;
+layout(location = 11) uniform int num_emitters;
 
 /* Structs */
 
@@ -28,6 +49,7 @@ struct HitRecord {
     vec3 point;
     vec3 normal;
     uint mat_index;
+    uint prim_ref; // primitive hit, type and index as in primitive_refs, NO_PRIMITIVE for triangles
     float t;
     bool front_face;
 };
@@ -38,12 +60,16 @@ struct Sphere{
     uint material_index;
 };
 
+// Precomputed on the CPU, see GPUQuad in primitives.h
 struct Quad{
     vec3 corner_point;
-    vec3 u;
-    vec3 v;
-    vec3 w;
     uint material_index;
+    vec3 normal;
+    float D;    // plane offset, dot(normal, corner_point)
+    vec3 uAxis; // dot(hit point - corner_point, uAxis) is the position along u, in [0, 1] inside
+    float padding0;
+    vec3 vAxis;
+    float padding1;
 };
 
 struct Material{
@@ -51,25 +77,73 @@ struct Material{
     float fuzz;
     vec3 emission;
     float refractive_index;
-    float type;
+    uint type;
 };
 
 struct BVHNodeFlat {
     vec4 aabbMin;
     vec4 aabbMax;
-    ivec4 meta; // x: left, y: right, z: sphereIndex, w: next node
+    ivec4 meta; // x: left, y: right (inner) or sphere count (leaf), z: first sphere (-1 for inner), w: next node
+};
+
+#if BVH_WIDTH > 2
+// Child bounds stored structure of arrays, one fetch holds every child
+struct BVHNodeWide {
+    float minX[BVH_WIDTH];
+    float minY[BVH_WIDTH];
+    float minZ[BVH_WIDTH];
+    float maxX[BVH_WIDTH];
+    float maxY[BVH_WIDTH];
+    float maxZ[BVH_WIDTH];
+    int child[BVH_WIDTH]; // inner node index, first sphere of a leaf (count > 0) or -1 for an empty slot
+    int count[BVH_WIDTH]; // sphere count of a leaf, 0 for inner nodes
+};
+
+#ifdef BVH_QUANTIZED
+// Child bounds as 8 bit steps of 2^exponent from the node origin, rounded outwards on the CPU.
+// Byte arrays are packed four to a uint, see bvh_quantized.h
+struct BVHNodeQuantized {
+    vec3 origin;
+    uint exponents;               // signed bytes x, y, z
+    uint qMin[3 * BVH_WIDTH / 4]; // all x, then all y, then all z
+    uint qMax[3 * BVH_WIDTH / 4];
+    int child[BVH_WIDTH];
+    uint counts[BVH_WIDTH / 4];
 };
+#endif
+#endif
 
 
 /* Scnene Buffers */
 
+#ifdef SPHERE_SOA
+// Traversal only reads the 16 byte geometry, the material of the closest hit is looked up once at the end
+layout(std430, binding = 0) buffer SphereGeometryBuffer{
+    vec4 sphere_geometry[]; // xyz = center, w = radius
+};
+
+layout(std430, binding = 12) buffer SphereMaterialBuffer{
+    uint sphere_materials[];
+};
+
+// Marks HitRecord.mat_index as a sphere index whose material hasn't been read yet
+const uint SPHERE_MATERIAL_PENDING = 0x80000000u;
+#else
 layout(std430, binding = 0) buffer SpheresBuffer{
     Sphere spheres[];
 };
+#endif
 
+#ifdef PACKED_MATERIALS
+// x = color.rg, y = color.b and fuzz or refractive index, z = emission.rg, w = emission.b | type << 16
+layout(std430, binding = 1) buffer MatsBuffer{
+    uvec4 packed_mats[];
+};
+#else
 layout(std430, binding = 1) buffer MatsBuffer{
     Material mats[];
 };
+#endif
 
 layout(std140, binding = 2) uniform Camera {
     mat4 viewMatrix;
@@ -81,21 +155,121 @@ layout(std140, binding = 2) uniform Camera {
     float defocus_angle;
 };
 
+#if BVH_WIDTH > 2 && defined(BVH_QUANTIZED)
+layout(std430, binding = 3) buffer BVHQuantizedBuffer {
+    BVHNodeQuantized wide_nodes[];
+};
+#elif BVH_WIDTH > 2
+layout(std430, binding = 3) buffer BVHWideBuffer {
+    BVHNodeWide wide_nodes[];
+};
+#else
 layout(std430, binding = 3) buffer BVHBuffer {
     BVHNodeFlat nodes[];
 };
+#endif
+
+#ifdef INSTANCING
+// Top level: instances and the BVH over them, binding 3 holds every BLAS and binding 0 their spheres
+struct Instance {
+    mat4 worldToObject;
+    int blasRoot;
+};
+
+layout(std430, binding = 5) buffer InstanceBuffer {
+    Instance instances[];
+};
+
+layout(std430, binding = 6) buffer TLASBuffer {
+    BVHNodeFlat tlas_nodes[];
+};
+#endif
+
+#ifdef TRIANGLES
+// Indexed triangle mesh: shared vertex positions, triangles in the leaf order of the mesh BVH
+layout(std430, binding = 7) buffer MeshNodeBuffer {
+    BVHNodeFlat mesh_nodes[];
+};
+
+layout(std430, binding = 8) buffer MeshVertexBuffer {
+    vec4 mesh_vertices[]; // xyz = position
+};
+
+layout(std430, binding = 9) buffer MeshTriangleBuffer {
+    uvec4 mesh_triangles[]; // xyz = vertex indices, w = material index
+};
+#endif
+
+// Primitive references: type in the top PRIMITIVE_TYPE_BITS bits, index into its buffer below
+const uint PRIMITIVE_TYPE_SHIFT = 28u;
+const uint PRIMITIVE_INDEX_MASK = (1u << PRIMITIVE_TYPE_SHIFT) - 1u;
+const uint PRIMITIVE_SPHERE = 0u;
+const uint PRIMITIVE_QUAD = 1u;
+const uint NO_PRIMITIVE = 0xffffffffu;
+
+#ifdef MIXED_PRIMITIVES
+// Leaf ranges index primitive_refs instead of spheres
+layout(std430, binding = 10) buffer QuadBuffer {
+    Quad quads[];
+};
+
+layout(std430, binding = 11) buffer PrimitiveRefBuffer {
+    uint primitive_refs[];
+};
+#endif
+
+#ifdef NEXT_EVENT_ESTIMATION
+// Emissive spheres and quads, see GPUEmitter in emitters.h. Sorted by prim_ref, and v.w increases
+// with the index so a light can be picked by binary search.
+struct Emitter {
+    vec4 position; // sphere: center and radius, quad: corner and area
+    vec4 u;        // quad edge, w = probability of picking this emitter
+    vec4 v;        // quad edge, w = probability of picking this emitter or one before it
+    vec3 radiance;
+    uint prim_ref;
+};
+
+layout(std430, binding = 13) buffer EmitterBuffer {
+    Emitter emitters[];
+};
+#endif
+
+#ifdef TRAVERSAL_STATS
+layout(std430, binding = 4) buffer TraversalStatsBuffer {
+    uint total_node_visits;
+    uint total_traversals;
+};
+#endif
 
 /* Constants */
 
-const float MAT_LAMBERTIAN = 0.0;
-const float MAT_METAL = 1.0;
-const float MAT_DIELECTRIC = 2.0;
-const float MAT_EMISSIVE = 3.0;
+const uint MAT_LAMBERTIAN = 0u;
+const uint MAT_METAL = 1u;
+const uint MAT_DIELECTRIC = 2u;
+const uint MAT_EMISSIVE = 3u;
 
 const float infinity = 1./0.;
 const float PI = 3.1415926535897932384626433832795;
 
 
+Material get_material(uint index) {
+#ifdef PACKED_MATERIALS
+    uvec4 p = packed_mats[index];
+    vec2 colorRG = unpackHalf2x16(p.x);
+    vec2 colorBParameter = unpackHalf2x16(p.y);
+    Material mat;
+    mat.color = vec3(colorRG, colorBParameter.x);
+    mat.fuzz = colorBParameter.y;
+    mat.refractive_index = colorBParameter.y;
+    mat.emission = vec3(unpackHalf2x16(p.z), unpackHalf2x16(p.w).x);
+    mat.type = p.w >> 16;
+    return mat;
+#else
+    return mats[index];
+#endif
+}
+
+
 /* Helper Math Functions */
 
 // The state must be initialized to non-zero value
@@ -118,23 +292,20 @@ float RandomBilateral(inout uint state) {
     return 2.0f * RandomUnilateral(state) - 1.0f;
 }
 
-vec3 random_vec3(uint state) {
+vec3 random_vec3(inout uint state) {
     return vec3(RandomBilateral(state), RandomBilateral(state), RandomBilateral(state));
 }
 
 
-vec3 random_unit_vector(uint state) {
-    vec3 p;
-    float lensq;
-    do {
-        p = random_vec3(state);
-        lensq = dot(p, p);
-    } while (lensq <= 1e-160 || lensq > 1.0);
-    
-    return p / sqrt(lensq);
+// Uniform on the sphere from a uniform height and angle, without a rejection loop that diverges
+vec3 random_unit_vector(inout uint state) {
+    float z = RandomBilateral(state);
+    float phi = 2.0 * PI * RandomUnilateral(state);
+    float r = sqrt(max(1.0 - z * z, 0.0));
+    return vec3(r * cos(phi), r * sin(phi), z);
 }
 
-vec3 random_on_hemisphere(uint state, vec3 normal) {
+vec3 random_on_hemisphere(inout uint state, vec3 normal) {
     vec3 direction = random_unit_vector(state);
     return (dot(direction, normal) > 0.0) ? direction : -direction;
 }
@@ -148,11 +319,12 @@ bool set_face_normal(in Ray ray, in vec3 outward_normal, inout HitRecord hit_rec
     return true;
 }
 
-bool hit_sphere(in Ray r, in Sphere s, float ray_tmin, float ray_tmax, inout HitRecord hit_rec) {
-    vec3 oc = s.position - r.origin; 
+// Sphere given as center and radius, sets everything but the material
+bool hit_sphere(in Ray r, in vec4 s, float ray_tmin, float ray_tmax, inout HitRecord hit_rec) {
+    vec3 oc = s.xyz - r.origin; 
     float a = dot(r.direction, r.direction);
     float h = dot(oc, r.direction);
-    float c = dot(oc, oc) - s.radius * s.radius; 
+    float c = dot(oc, oc) - s.w * s.w; 
     
     float discriminant = h * h - a * c;
     if (discriminant < 0.0) 
@@ -168,50 +340,102 @@ bool hit_sphere(in Ray r, in Sphere s, float ray_tmin, float ray_tmax, inout Hit
     
     hit_rec.t = root;
     hit_rec.point = r.origin + hit_rec.t * r.direction ;
-    hit_rec.normal = normalize(hit_rec.point - s.position);
-    hit_rec.mat_index = s.material_index;
+    hit_rec.normal = normalize(hit_rec.point - s.xyz);
     set_face_normal(r, hit_rec.normal, hit_rec);
 
     return true;
 }
 
-bool hit_quad(in Ray r, in Quad q, inout HitRecord hit_rec) {
-    // constants of the quad for intersection calculations
-    vec3 u = q.u;
-    vec3 v = q.v;
-    vec3 n = cross(u, v);
-    vec3 normal = normalize(n);
-    float D = dot(normal, q.corner_point);
-    vec3 w = n / dot(n, n);
+bool hit_sphere(in Ray r, in Sphere s, float ray_tmin, float ray_tmax, inout HitRecord hit_rec) {
+    if (!hit_sphere(r, vec4(s.position, s.radius), ray_tmin, ray_tmax, hit_rec))
+        return false;
+    hit_rec.mat_index = s.material_index;
+    return true;
+}
+
+// Sphere i of the sphere buffer in either layout. With SPHERE_SOA the material stays pending until
+// resolve_material, so rejected candidates never touch the material buffer.
+bool hit_sphere_index(in Ray r, uint i, float ray_tmin, float ray_tmax, inout HitRecord hit_rec) {
+#ifdef SPHERE_SOA
+    if (!hit_sphere(r, sphere_geometry[i], ray_tmin, ray_tmax, hit_rec))
+        return false;
+    hit_rec.mat_index = i | SPHERE_MATERIAL_PENDING;
+#else
+    if (!hit_sphere(r, spheres[i], ray_tmin, ray_tmax, hit_rec))
+        return false;
+#endif
+    hit_rec.prim_ref = i; // PRIMITIVE_SPHERE is 0
+    return true;
+}
+
+void resolve_material(inout HitRecord hit_rec) {
+#ifdef SPHERE_SOA
+    if ((hit_rec.mat_index & SPHERE_MATERIAL_PENDING) != 0u)
+        hit_rec.mat_index = sphere_materials[hit_rec.mat_index & ~SPHERE_MATERIAL_PENDING];
+#endif
+}
+
+#ifdef TRIANGLES
+// Moller-Trumbore: solves for the barycentrics and t at once with a few cross and dot products,
+// without computing the triangle's plane first
+bool hit_triangle(in Ray r, in uvec4 tri, float ray_tmin, float ray_tmax, inout HitRecord hit_rec) {
+    vec3 v0 = mesh_vertices[tri.x].xyz;
+    vec3 edge1 = mesh_vertices[tri.y].xyz - v0;
+    vec3 edge2 = mesh_vertices[tri.z].xyz - v0;
+
+    vec3 p = cross(r.direction, edge2);
+    float det = dot(edge1, p);
+    if (det == 0.0) // ray parallel to the triangle
+        return false;
+    float inv_det = 1.0 / det;
+
+    vec3 s = r.origin - v0;
+    float u = dot(s, p) * inv_det;
+    if (u < 0.0 || u > 1.0)
+        return false;
+
+    vec3 q = cross(s, edge1);
+    float v = dot(r.direction, q) * inv_det;
+    if (v < 0.0 || u + v > 1.0)
+        return false;
+
+    float t = dot(edge2, q) * inv_det;
+    if (t < ray_tmin || t > ray_tmax)
+        return false;
+
+    hit_rec.t = t;
+    hit_rec.point = r.origin + t * r.direction;
+    hit_rec.mat_index = tri.w;
+    hit_rec.prim_ref = NO_PRIMITIVE;
+    set_face_normal(r, normalize(cross(edge1, edge2)), hit_rec);
+    return true;
+}
+#endif
 
-    float denom = dot(normal, r.direction);
+// Two sided, the plane gives t and the projections of the hit point give the quad coordinates
+bool hit_quad(in Ray r, in Quad q, float ray_tmin, float ray_tmax, inout HitRecord hit_rec) {
+    float denom = dot(q.normal, r.direction);
 
     // Ray is parallel to quad
-    if (denom < 0.00001){
+    if (abs(denom) < 1e-8)
         return false;
-    }
 
-    float t = (D - dot(normal, r.origin)) / denom;
-    if (t < 0.00001){
+    float t = (q.D - dot(q.normal, r.origin)) / denom;
+    if (t < ray_tmin || t > ray_tmax)
         return false;
-    }
 
     // determine if hit point lies within planar shape
-    vec3 intersection = r.origin + hit_rec.t * r.direction; 
+    vec3 intersection = r.origin + t * r.direction;
     vec3 planar_hitpt_vector = intersection - q.corner_point;
-    float alpha = dot(w, cross(planar_hitpt_vector, v));
-    float beta = dot(w, cross(u, planar_hitpt_vector));
-
-    // check if hit point is outside planar 
-    if ((alpha) < 0.0 || (alpha) > 1.0 || (beta) < 0.0 || (beta) > 1.0){
+    float alpha = dot(planar_hitpt_vector, q.uAxis);
+    float beta = dot(planar_hitpt_vector, q.vAxis);
+    if (alpha < 0.0 || alpha > 1.0 || beta < 0.0 || beta > 1.0)
         return false;
-    }
 
     hit_rec.t = t;
     hit_rec.point = intersection;
-    hit_rec.normal = normal;
     hit_rec.mat_index = q.material_index;
-    set_face_normal(r, hit_rec.normal, hit_rec);
+    set_face_normal(r, q.normal, hit_rec);
 
     return true;
 }
@@ -227,8 +451,7 @@ bool world_hit(in Ray r, in float ray_tmin,  in float ray_tmax, inout HitRecord
     bool hit_anything = false;
     float closest_so_far = ray_tmax;
     for (int i = 0; i < num_objects; i++) {
-        Sphere s = spheres[i];
-        if (hit_sphere(r, s, ray_tmin, closest_so_far, temp_rec)) {
+        if (hit_sphere_index(r, uint(i), ray_tmin, closest_so_far, temp_rec)) {
             if (temp_rec.t < closest_so_far){
                 hit_anything = true;
                 closest_so_far = temp_rec.t;
@@ -236,10 +459,13 @@ bool world_hit(in Ray r, in float ray_tmin,  in float ray_tmax, inout HitRecord
             }
         }
     }
+    if (hit_anything)
+        resolve_material(hit_rec);
     return hit_anything;
 }
 
-bool intersect_aabb(in Ray r, in vec3 min_b, in vec3 max_b, in vec3 inv_dir) {
+// Entry distance of the ray into the box, or infinity if it misses or enters beyond t_max
+float intersect_aabb_dist(in Ray r, in vec3 min_b, in vec3 max_b, in vec3 inv_dir, in float t_max) {
     vec3 tmin = (min_b - r.origin) * inv_dir;
     vec3 tmax = (max_b - r.origin) * inv_dir;
     
@@ -249,29 +475,224 @@ bool intersect_aabb(in Ray r, in vec3 min_b, in vec3 max_b, in vec3 inv_dir) {
     float t_near = max(max(t1.x, t1.y), t1.z);
     float t_far = min(min(t2.x, t2.y), t2.z);
     
-    return t_near < t_far && t_far > 0.0f;
+    return (t_near < t_far && t_far > 0.0f && t_near < t_max) ? max(t_near, 0.0) : infinity;
+}
+
+bool intersect_aabb(in Ray r, in vec3 min_b, in vec3 max_b, in vec3 inv_dir, in float t_max) {
+    return intersect_aabb_dist(r, min_b, max_b, inv_dir, t_max) < infinity;
+}
+
+// Per invocation count of BVH nodes tested, flushed to TraversalStatsBuffer once per pixel
+uint node_visits = 0u;
+uint traversals = 0u;
+#ifdef TRAVERSAL_STATS
+#define COUNT_NODE_VISITS(n) node_visits += uint(n)
+#else
+#define COUNT_NODE_VISITS(n)
+#endif
+
+// Primitive i of a leaf range: a sphere, or with MIXED_PRIMITIVES whatever primitive_refs[i] references
+bool hit_primitive(in Ray r, in int i, in float tMin, in float tMax, inout HitRecord hit) {
+#ifdef MIXED_PRIMITIVES
+    uint ref = primitive_refs[i];
+    uint index = ref & PRIMITIVE_INDEX_MASK;
+    if ((ref >> PRIMITIVE_TYPE_SHIFT) == PRIMITIVE_QUAD) {
+        if (!hit_quad(r, quads[index], tMin, tMax, hit))
+            return false;
+        hit.prim_ref = ref;
+        return true;
+    }
+    return hit_sphere_index(r, index, tMin, tMax, hit);
+#else
+    return hit_sphere_index(r, uint(i), tMin, tMax, hit);
+#endif
+}
+
+// Tests the primitives of a leaf, shrinking closest on every hit
+bool hit_leaf(in Ray r, in int first, in int count, in float tMin, inout float closest, inout HitRecord hit) {
+    bool hitSomething = false;
+    for (int i = first; i < first + count; i++) {
+        HitRecord temp;
+        if (hit_primitive(r, i, tMin, closest, temp)) {
+            closest = temp.t;
+            hit = temp;
+            hitSomething = true;
+        }
+    }
+    return hitSomething;
+}
+
+// Shadow ray version of hit_leaf: any hit in (tMin, tMax) will do
+bool any_hit_leaf(in Ray r, in int first, in int count, in float tMin, in float tMax) {
+    for (int i = first; i < first + count; i++) {
+        HitRecord temp;
+        if (hit_primitive(r, i, tMin, tMax, temp))
+            return true;
+    }
+    return false;
+}
+
+
+#if BVH_WIDTH > 2
+// Sized by the host from the depth of the collapsed tree (wideStackSize), so a push never finds it full
+#ifndef WIDE_STACK_SIZE
+#error WIDE_STACK_SIZE must be defined for wide BVHs
+#endif
+
+#ifdef BVH_QUANTIZED
+#define WideNode BVHNodeQuantized
+
+uint unpack_byte(uint word, int index) {
+    return bitfieldExtract(word, (index & 3) * 8, 8);
+}
+
+void wide_child_bounds(in BVHNodeQuantized node, int i, out vec3 minB, out vec3 maxB) {
+    int exponents = int(node.exponents);
+    ivec3 exponent = ivec3(bitfieldExtract(exponents, 0, 8), bitfieldExtract(exponents, 8, 8), bitfieldExtract(exponents, 16, 8));
+    ivec3 byteIndex = ivec3(0, BVH_WIDTH, 2 * BVH_WIDTH) + i;
+    uvec3 qMin = uvec3(unpack_byte(node.qMin[byteIndex.x >> 2], byteIndex.x),
+                       unpack_byte(node.qMin[byteIndex.y >> 2], byteIndex.y),
+                       unpack_byte(node.qMin[byteIndex.z >> 2], byteIndex.z));
+    uvec3 qMax = uvec3(unpack_byte(node.qMax[byteIndex.x >> 2], byteIndex.x),
+                       unpack_byte(node.qMax[byteIndex.y >> 2], byteIndex.y),
+                       unpack_byte(node.qMax[byteIndex.z >> 2], byteIndex.z));
+    // q * 2^exponent is exact, the same decode as dequantize() on the CPU
+    minB = node.origin + ldexp(vec3(qMin), exponent);
+    maxB = node.origin + ldexp(vec3(qMax), exponent);
+}
+
+int wide_child_count(in BVHNodeQuantized node, int i) {
+    return int(unpack_byte(node.counts[i >> 2], i));
+}
+#else
+#define WideNode BVHNodeWide
+
+void wide_child_bounds(in BVHNodeWide node, int i, out vec3 minB, out vec3 maxB) {
+    minB = vec3(node.minX[i], node.minY[i], node.minZ[i]);
+    maxB = vec3(node.maxX[i], node.maxY[i], node.maxZ[i]);
+}
+
+int wide_child_count(in BVHNodeWide node, int i) {
+    return node.count[i];
+}
+#endif
+
+// Wide BVH traversal with a small stack, every child of a node is tested from a single fetch.
+// With ORDERED_TRAVERSAL the children are visited nearest first, otherwise in slot order.
+bool world_hit_bvh_wide(in Ray r, in float tMin, in float tMax, inout HitRecord hit) {
+    vec3 invDir = 1.0 / r.direction;
+    bool hitSomething = false;
+    float closest = tMax;
+
+    int stackNode[WIDE_STACK_SIZE];
+    float stackDist[WIDE_STACK_SIZE];
+    int stackSize = 0;
+    stackNode[stackSize] = root_index;
+    stackDist[stackSize++] = 0.0;
+
+    while (stackSize > 0) {
+        --stackSize;
+        // Skip subtrees that start behind the closest hit found since they were pushed
+        if (stackDist[stackSize] >= closest)
+            continue;
+
+        WideNode node = wide_nodes[stackNode[stackSize]];
+        COUNT_NODE_VISITS(1);
+
+        // Hit children, sorted by entry distance when traversal is ordered
+        int hitSlot[BVH_WIDTH];
+        float hitDist[BVH_WIDTH];
+        int numHit = 0;
+        for (int i = 0; i < BVH_WIDTH; i++) {
+            if (node.child[i] < 0)
+                continue;
+
+            vec3 minB, maxB;
+            wide_child_bounds(node, i, minB, maxB);
+            float dist = intersect_aabb_dist(r, minB, maxB, invDir, closest);
+            if (dist == infinity)
+                continue;
+
+            int j = numHit++;
+#ifdef ORDERED_TRAVERSAL
+            for (; j > 0 && hitDist[j - 1] > dist; j--) {
+                hitSlot[j] = hitSlot[j - 1];
+                hitDist[j] = hitDist[j - 1];
+            }
+#endif
+            hitSlot[j] = i;
+            hitDist[j] = dist;
+        }
+
+        // Leaves are tested right away (nearest first), inner children are pushed farthest first
+        // so the nearest one is popped next
+        for (int k = 0; k < numHit; k++) {
+            int i = hitSlot[k];
+            int count = wide_child_count(node, i);
+            if (count > 0 && hitDist[k] < closest)
+                hitSomething = hit_leaf(r, node.child[i], count, tMin, closest, hit) || hitSomething;
+        }
+        for (int k = numHit - 1; k >= 0; k--) {
+            int i = hitSlot[k];
+            if (wide_child_count(node, i) == 0 && stackSize < WIDE_STACK_SIZE) {
+                stackNode[stackSize] = node.child[i];
+                stackDist[stackSize++] = hitDist[k];
+            }
+        }
+    }
+    return hitSomething;
 }
 
+// Any hit version of world_hit_bvh_wide for shadow rays: no ordering and no closest hit, the first
+// primitive hit ends the traversal
+bool occluded_bvh_wide(in Ray r, in float tMin, in float tMax) {
+    vec3 invDir = 1.0 / r.direction;
+
+    int stackNode[WIDE_STACK_SIZE];
+    int stackSize = 0;
+    stackNode[stackSize++] = root_index;
+
+    while (stackSize > 0) {
+        WideNode node = wide_nodes[stackNode[--stackSize]];
+        COUNT_NODE_VISITS(1);
 
+        for (int i = 0; i < BVH_WIDTH; i++) {
+            if (node.child[i] < 0)
+                continue;
+
+            vec3 minB, maxB;
+            wide_child_bounds(node, i, minB, maxB);
+            if (!intersect_aabb(r, minB, maxB, invDir, tMax))
+                continue;
+
+            int count = wide_child_count(node, i);
+            if (count > 0) {
+                if (any_hit_leaf(r, node.child[i], count, tMin, tMax))
+                    return true;
+            }
+            else if (stackSize < WIDE_STACK_SIZE) {
+                stackNode[stackSize++] = node.child[i];
+            }
+        }
+    }
+    return false;
+}
+#else
 // BVH traversal intersection using pointers
-bool world_hit_aabb_stackless(in Ray r, in float tMin, in float tMax, inout HitRecord hit) {
+bool world_hit_aabb_stackless(in Ray r, in int root, in float tMin, in float tMax, inout HitRecord hit) {
     vec3 invDir = 1.0 / r.direction;
-    int idx = root_index;
+    int idx = root;
     bool hitSomething = false;
     float closest = tMax;
     
     while(idx >= 0) {
         BVHNodeFlat node = nodes[idx];
-        if (intersect_aabb(r, node.aabbMin.xyz, node.aabbMax.xyz, invDir)) {
+        COUNT_NODE_VISITS(1);
+        if (intersect_aabb(r, node.aabbMin.xyz, node.aabbMax.xyz, invDir, closest)) {
             // Check if leaf
             if (node.meta.z != -1) {
-                Sphere s = spheres[node.meta.z];
-                HitRecord temp;
-                if (hit_sphere(r, s, tMin, closest, temp)) {
-                    closest = temp.t;
-                    hit = temp;
-                    hitSomething = true;
-                }
+                // Leaf: test its contiguous range of spheres
+                hitSomething = hit_leaf(r, node.meta.z, node.meta.y, tMin, closest, hit) || hitSomething;
                 idx = node.meta.w; // move to next node using the next pointer
             }
             else {
@@ -285,6 +706,263 @@ bool world_hit_aabb_stackless(in Ray r, in float tMin, in float tMax, inout HitR
     return hitSomething;
 }
 
+const int TRAVERSAL_STACK_SIZE = 64;
+
+// Front to back traversal with a short stack: both children are tested, the nearer one is visited
+// first and the farther one is pushed with its entry distance. Once a hit is found, pending subtrees
+// that start behind it are dropped without being fetched. Trees deeper than the stack (rebuilt or GPU
+// built ones can be) finish with a stackless pass, so a far child that didn't fit is never lost.
+bool world_hit_bvh_ordered(in Ray r, in int rootIndex, in float tMin, in float tMax, inout HitRecord hit) {
+    vec3 invDir = 1.0 / r.direction;
+    bool hitSomething = false;
+    float closest = tMax;
+
+    int stackNode[TRAVERSAL_STACK_SIZE];
+    float stackDist[TRAVERSAL_STACK_SIZE];
+    int stackSize = 0;
+    bool overflowed = false;
+
+    BVHNodeFlat root = nodes[rootIndex];
+    COUNT_NODE_VISITS(1);
+    int idx = intersect_aabb(r, root.aabbMin.xyz, root.aabbMax.xyz, invDir, closest) ? rootIndex : -1;
+
+    while (idx >= 0) {
+        BVHNodeFlat node = nodes[idx];
+        idx = -1;
+
+        if (node.meta.z != -1) {
+            hitSomething = hit_leaf(r, node.meta.z, node.meta.y, tMin, closest, hit) || hitSomething;
+        }
+        else {
+            BVHNodeFlat left = nodes[node.meta.x];
+            BVHNodeFlat right = nodes[node.meta.y];
+            COUNT_NODE_VISITS(2);
+            float distLeft = intersect_aabb_dist(r, left.aabbMin.xyz, left.aabbMax.xyz, invDir, closest);
+            float distRight = intersect_aabb_dist(r, right.aabbMin.xyz, right.aabbMax.xyz, invDir, closest);
+
+            int nearChild = node.meta.x, farChild = node.meta.y;
+            float nearDist = distLeft, farDist = distRight;
+            if (distRight < distLeft) {
+                nearChild = node.meta.y; farChild = node.meta.x;
+                nearDist = distRight; farDist = distLeft;
+            }
+
+            if (nearDist < infinity) {
+                idx = nearChild;
+                if (farDist < infinity) {
+                    if (stackSize < TRAVERSAL_STACK_SIZE) {
+                        stackNode[stackSize] = farChild;
+                        stackDist[stackSize++] = farDist;
+                    }
+                    else {
+                        overflowed = true;
+                    }
+                }
+            }
+        }
+
+        // Nothing to descend into, pop the next pending subtree that still starts before the closest hit
+        while (idx < 0 && stackSize > 0) {
+            --stackSize;
+            if (stackDist[stackSize] < closest)
+                idx = stackNode[stackSize];
+        }
+    }
+
+    // The skip links cover the whole tree, so a stackless pass up to the closest hit finds whatever
+    // the dropped subtrees held
+    if (overflowed)
+        hitSomething = world_hit_aabb_stackless(r, rootIndex, tMin, closest, hit) || hitSomething;
+    return hitSomething;
+}
+
+// Binary BVH traversal starting at root, used for the whole scene or for one BLAS
+bool world_hit_blas(in Ray r, in int root, in float tMin, in float tMax, inout HitRecord hit) {
+#ifdef ORDERED_TRAVERSAL
+    return world_hit_bvh_ordered(r, root, tMin, tMax, hit);
+#else
+    return world_hit_aabb_stackless(r, root, tMin, tMax, hit);
+#endif
+}
+
+// Any hit version of world_hit_aabb_stackless for shadow rays. Order doesn't matter when any hit
+// will do, so the skip links serve ORDERED_TRAVERSAL builds too.
+bool occluded_blas(in Ray r, in int root, in float tMin, in float tMax) {
+    vec3 invDir = 1.0 / r.direction;
+    int idx = root;
+
+    while (idx >= 0) {
+        BVHNodeFlat node = nodes[idx];
+        COUNT_NODE_VISITS(1);
+        if (!intersect_aabb(r, node.aabbMin.xyz, node.aabbMax.xyz, invDir, tMax)) {
+            idx = node.meta.w;
+            continue;
+        }
+        if (node.meta.z == -1) {
+            idx = node.meta.x;
+            continue;
+        }
+        if (any_hit_leaf(r, node.meta.z, node.meta.y, tMin, tMax))
+            return true;
+        idx = node.meta.w;
+    }
+    return false;
+}
+#endif
+
+#ifdef INSTANCING
+// Stackless traversal of the TLAS. At a leaf the ray is moved into the object space of each instance
+// and traverses that object's BLAS. The object space direction isn't normalized, so t is the same in
+// both spaces and closest carries over between instances.
+bool world_hit_tlas(in Ray r, in float tMin, in float tMax, inout HitRecord hit) {
+    vec3 invDir = 1.0 / r.direction;
+    int idx = 0;
+    bool hitSomething = false;
+    float closest = tMax;
+
+    while (idx >= 0) {
+        BVHNodeFlat node = tlas_nodes[idx];
+        COUNT_NODE_VISITS(1);
+        if (!intersect_aabb(r, node.aabbMin.xyz, node.aabbMax.xyz, invDir, closest)) {
+            idx = node.meta.w;
+            continue;
+        }
+        if (node.meta.z == -1) {
+            idx = node.meta.x;
+            continue;
+        }
+
+        for (int i = node.meta.z; i < node.meta.z + node.meta.y; i++) {
+            Instance instance = instances[i];
+            Ray objectRay;
+            objectRay.origin = (instance.worldToObject * vec4(r.origin, 1.0)).xyz;
+            objectRay.direction = (instance.worldToObject * vec4(r.direction, 0.0)).xyz;
+
+            HitRecord objectHit;
+            if (world_hit_blas(objectRay, instance.blasRoot, tMin, closest, objectHit)) {
+                closest = objectHit.t;
+                hit = objectHit;
+                hit.point = r.origin + objectHit.t * r.direction;
+                // Normals transform with the inverse transpose, which keeps their side relative to the ray
+                hit.normal = normalize(transpose(mat3(instance.worldToObject)) * objectHit.normal);
+                hitSomething = true;
+            }
+        }
+        idx = node.meta.w;
+    }
+    return hitSomething;
+}
+#endif
+
+#ifdef TRIANGLES
+// Stackless traversal of the mesh BVH, same layout as the sphere BVH with leaves indexing triangles
+bool world_hit_mesh(in Ray r, in float tMin, in float tMax, inout HitRecord hit) {
+    vec3 invDir = 1.0 / r.direction;
+    int idx = 0;
+    bool hitSomething = false;
+    float closest = tMax;
+
+    while (idx >= 0) {
+        BVHNodeFlat node = mesh_nodes[idx];
+        COUNT_NODE_VISITS(1);
+        if (!intersect_aabb(r, node.aabbMin.xyz, node.aabbMax.xyz, invDir, closest)) {
+            idx = node.meta.w;
+            continue;
+        }
+        if (node.meta.z == -1) {
+            idx = node.meta.x;
+            continue;
+        }
+
+        for (int i = node.meta.z; i < node.meta.z + node.meta.y; i++) {
+            HitRecord temp;
+            if (hit_triangle(r, mesh_triangles[i], tMin, closest, temp)) {
+                closest = temp.t;
+                hit = temp;
+                hitSomething = true;
+            }
+        }
+        idx = node.meta.w;
+    }
+    return hitSomething;
+}
+
+// Any hit version of world_hit_mesh for shadow rays
+bool occluded_mesh(in Ray r, in float tMin, in float tMax) {
+    vec3 invDir = 1.0 / r.direction;
+    int idx = 0;
+
+    while (idx >= 0) {
+        BVHNodeFlat node = mesh_nodes[idx];
+        COUNT_NODE_VISITS(1);
+        if (!intersect_aabb(r, node.aabbMin.xyz, node.aabbMax.xyz, invDir, tMax)) {
+            idx = node.meta.w;
+            continue;
+        }
+        if (node.meta.z == -1) {
+            idx = node.meta.x;
+            continue;
+        }
+
+        for (int i = node.meta.z; i < node.meta.z + node.meta.y; i++) {
+            HitRecord temp;
+            if (hit_triangle(r, mesh_triangles[i], tMin, tMax, temp))
+                return true;
+        }
+        idx = node.meta.w;
+    }
+    return false;
+}
+#endif
+
+// Traversal used by the path tracer, picked at compile time by BVH_WIDTH, ORDERED_TRAVERSAL, INSTANCING
+// and TRIANGLES
+bool world_hit_bvh(in Ray r, in float tMin, in float tMax, inout HitRecord hit) {
+#ifdef TRAVERSAL_STATS
+    traversals++;
+#endif
+#if BVH_WIDTH > 2
+    bool hitSomething = world_hit_bvh_wide(r, tMin, tMax, hit);
+#elif defined(INSTANCING)
+    bool hitSomething = world_hit_tlas(r, tMin, tMax, hit);
+#else
+    bool hitSomething = world_hit_blas(r, root_index, tMin, tMax, hit);
+#endif
+#ifdef TRIANGLES
+    // The mesh only has to beat the closest sphere
+    if (world_hit_mesh(r, tMin, hitSomething ? hit.t : tMax, hit))
+        hitSomething = true;
+#endif
+    if (hitSomething)
+        resolve_material(hit);
+    return hitSomething;
+}
+
+#ifdef NEXT_EVENT_ESTIMATION
+#ifdef INSTANCING
+#error "NEXT_EVENT_ESTIMATION needs emitters in world space, it can't be combined with INSTANCING"
+#endif
+
+// Whether anything lies on the ray between tMin and tMax, for shadow rays
+bool occluded(in Ray r, in float tMin, in float tMax) {
+#ifdef TRAVERSAL_STATS
+    traversals++;
+#endif
+#if BVH_WIDTH > 2
+    if (occluded_bvh_wide(r, tMin, tMax))
+        return true;
+#else
+    if (occluded_blas(r, root_index, tMin, tMax))
+        return true;
+#endif
+#ifdef TRIANGLES
+    if (occluded_mesh(r, tMin, tMax))
+        return true;
+#endif
+    return false;
+}
+#endif
+
 
 float reflectance(float cosine, float ref_idx) {
     // Schlick's approximation
@@ -294,9 +972,9 @@ float reflectance(float cosine, float ref_idx) {
     return r0 + (1.0 - r0) * pow(1.0 - cosine, 5.0);
 }
 
-bool scatter(uint state, in Ray ray_in, in HitRecord hit_rec, inout vec3 matColor, inout Ray scattered) {
-    Material mat = mats[hit_rec.mat_index];
-    float type = mat.type;
+bool scatter(inout uint state, in Ray ray_in, in HitRecord hit_rec, inout vec3 matColor, inout Ray scattered) {
+    Material mat = get_material(hit_rec.mat_index);
+    uint type = mat.type;
 
     if (type == MAT_EMISSIVE) {
         // Emissive materials don't scatter
@@ -368,7 +1046,7 @@ vec3 ray_color(in Ray ray, uint max_bounces, inout uint state) {
         if (world_hit(current_ray, 0.001, infinity, hit_rec)) {
             Ray scattered;
             vec3 matColor;
-            vec3 emitted = mats[hit_rec.mat_index].emission;
+            vec3 emitted = get_material(hit_rec.mat_index).emission;
 
             if (scatter(state, current_ray, hit_rec, matColor, scattered)) {
                 accumulated_color *= matColor;
@@ -407,10 +1085,10 @@ vec3 ray_color2(in Ray ray, uint max_bounces, inout uint state) {
 
     for (int bounce = 0; bounce < max_bounces; bounce++) {
         HitRecord hit_rec;
-        if (world_hit_aabb_stackless(current_ray, 0.001, infinity, hit_rec)) {
+        if (world_hit_bvh(current_ray, 0.001, infinity, hit_rec)) {
             Ray scattered;
             vec3 matColor;
-            vec3 emitted = mats[hit_rec.mat_index].emission;
+            vec3 emitted = get_material(hit_rec.mat_index).emission;
 
             if (scatter(state, current_ray, hit_rec, matColor, scattered)) {
                 accumulated_color *= matColor;
@@ -437,10 +1115,186 @@ vec3 ray_color2(in Ray ray, uint max_bounces, inout uint state) {
     return final_color; // max depth reached
 }
 
+#ifdef NEXT_EVENT_ESTIMATION
+// Orthonormal basis around the unit vector n, branchless (Duff et al. 2017)
+void orthonormal_basis(vec3 n, out vec3 b1, out vec3 b2) {
+    float sgn = n.z >= 0.0 ? 1.0 : -1.0;
+    float a = -1.0 / (sgn + n.z);
+    float b = n.x * n.y * a;
+    b1 = vec3(1.0 + sgn * n.x * n.x * a, sgn * b, -sgn * n.x);
+    b2 = vec3(b, sgn + n.y * n.y * a, -n.y);
+}
+
+float power_heuristic(float pdf, float other_pdf) {
+    float a = pdf * pdf;
+    return a / (a + other_pdf * other_pdf);
+}
+
+// 1 - cos of the half angle of the cone a sphere at squared distance dist2 fills, written so it keeps
+// its precision for small or distant spheres
+float sphere_cone_one_minus_cos(float radius, float dist2) {
+    float sin2 = radius * radius / dist2;
+    return sin2 / (1.0 + sqrt(max(1.0 - sin2, 0.0)));
+}
+
+// Emitter whose slice of the cumulative probabilities contains u
+int select_emitter(float u) {
+    int lo = 0, hi = num_emitters - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (emitters[mid].v.w <= u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Emitter of the primitive, -1 if it isn't one
+int find_emitter(uint prim_ref) {
+    int lo = 0, hi = num_emitters - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        uint ref = emitters[mid].prim_ref;
+        if (ref == prim_ref)
+            return mid;
+        if (ref < prim_ref)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+// Solid angle density with which sample_direct_light, called at origin, would have picked the point
+// hit_rec on emitter e
+float emitter_pdf(int e, vec3 origin, in HitRecord hit_rec) {
+    Emitter em = emitters[e];
+    if ((em.prim_ref >> PRIMITIVE_TYPE_SHIFT) == PRIMITIVE_QUAD) {
+        vec3 to_light = hit_rec.point - origin;
+        float dist2 = dot(to_light, to_light);
+        float cos_light = abs(dot(hit_rec.normal, to_light)) * inversesqrt(dist2);
+        return em.u.w * dist2 / max(cos_light * em.position.w, 1e-8);
+    }
+    vec3 to_center = em.position.xyz - origin;
+    float dist2 = dot(to_center, to_center);
+    if (dist2 <= em.position.w * em.position.w)
+        return 0.0;
+    return em.u.w / (2.0 * PI * sphere_cone_one_minus_cos(em.position.w, dist2));
+}
+
+// Light reaching a Lambertian surface of color albedo at hit_rec from one emitter, picked in proportion
+// to its power. Quads are sampled by area, spheres by the cone they fill. The shadow ray stops just
+// short of the sampled point. With mis the result is weighted against the BSDF sample of the next bounce.
+vec3 sample_direct_light(in HitRecord hit_rec, vec3 albedo, bool mis, inout uint state) {
+    Emitter em = emitters[select_emitter(RandomUnilateral(state))];
+    float u1 = RandomUnilateral(state);
+    float u2 = RandomUnilateral(state);
+
+    vec3 dir;
+    float dist;
+    float light_pdf;
+    if ((em.prim_ref >> PRIMITIVE_TYPE_SHIFT) == PRIMITIVE_QUAD) {
+        vec3 to_light = em.position.xyz + u1 * em.u.xyz + u2 * em.v.xyz - hit_rec.point;
+        float dist2 = dot(to_light, to_light);
+        dist = sqrt(dist2);
+        dir = to_light / dist;
+        float cos_light = abs(dot(normalize(cross(em.u.xyz, em.v.xyz)), dir));
+        if (cos_light < 1e-6)
+            return vec3(0.0);
+        light_pdf = dist2 / (cos_light * em.position.w);
+    }
+    else {
+        vec3 to_center = em.position.xyz - hit_rec.point;
+        float dist2 = dot(to_center, to_center);
+        if (dist2 <= em.position.w * em.position.w)
+            return vec3(0.0);
+        float one_minus_cos_max = sphere_cone_one_minus_cos(em.position.w, dist2);
+        float cos_theta = 1.0 - u1 * one_minus_cos_max;
+        float sin_theta = sqrt(max(1.0 - cos_theta * cos_theta, 0.0));
+        float phi = 2.0 * PI * u2;
+        vec3 w = to_center * inversesqrt(dist2);
+        vec3 b1, b2;
+        orthonormal_basis(w, b1, b2);
+        dir = normalize(cos_theta * w + sin_theta * (cos(phi) * b1 + sin(phi) * b2));
+
+        HitRecord light_hit;
+        if (!hit_sphere(Ray(hit_rec.point, dir), em.position, 0.0, infinity, light_hit))
+            return vec3(0.0);
+        dist = light_hit.t;
+        light_pdf = 1.0 / (2.0 * PI * one_minus_cos_max);
+    }
+    light_pdf *= em.u.w;
+
+    float cos_surface = dot(hit_rec.normal, dir);
+    if (cos_surface <= 0.0)
+        return vec3(0.0);
+    if (occluded(Ray(hit_rec.point, dir), 0.001, dist * (1.0 - 1e-4)))
+        return vec3(0.0);
+
+    float weight = mis ? power_heuristic(light_pdf, cos_surface / PI) : 1.0;
+    return albedo / PI * em.radiance * cos_surface * weight / light_pdf;
+}
+
+// ray_color2 with next event estimation at Lambertian hits. Emitters found by the BSDF sample of a
+// Lambertian bounce are MIS weighted against the light sample taken there, after specular bounces and
+// from the camera they count fully since no light sample covered them.
+vec3 ray_color_nee(in Ray ray, uint max_bounces, inout uint state) {
+    vec3 accumulated_color = vec3(1.0);
+    vec3 final_color = vec3(0.0);
+    Ray current_ray = ray;
+
+    float bsdf_pdf = 0.0; // density of the last bounce direction, 0 if no light sample competed with it
+    vec3 bounce_origin = ray.origin;
+
+    for (int bounce = 0; bounce < max_bounces; bounce++) {
+        HitRecord hit_rec;
+        if (!world_hit_bvh(current_ray, 0.001, infinity, hit_rec)) {
+            vec3 unit_direction = normalize(current_ray.direction);
+            float blend = 0.5 * (unit_direction.y + 1.0);
+            vec3 background_color = mix(vec3(1.0), vec3(0.5, 0.7, 1.0), blend);
+            final_color += accumulated_color * background_color;
+            break;
+        }
+
+        Material mat = get_material(hit_rec.mat_index);
+        if (mat.type == MAT_EMISSIVE) {
+            float weight = 1.0;
+            if (bsdf_pdf > 0.0) {
+                int e = find_emitter(hit_rec.prim_ref);
+                if (e >= 0)
+                    weight = power_heuristic(bsdf_pdf, emitter_pdf(e, bounce_origin, hit_rec));
+            }
+            final_color += accumulated_color * mat.color * mat.emission * weight;
+            break;
+        }
+
+        // The last bounce has no BSDF sample to share the light with, so its light sample counts fully
+        bool diffuse = mat.type == MAT_LAMBERTIAN && num_emitters > 0;
+        if (diffuse)
+            final_color += accumulated_color * sample_direct_light(hit_rec, mat.color, bounce + 1 < max_bounces, state);
+
+        Ray scattered;
+        vec3 matColor;
+        if (!scatter(state, current_ray, hit_rec, matColor, scattered))
+            break;
+        accumulated_color *= matColor;
+        bsdf_pdf = diffuse ? max(dot(scattered.direction, hit_rec.normal), 0.0) / PI : 0.0;
+        bounce_origin = hit_rec.point;
+        current_ray = scattered;
+
+        // end early if contribution is below a threshold
+        if (!(length(accumulated_color) > 0.001))
+            break;
+    }
+    return final_color;
+}
+#endif
+
 
-vec3 sample_square(uint state) {
+vec3 sample_square(inout uint state) {
     // Returns the vector to a random point in the [-.5,-.5]-[+.5,+.5] unit square.
-    return vec3(RandomBilateral(state) - 0.5, RandomBilateral(state) - 0.5 , 0);
+    return vec3(RandomUnilateral(state) - 0.5, RandomUnilateral(state) - 0.5 , 0);
 }
 
 
@@ -488,52 +1342,41 @@ vec2 sample_disk(inout uint state) {
 }
 
 
-void main() {
-    uint x = gl_GlobalInvocationID.x;
-    uint y = gl_GlobalInvocationID.y;
-    ivec2 pixel_coords = ivec2(gl_GlobalInvocationID.xy);
-
-    uint width = uint(imageDimensions.x);
-    uint height = uint(imageDimensions.y);
-
-    uint random_state = time * (x + y * 36) + 1;
-
-    vec2 inv_resolution = 1.0 / vec2(width, height);
+// Camera ray through a jittered point of the pixel, from a point of the lens
+Ray camera_ray(ivec2 pixel_coords, inout uint random_state) {
+    vec2 inv_resolution = 1.0 / imageDimensions;
     vec3 camera_right = vec3(invViewMatrix[0].xyz);
     vec3 camera_up    = vec3(invViewMatrix[1].xyz);
     float lens_radius = tan(radians(defocus_angle * 0.5)) * focus_distance;
 
-    vec3 pixel_color = vec3(0.0);
-    
-    for (int s = 0; s < samples_per_pixel; ++s) {
-        // Subpixel jitter
-        vec2 offset = sample_square(random_state).xy;  
-        vec2 uv = (vec2(pixel_coords) + offset) * inv_resolution;
-        vec2 ndc = uv * 2.0 - 1.0;
-
-        // World-space direction (view → clip → world)
-        vec4 view_pos = invProjMatrix * vec4(ndc, -1.0, 1.0);
-        view_pos /= view_pos.w;
-        vec4 world_pos = invViewMatrix * view_pos;
-        vec3 dir = normalize(world_pos.xyz - cameraPosition);
-
-        // Sample lens disk and shift ray origin
-        vec2 lens_sample = sample_disk(random_state) * lens_radius;
-        vec3 lens_offset = camera_right * lens_sample.x + camera_up * lens_sample.y;
-        vec3 origin = cameraPosition + lens_offset;
-
-        // Recompute ray direction toward focal point
-        vec3 focal_point = cameraPosition + dir * focus_distance;
-        dir = normalize(focal_point - origin);
-
-        Ray ray;
-        ray.origin = origin;
-        ray.direction = dir;
-
-        pixel_color += ray_color2(ray, max_bounces, random_state);
-    }
-
+    // Subpixel jitter
+    vec2 offset = sample_square(random_state).xy;  
+    vec2 uv = (vec2(pixel_coords) + offset) * inv_resolution;
+    vec2 ndc = uv * 2.0 - 1.0;
+
+    // World-space direction (view → clip → world)
+    vec4 view_pos = invProjMatrix * vec4(ndc, -1.0, 1.0);
+    view_pos /= view_pos.w;
+    vec4 world_pos = invViewMatrix * view_pos;
+    vec3 dir = normalize(world_pos.xyz - cameraPosition);
+
+    // Sample lens disk and shift ray origin
+    vec2 lens_sample = sample_disk(random_state) * lens_radius;
+    vec3 lens_offset = camera_right * lens_sample.x + camera_up * lens_sample.y;
+    vec3 origin = cameraPosition + lens_offset;
+
+    // Recompute ray direction toward focal point
+    vec3 focal_point = cameraPosition + dir * focus_distance;
+    dir = normalize(focal_point - origin);
+
+    Ray ray;
+    ray.origin = origin;
+    ray.direction = dir;
+    return ray;
+}
 
+// Averages the frame's samples and blends them into the image accumulated over the previous frames
+void store_pixel(ivec2 pixel_coords, vec3 pixel_color) {
     vec3 prevColor = imageLoad(srcImage, pixel_coords).xyz;
 
     float scale_factor = 1.0 / float(samples_per_pixel);
@@ -546,3 +1389,282 @@ void main() {
     imageStore(destImage, pixel_coords, vec4(final_color, 1.0));
 }
 
+// The frame's samples of a pixel
+vec3 trace_pixel(ivec2 pixel_coords) {
+    uint x = uint(pixel_coords.x);
+    uint y = uint(pixel_coords.y);
+    uint random_state = time * (x + y * 36) + 1;
+
+    vec3 pixel_color = vec3(0.0);
+    
+    for (int s = 0; s < samples_per_pixel; ++s) {
+        Ray ray = camera_ray(pixel_coords, random_state);
+
+#ifdef NEXT_EVENT_ESTIMATION
+        pixel_color += ray_color_nee(ray, max_bounces, random_state);
+#else
+        pixel_color += ray_color2(ray, max_bounces, random_state);
+#endif
+    }
+    return pixel_color;
+}
+
+#if defined(PERSISTENT_THREADS)
+// Items are the pixels of 8x8 tiles, Morton ordered inside a tile and tiles row by row, so the pixels
+// an invocation group pulls together are close and their rays stay coherent. A frame takes work_count
+// items from work_start on, wrapping around the image, so it may cover only part of it; the image's
+// alpha then counts the frames accumulated per pixel instead of frameIndex.
+// An invocation takes at most work_per_invocation items (persistent_threads.h), so none runs for the
+// whole frame: llvmpipe ends every loop of an invocation after 65535 loop iterations in total, which
+// cut traversals short and left whole 8 pixel runs of a frame wrong.
+
+layout(std430, binding = 18) buffer WorkCounterBuffer {
+    uint work_counter; // items taken this frame, zeroed before the dispatch
+};
+
+layout(location = 16) uniform int work_start;  // item the frame starts at
+layout(location = 17) uniform int work_count;  // items of the frame, at most one per pixel
+layout(location = 18) uniform int fresh_items; // the first this many items start a new accumulation
+layout(location = 19) uniform int work_per_invocation; // items one invocation may take this frame
+
+const uint WORK_TILE_SIZE = 8u;
+
+// Pixel of a 6 bit Morton code within a tile, x from the even bits and y from the odd ones
+uvec2 morton_decode_tile(uint code) {
+    uvec2 v = uvec2(code, code >> 1) & 0x15u;
+    v = (v | (v >> 1)) & 0x03u | (v >> 2) & 0x04u;
+    return v;
+}
+
+void main() {
+    uvec2 size = uvec2(imageDimensions);
+    uint tiles_x = (size.x + WORK_TILE_SIZE - 1u) / WORK_TILE_SIZE;
+    uint tiles_y = (size.y + WORK_TILE_SIZE - 1u) / WORK_TILE_SIZE;
+    uint item_count = tiles_x * tiles_y * WORK_TILE_SIZE * WORK_TILE_SIZE;
+
+    // A lane that finishes its pixel takes the next one, so lanes of long paths don't hold up the rest
+    for (int taken = 0; taken < work_per_invocation; taken++) {
+        uint k = atomicAdd(work_counter, 1u);
+        if (k >= uint(work_count))
+            break;
+        uint item = (uint(work_start) + k) % item_count;
+        uint tile = item / (WORK_TILE_SIZE * WORK_TILE_SIZE);
+        uvec2 pixel = uvec2(tile % tiles_x, tile / tiles_x) * WORK_TILE_SIZE + morton_decode_tile(item % (WORK_TILE_SIZE * WORK_TILE_SIZE));
+        if (any(greaterThanEqual(pixel, size)))
+            continue; // edge tiles hang over the image
+        ivec2 pixel_coords = ivec2(pixel);
+
+        vec3 pixel_color = trace_pixel(pixel_coords) / float(samples_per_pixel);
+        pixel_color = linear_to_srgb(pixel_color);
+
+        vec4 prev = imageLoad(srcImage, pixel_coords);
+        float frames = k < uint(fresh_items) ? 0.0 : prev.w;
+        imageStore(destImage, pixel_coords, vec4((pixel_color + prev.xyz * frames) / (frames + 1.0), frames + 1.0));
+    }
+
+#ifdef TRAVERSAL_STATS
+    atomicAdd(total_node_visits, node_visits);
+    atomicAdd(total_traversals, traversals);
+#endif
+}
+
+#elif !defined(WAVEFRONT)
+void main() {
+    ivec2 pixel_coords = ivec2(gl_GlobalInvocationID.xy);
+
+    store_pixel(pixel_coords, trace_pixel(pixel_coords));
+
+#ifdef TRAVERSAL_STATS
+    atomicAdd(total_node_visits, node_visits);
+    atomicAdd(total_traversals, traversals);
+#endif
+}
+#else
+/** Wavefront path tracing **/
+
+// The path loop of ray_color2 split into passes over queues of paths, so every pass runs one kind of
+// work: lanes no longer idle while their neighbours trace longer paths or scatter other materials.
+// There is a path per pixel and the frame's samples run one after the other, each as
+//   generate    camera rays of all pixels into ray queue 0
+//   extend      closest hits of a ray queue: misses add the sky, hits go to their material's shade queue
+//   shade       scatter for one material type, paths that go on into the other ray queue
+//   queues      a single group turning the queue counts into the next passes' indirect dispatches
+//   accumulate  once after the last sample, averaging the samples into the image as main() does
+// Paths draw their random numbers in the megakernel's order, so both render the same image. Passes
+// over a path per pixel need more groups than a dispatch guarantees in x at 4K, so their groups come
+// in rows and wavefront_item() flattens them again.
+
+const uint WAVEFRONT_GROUP_SIZE = 64u;
+const uint WAVEFRONT_MAX_GROUPS_X = 65535u; // guaranteed GL_MAX_COMPUTE_WORK_GROUP_COUNT, longer dispatches get rows
+const uint QUEUE_RAYS = 0u;  // ray queues 0 and 1, extended in turn
+const uint QUEUE_SHADE = 2u; // + material type
+const uint QUEUE_COUNT = 6u;
+
+struct PathState {
+    vec3 origin;
+    uint rng;
+    vec3 direction;
+    uint bounce;         // rays traced so far
+    vec3 throughput;
+    uint hit_mat_index;  // the hit of the last extend, for shade
+    vec3 hit_point;
+    uint hit_front_face;
+    vec3 hit_normal;
+    uint padding;
+};
+
+layout(std430, binding = 14) buffer PathBuffer {
+    PathState paths[]; // indexed by pixel
+};
+
+layout(std430, binding = 15) buffer QueueBuffer {
+    uint queue_items[]; // QUEUE_COUNT queues of a slot per path
+};
+
+layout(std430, binding = 16) buffer QueueCountBuffer {
+    uvec4 queue_dispatch[]; // per queue: xyz = groups of the indirect dispatch, w = paths pushed
+};
+
+layout(std430, binding = 17) buffer RadianceBuffer {
+    vec4 pixel_radiance[]; // sum of the frame's samples
+};
+
+layout(location = 12) uniform int wavefront_ray_queue; // extend: the queue traced, shade: the queue continued paths go to
+layout(location = 13) uniform int wavefront_sample;    // generate: the sample of the frame
+layout(location = 14) uniform int wavefront_consumed;  // queues: bit mask of the queues to empty
+layout(location = 15) uniform int wavefront_produced;  // queues: bit mask of the queues to size the dispatches of
+
+uint path_count() {
+    return uint(imageDimensions.x) * uint(imageDimensions.y);
+}
+
+// Index of the invocation in a flat list, dispatches of more than WAVEFRONT_MAX_GROUPS_X groups are folded into rows
+uint wavefront_item() {
+    return (gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x) * WAVEFRONT_GROUP_SIZE + gl_LocalInvocationID.x;
+}
+
+void push_path(uint queue, uint path) {
+    uint slot = atomicAdd(queue_dispatch[queue].w, 1u);
+    queue_items[queue * path_count() + slot] = path;
+}
+
+#if defined(WAVEFRONT_PASS_GENERATE)
+void main() {
+    uint path = wavefront_item();
+    uint width = uint(imageDimensions.x);
+    if (path >= path_count())
+        return;
+    uint x = path % width;
+    uint y = path / width;
+
+    // The first sample seeds the state as main() does, the others go on from where the last one stopped
+    uint random_state = wavefront_sample == 0 ? time * (x + y * 36) + 1 : paths[path].rng;
+    Ray ray = camera_ray(ivec2(x, y), random_state);
+
+    paths[path].origin = ray.origin;
+    paths[path].direction = ray.direction;
+    paths[path].rng = random_state;
+    paths[path].bounce = 0u;
+    paths[path].throughput = vec3(1.0);
+    if (wavefront_sample == 0)
+        pixel_radiance[path] = vec4(0.0);
+
+    queue_items[QUEUE_RAYS * path_count() + path] = path;
+    if (path == 0u)
+        queue_dispatch[QUEUE_RAYS].w = path_count();
+}
+
+#elif defined(WAVEFRONT_PASS_EXTEND)
+void main() {
+    uint queue = uint(wavefront_ray_queue);
+    uint item = wavefront_item();
+    if (item >= queue_dispatch[queue].w)
+        return;
+    uint path = queue_items[queue * path_count() + item];
+
+    Ray ray = Ray(paths[path].origin, paths[path].direction);
+    HitRecord hit_rec;
+    if (world_hit_bvh(ray, 0.001, infinity, hit_rec)) {
+        paths[path].hit_point = hit_rec.point;
+        paths[path].hit_normal = hit_rec.normal;
+        paths[path].hit_mat_index = hit_rec.mat_index;
+        paths[path].hit_front_face = uint(hit_rec.front_face);
+
+        // Other types absorb in scatter() without emitting, so the path just ends
+        uint type = get_material(hit_rec.mat_index).type;
+        if (type < QUEUE_COUNT - QUEUE_SHADE)
+            push_path(QUEUE_SHADE + type, path);
+    } else {
+        vec3 unit_direction = normalize(ray.direction);
+        float blend = 0.5 * (unit_direction.y + 1.0);
+        vec3 background_color = mix(vec3(1.0), vec3(0.5, 0.7, 1.0), blend);
+        pixel_radiance[path].xyz += paths[path].throughput * background_color;
+    }
+
+#ifdef TRAVERSAL_STATS
+    atomicAdd(total_node_visits, node_visits);
+    atomicAdd(total_traversals, traversals);
+#endif
+}
+
+#elif defined(WAVEFRONT_PASS_SHADE)
+// WAVEFRONT_SHADE_TYPE is the material type, so every lane of the pass takes the same scatter() branch
+void main() {
+    uint queue = QUEUE_SHADE + uint(WAVEFRONT_SHADE_TYPE);
+    uint item = wavefront_item();
+    if (item >= queue_dispatch[queue].w)
+        return;
+    uint path = queue_items[queue * path_count() + item];
+
+    PathState state = paths[path];
+    Ray ray = Ray(state.origin, state.direction);
+    HitRecord hit_rec;
+    hit_rec.point = state.hit_point;
+    hit_rec.normal = state.hit_normal;
+    hit_rec.mat_index = state.hit_mat_index;
+    hit_rec.front_face = state.hit_front_face != 0u;
+
+    Ray scattered;
+    vec3 matColor;
+    uint random_state = state.rng;
+    if (scatter(random_state, ray, hit_rec, matColor, scattered)) {
+        vec3 throughput = state.throughput * matColor;
+        uint bounce = state.bounce + 1u;
+        // end early if contribution is below a threshold
+        if (length(throughput) > 0.001 && bounce < uint(max_bounces)) {
+            paths[path].origin = scattered.origin;
+            paths[path].direction = scattered.direction;
+            paths[path].throughput = throughput;
+            paths[path].bounce = bounce;
+            push_path(uint(wavefront_ray_queue), path);
+        }
+    } else {
+        pixel_radiance[path].xyz += state.throughput * matColor * get_material(hit_rec.mat_index).emission;
+    }
+    paths[path].rng = random_state;
+}
+
+#elif defined(WAVEFRONT_PASS_QUEUES)
+void main() {
+    uint queue = gl_LocalInvocationID.x;
+    if (queue >= QUEUE_COUNT)
+        return;
+    if ((uint(wavefront_consumed) & (1u << queue)) != 0u)
+        queue_dispatch[queue] = uvec4(0u, 1u, 1u, 0u);
+    if ((uint(wavefront_produced) & (1u << queue)) != 0u) {
+        uint groups = (queue_dispatch[queue].w + WAVEFRONT_GROUP_SIZE - 1u) / WAVEFRONT_GROUP_SIZE;
+        uint rows = max((groups + WAVEFRONT_MAX_GROUPS_X - 1u) / WAVEFRONT_MAX_GROUPS_X, 1u);
+        queue_dispatch[queue].xy = uvec2(min(groups, WAVEFRONT_MAX_GROUPS_X), rows);
+    }
+}
+
+#elif defined(WAVEFRONT_PASS_ACCUMULATE)
+void main() {
+    uint path = wavefront_item();
+    uint width = uint(imageDimensions.x);
+    if (path >= path_count())
+        return;
+    store_pixel(ivec2(path % width, path / width), pixel_radiance[path].xyz);
+}
+#endif
+#endif
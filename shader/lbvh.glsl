@@ -0,0 +1,397 @@
+#version 450 core
+
+// GPU linear BVH build, see gpu_lbvh.h. Every pass is compiled from this file with one of the
+// LBVH_PASS_* defines. Same algorithm as buildLBVH in lbvh.h: 63 bit Morton codes over the centroid
+// bounds, radix sort, Karras hierarchy, bottom-up bounds. The result is written in the BVHNodeFlat
+// layout the tracer reads, in plain pre-order (node, left subtree, right subtree) with skip links.
+// Kept at 450 so it runs on software drivers (Mesa llvmpipe).
+
+#define GROUP_SIZE 256
+#define RADIX_BITS 4
+#define RADIX_BUCKETS 16
+#define MORTON_BITS_PER_AXIS 21
+
+layout (local_size_x = GROUP_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+layout(location = 0) uniform int count;     // number of spheres
+layout(location = 1) uniform int shift;     // radix sort: bit offset of the digit
+layout(location = 2) uniform int numGroups; // radix sort: workgroups of the histogram and scatter passes
+
+struct Sphere {
+    vec3 position;
+    float radius;
+    uint material_index;
+};
+
+struct BVHNodeFlat {
+    vec4 aabbMin;
+    vec4 aabbMax;
+    ivec4 meta; // x: left, y: right (inner) or sphere count (leaf), z: first sphere (-1 for inner), w: next node
+};
+
+// Scene centroid bounds as order preserving uints, so they can be reduced with atomicMin/atomicMax
+uint float_to_ordered(float f) {
+    uint u = floatBitsToUint(f);
+    return (u & 0x80000000u) != 0u ? ~u : (u | 0x80000000u);
+}
+
+float ordered_to_float(uint u) {
+    return uintBitsToFloat((u & 0x80000000u) != 0u ? (u & 0x7FFFFFFFu) : ~u);
+}
+
+// Same box and centroid as computeAABB / AABB::center on the CPU
+vec3 sphere_centroid(Sphere s) {
+    return ((s.position - vec3(s.radius)) + (s.position + vec3(s.radius))) * 0.5;
+}
+
+// Codes are uvec2(high 31 bits, low 32 bits)
+uint radix_digit(uvec2 code) {
+    uint word = shift < 32 ? code.y : code.x;
+    return (word >> uint(shift & 31)) & uint(RADIX_BUCKETS - 1);
+}
+
+#if defined(LBVH_PASS_BOUNDS)
+
+layout(std430, binding = 0) readonly buffer SourceSpheres { Sphere spheres[]; };
+layout(std430, binding = 1) buffer SceneBounds { uint sceneMin[4]; uint sceneMax[4]; };
+
+shared vec3 groupMin[GROUP_SIZE];
+shared vec3 groupMax[GROUP_SIZE];
+
+void main() {
+    uint lid = gl_LocalInvocationID.x;
+    int i = int(gl_GlobalInvocationID.x);
+
+    vec3 c = i < count ? sphere_centroid(spheres[i]) : vec3(0.0);
+    groupMin[lid] = i < count ? c : vec3(3.4e38);
+    groupMax[lid] = i < count ? c : vec3(-3.4e38);
+
+    for (uint stride = GROUP_SIZE / 2; stride > 0u; stride >>= 1) {
+        barrier();
+        if (lid < stride) {
+            groupMin[lid] = min(groupMin[lid], groupMin[lid + stride]);
+            groupMax[lid] = max(groupMax[lid], groupMax[lid + stride]);
+        }
+    }
+
+    if (lid == 0u) {
+        for (int axis = 0; axis < 3; axis++) {
+            atomicMin(sceneMin[axis], float_to_ordered(groupMin[0][axis]));
+            atomicMax(sceneMax[axis], float_to_ordered(groupMax[0][axis]));
+        }
+    }
+}
+
+#elif defined(LBVH_PASS_MORTON)
+
+layout(std430, binding = 0) readonly buffer SourceSpheres { Sphere spheres[]; };
+layout(std430, binding = 1) readonly buffer SceneBounds { uint sceneMin[4]; uint sceneMax[4]; };
+layout(std430, binding = 2) writeonly buffer KeysOut { uvec2 keysOut[]; };
+layout(std430, binding = 3) writeonly buffer ValuesOut { uint valuesOut[]; };
+
+// Interleaves 21 bits per axis into a 63 bit code, x highest, matching morton3D in lbvh.h
+uvec2 morton3D(uvec3 q) {
+    uvec2 code = uvec2(0u);
+    for (int b = 0; b < MORTON_BITS_PER_AXIS; b++) {
+        uvec3 bits = (q >> uint(b)) & 1u;
+        uint triple = (bits.x << 2) | (bits.y << 1) | bits.z;
+        int pos = 3 * b;
+        if (pos < 32)
+            code.y |= triple << uint(pos);
+        if (pos + 2 >= 32)
+            code.x |= pos >= 32 ? triple << uint(pos - 32) : triple >> uint(32 - pos);
+    }
+    return code;
+}
+
+void main() {
+    int i = int(gl_GlobalInvocationID.x);
+    if (i >= count)
+        return;
+
+    vec3 boundsMin = vec3(ordered_to_float(sceneMin[0]), ordered_to_float(sceneMin[1]), ordered_to_float(sceneMin[2]));
+    vec3 boundsMax = vec3(ordered_to_float(sceneMax[0]), ordered_to_float(sceneMax[1]), ordered_to_float(sceneMax[2]));
+
+    // Flat axes map to 0 instead of dividing by zero
+    vec3 extent = boundsMax - boundsMin;
+    vec3 invExtent = vec3(extent.x > 0.0 ? 1.0 / extent.x : 0.0,
+                          extent.y > 0.0 ? 1.0 / extent.y : 0.0,
+                          extent.z > 0.0 ? 1.0 / extent.z : 0.0);
+
+    vec3 normalized = (sphere_centroid(spheres[i]) - boundsMin) * invExtent;
+    const float scale = float(1 << MORTON_BITS_PER_AXIS);
+    uvec3 q = uvec3(clamp(normalized * scale, vec3(0.0), vec3(scale - 1.0)));
+
+    keysOut[i] = morton3D(q);
+    valuesOut[i] = uint(i);
+}
+
+#elif defined(LBVH_PASS_HISTOGRAM)
+
+layout(std430, binding = 0) readonly buffer KeysIn { uvec2 keysIn[]; };
+layout(std430, binding = 1) writeonly buffer Histogram { uint histogram[]; }; // digit major: [digit * numGroups + group]
+
+shared uint groupCounts[RADIX_BUCKETS];
+
+void main() {
+    uint lid = gl_LocalInvocationID.x;
+    int i = int(gl_GlobalInvocationID.x);
+
+    if (lid < uint(RADIX_BUCKETS))
+        groupCounts[lid] = 0u;
+    barrier();
+
+    if (i < count)
+        atomicAdd(groupCounts[radix_digit(keysIn[i])], 1u);
+    barrier();
+
+    if (lid < uint(RADIX_BUCKETS))
+        histogram[lid * uint(numGroups) + gl_WorkGroupID.x] = groupCounts[lid];
+}
+
+#elif defined(LBVH_PASS_SCAN)
+
+// Exclusive prefix sum over the whole histogram in a single workgroup: every thread sums a contiguous
+// block, the block sums are scanned in shared memory, then every thread writes its block's offsets
+layout(std430, binding = 0) buffer Histogram { uint histogram[]; };
+
+shared uint blockSums[GROUP_SIZE];
+
+void main() {
+    uint lid = gl_LocalInvocationID.x;
+    uint total = uint(numGroups * RADIX_BUCKETS);
+    uint blockSize = (total + GROUP_SIZE - 1u) / GROUP_SIZE;
+    uint blockStart = min(lid * blockSize, total);
+    uint blockEnd = min(blockStart + blockSize, total);
+
+    uint sum = 0u;
+    for (uint j = blockStart; j < blockEnd; j++)
+        sum += histogram[j];
+    blockSums[lid] = sum;
+
+    // Inclusive Hillis-Steele scan of the block sums
+    for (uint offset = 1u; offset < GROUP_SIZE; offset <<= 1) {
+        barrier();
+        uint add = lid >= offset ? blockSums[lid - offset] : 0u;
+        barrier();
+        blockSums[lid] += add;
+    }
+    barrier();
+
+    uint running = blockSums[lid] - sum;
+    for (uint j = blockStart; j < blockEnd; j++) {
+        uint value = histogram[j];
+        histogram[j] = running;
+        running += value;
+    }
+}
+
+#elif defined(LBVH_PASS_SCATTER)
+
+layout(std430, binding = 0) readonly buffer KeysIn { uvec2 keysIn[]; };
+layout(std430, binding = 1) readonly buffer ValuesIn { uint valuesIn[]; };
+layout(std430, binding = 2) writeonly buffer KeysOut { uvec2 keysOut[]; };
+layout(std430, binding = 3) writeonly buffer ValuesOut { uint valuesOut[]; };
+layout(std430, binding = 4) readonly buffer Histogram { uint histogram[]; };
+
+// Per thread one-hot digit counters, 16 bit per digit packed in two uvec4. Scanning them across the
+// group gives every key its rank among the keys with the same digit before it, which keeps the sort stable.
+shared uvec4 rankLow[GROUP_SIZE];
+shared uvec4 rankHigh[GROUP_SIZE];
+
+void main() {
+    uint lid = gl_LocalInvocationID.x;
+    int i = int(gl_GlobalInvocationID.x);
+    bool valid = i < count;
+
+    uvec2 key = valid ? keysIn[i] : uvec2(0u);
+    uint digit = radix_digit(key);
+    uint word = digit >> 1;
+    uint field = (digit & 1u) * 16u;
+
+    uvec4 low = uvec4(0u);
+    uvec4 high = uvec4(0u);
+    if (valid) {
+        if (word < 4u)
+            low[word] = 1u << field;
+        else
+            high[word - 4u] = 1u << field;
+    }
+    rankLow[lid] = low;
+    rankHigh[lid] = high;
+
+    for (uint offset = 1u; offset < GROUP_SIZE; offset <<= 1) {
+        barrier();
+        uvec4 addLow = lid >= offset ? rankLow[lid - offset] : uvec4(0u);
+        uvec4 addHigh = lid >= offset ? rankHigh[lid - offset] : uvec4(0u);
+        barrier();
+        rankLow[lid] += addLow;
+        rankHigh[lid] += addHigh;
+    }
+    barrier();
+
+    if (!valid)
+        return;
+
+    uint packedRank = word < 4u ? rankLow[lid][word] : rankHigh[lid][word - 4u];
+    uint rank = ((packedRank >> field) & 0xFFFFu) - 1u; // scan was inclusive
+    uint destination = histogram[digit * uint(numGroups) + gl_WorkGroupID.x] + rank;
+
+    keysOut[destination] = key;
+    valuesOut[destination] = valuesIn[i];
+}
+
+#elif defined(LBVH_PASS_HIERARCHY)
+
+layout(std430, binding = 0) readonly buffer Keys { uvec2 keys[]; };
+layout(std430, binding = 1) writeonly buffer Children { ivec2 children[]; }; // internal nodes, leaves are n-1+k
+layout(std430, binding = 2) writeonly buffer Parents { int parents[]; };
+layout(std430, binding = 3) writeonly buffer Visits { uint visits[]; };
+
+// Same as commonPrefix in lbvh.h
+int common_prefix(int i, int j) {
+    if (j < 0 || j >= count)
+        return -1;
+    uvec2 a = keys[i];
+    uvec2 b = keys[j];
+    if (a == b)
+        return 64 + 31 - findMSB(uint(i ^ j));
+    if (a.x != b.x)
+        return 31 - findMSB(a.x ^ b.x);
+    return 32 + 31 - findMSB(a.y ^ b.y);
+}
+
+void main() {
+    int i = int(gl_GlobalInvocationID.x);
+    if (i >= count - 1)
+        return;
+
+    int direction = common_prefix(i, i + 1) - common_prefix(i, i - 1) >= 0 ? 1 : -1;
+    int minPrefix = common_prefix(i, i - direction);
+
+    int maxLength = 2;
+    while (common_prefix(i, i + maxLength * direction) > minPrefix)
+        maxLength *= 2;
+    int len = 0;
+    for (int step = maxLength / 2; step >= 1; step /= 2) {
+        if (common_prefix(i, i + (len + step) * direction) > minPrefix)
+            len += step;
+    }
+    int j = i + len * direction;
+
+    int nodePrefix = common_prefix(i, j);
+    int split = 0;
+    int step = len;
+    do {
+        step = (step + 1) >> 1;
+        if (common_prefix(i, i + (split + step) * direction) > nodePrefix)
+            split += step;
+    } while (step > 1);
+    int gamma = i + split * direction + min(direction, 0);
+
+    int leafBase = count - 1;
+    int left = min(i, j) == gamma ? leafBase + gamma : gamma;
+    int right = max(i, j) == gamma + 1 ? leafBase + gamma + 1 : gamma + 1;
+
+    children[i] = ivec2(left, right);
+    parents[left] = i;
+    parents[right] = i;
+    visits[i] = 0u;
+}
+
+#elif defined(LBVH_PASS_FIT)
+
+layout(std430, binding = 0) readonly buffer SourceSpheres { Sphere spheres[]; };
+layout(std430, binding = 1) readonly buffer Values { uint values[]; };
+layout(std430, binding = 2) readonly buffer Children { ivec2 children[]; };
+layout(std430, binding = 3) readonly buffer Parents { int parents[]; };
+layout(std430, binding = 4) coherent buffer NodeBounds { vec4 nodeBounds[]; }; // min, max per node
+layout(std430, binding = 5) coherent buffer LeafCounts { int leafCounts[]; };   // leaves below every node
+layout(std430, binding = 6) buffer Visits { uint visits[]; };
+
+// Every leaf walks towards the root (node 0). The first child to reach an internal node stops, the second
+// one merges both children and carries on, so every internal node is written once, after its children.
+void main() {
+    int k = int(gl_GlobalInvocationID.x);
+    if (k >= count)
+        return;
+
+    Sphere s = spheres[values[k]];
+    int node = count - 1 + k;
+    nodeBounds[2 * node] = vec4(s.position - vec3(s.radius), 0.0);
+    nodeBounds[2 * node + 1] = vec4(s.position + vec3(s.radius), 0.0);
+    leafCounts[node] = 1;
+
+    while (node != 0) {
+        memoryBarrierBuffer();
+        int parent = parents[node];
+        if (atomicAdd(visits[parent], 1u) == 0u)
+            break;
+        memoryBarrierBuffer();
+
+        ivec2 c = children[parent];
+        nodeBounds[2 * parent] = min(nodeBounds[2 * c.x], nodeBounds[2 * c.y]);
+        nodeBounds[2 * parent + 1] = max(nodeBounds[2 * c.x + 1], nodeBounds[2 * c.y + 1]);
+        leafCounts[parent] = leafCounts[c.x] + leafCounts[c.y];
+        node = parent;
+    }
+}
+
+#elif defined(LBVH_PASS_FLATTEN)
+
+layout(std430, binding = 0) readonly buffer Children { ivec2 children[]; };
+layout(std430, binding = 1) readonly buffer Parents { int parents[]; };
+layout(std430, binding = 2) readonly buffer NodeBounds { vec4 nodeBounds[]; };
+layout(std430, binding = 3) readonly buffer LeafCounts { int leafCounts[]; };
+layout(std430, binding = 4) writeonly buffer FlatNodes { BVHNodeFlat flatNodes[]; };
+
+// A subtree with l leaves has 2l-1 nodes. In pre-order the left child follows its parent and the right
+// child follows the left subtree, so walking up to the root and summing those offsets gives the flat
+// index of the node. The skip link is the first node after the subtree.
+void main() {
+    int node = int(gl_GlobalInvocationID.x);
+    int totalNodes = 2 * count - 1;
+    if (node >= totalNodes)
+        return;
+
+    int flatIndex = 0;
+    for (int c = node; c != 0; ) {
+        int parent = parents[c];
+        int left = children[parent].x;
+        flatIndex += c == left ? 1 : 2 * leafCounts[left];
+        c = parent;
+    }
+
+    int next = flatIndex + 2 * leafCounts[node] - 1;
+    if (next >= totalNodes)
+        next = -1;
+
+    BVHNodeFlat flatNode;
+    flatNode.aabbMin = nodeBounds[2 * node];
+    flatNode.aabbMax = nodeBounds[2 * node + 1];
+
+    int leafBase = count - 1;
+    if (node >= leafBase) {
+        flatNode.meta = ivec4(-1, 1, node - leafBase, next);
+    }
+    else {
+        int left = children[node].x;
+        flatNode.meta = ivec4(flatIndex + 1, flatIndex + 2 * leafCounts[left], -1, next);
+    }
+    flatNodes[flatIndex] = flatNode;
+}
+
+#elif defined(LBVH_PASS_REORDER)
+
+layout(std430, binding = 0) readonly buffer SourceSpheres { Sphere spheres[]; };
+layout(std430, binding = 1) readonly buffer Values { uint values[]; };
+layout(std430, binding = 2) writeonly buffer SortedSpheres { Sphere sortedSpheres[]; };
+
+// Leaf k references sphere k, so the tracer can read the spheres in Morton order directly
+void main() {
+    int k = int(gl_GlobalInvocationID.x);
+    if (k < count)
+        sortedSpheres[k] = spheres[values[k]];
+}
+
+#endif
@@ -4,6 +4,11 @@
 #include <vector>
 #include <iostream>
 #include <algorithm>
+#include <mutex>
+#include <numeric>
+#include <cassert>
+
+#include "thread_pool.h"
 
 
 struct AABB {
@@ -40,9 +45,18 @@ AABB computeAABB(const Sphere& s) {
 }
 
 AABB computeAABB(const Quad& q) {
-    AABB aabb{};
-    aabb = { q.corner_point, q.corner_point + q.u + q.v};
-    padAABB(aabb); // in case quad is exactly on bouding box, add some padding
+    // All four corners, u and v can point in any direction
+    glm::vec3 a = q.corner_point, b = a + q.u, c = a + q.v, d = a + q.u + q.v;
+    AABB aabb = { glm::min(glm::min(a, b), glm::min(c, d)), glm::max(glm::max(a, b), glm::max(c, d)) };
+
+    // Axis aligned quads have flat boxes, which the slab test misses
+    for (int axis = 0; axis < 3; axis++) {
+        float epsilon = 1e-5f * std::max(1.0f, std::max(std::abs(aabb.min[axis]), std::abs(aabb.max[axis])));
+        if (aabb.max[axis] - aabb.min[axis] < epsilon) {
+            aabb.min[axis] -= epsilon;
+            aabb.max[axis] += epsilon;
+        }
+    }
     return aabb;
 }
 
@@ -54,36 +68,24 @@ AABB surroundingBox(const AABB& a, const AABB& b) {
 }
 
 
+// Leaves hold a contiguous range of primitives, primOffset indexes the primitive array after it was
+// reordered to the builder's index order (see reorderPrimitives)
 struct BVHNode {
     AABB aabb;
     int left;
     int right;
-    int sphereIndex = -1;
+    int primOffset = -1;
+    int primCount = 0;
+
+    bool isLeaf() const { return primCount > 0; }
 };
 
 struct alignas(16) BVHNodeFlat {
     glm::vec4 aabbMin;   // .xyz = min
     glm::vec4 aabbMax;   // .xyz = max
-    glm::ivec4 meta;     // .x = left, .y = right, .z = sphereIndex, .w = unused
+    glm::ivec4 meta;     // .x = left, .y = right (inner) or primitive count (leaf), .z = first primitive (-1 for inner), .w = next node
 };
 
-AABB computeSceneAABB(const std::vector<Sphere>& spheres) {
-    glm::vec3 minPoint(std::numeric_limits<float>::max());
-    glm::vec3 maxPoint(std::numeric_limits<float>::lowest());
-
-    for (const Sphere& sphere : spheres) {
-        glm::vec3 center = sphere.position;
-
-        minPoint = glm::min(minPoint, center);
-        maxPoint = glm::max(maxPoint, center);
-    }
-
-    AABB bounds;
-    bounds.min = minPoint;
-    bounds.max = maxPoint;
-    return bounds;
-}
-
 int findMaxVarianceAxis(const std::vector<int> &sphereIndices, const std::vector<AABB> &aabbs){
     float mean[3] = {0}, var[3] = {0};
     for (int idx : sphereIndices) {
@@ -124,175 +126,390 @@ int longestAxis(const AABB &box){
 }
 
 
-float computeSAHCost(int numLeft, float leftArea, int numRight, float rightArea) {
-    // Constant traversal cost = 1.0, intersection cost = 1.0
-    return 1.0f + (leftArea * numLeft + rightArea * numRight);
+// Cost of traversing an inner node and of intersecting one primitive, relative to each other.
+// A node visit is a dependent 48 byte load plus a box test, weighted as two sphere tests this
+// gives leaves of 2-4 spheres and about half the nodes of one sphere per leaf.
+const float SAH_TRAVERSAL_COST = 2.0f;
+const float SAH_INTERSECTION_COST = 1.0f;
+// Leaves never get bigger than this, even if SAH would prefer it
+const int MAX_LEAF_SIZE = 8;
+
+// Expected cost of splitting a node with the given surface area, the children are hit with
+// probability childArea / parentArea
+float computeSAHCost(int numLeft, float leftArea, int numRight, float rightArea, float parentArea) {
+    return SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * (leftArea * numLeft + rightArea * numRight) / std::max(parentArea, FLT_MIN);
+}
+
+// Expected cost of making a leaf out of count primitives instead of splitting
+float computeLeafCost(int count) {
+    return SAH_INTERSECTION_COST * count;
 }
 
 // SAH effectivly reduces the number of interesection tests by splitting the aabb into optimal subboxes.
-// It does this by finding the best axis to split on using the surface area of the aabbs
-int findBestSAHSplit(const std::vector<AABB>& aabbs, const std::vector<int>& indices, int& splitAxis, int& splitIndex) {
+// It does this by finding the best axis to split on using the surface area of the aabbs.
+// Works in place: indices[start, end) is sorted along each axis in turn and rightAreas (one entry per
+// primitive, preallocated) holds the sweep, so nothing is allocated. On return the range is partitioned
+// around splitIndex (absolute) along splitAxis.
+// Returns the cost of the best split.
+float findBestSAHSplit(const std::vector<AABB>& aabbs, std::vector<int>& indices, int start, int end, const AABB& box, std::vector<float>& rightAreas, int& splitAxis, int& splitIndex) {
     float bestCost = FLT_MAX;
+    float parentArea = box.surfaceArea();
+    splitAxis = 0;
+    splitIndex = (start + end) / 2;
 
     // Iterate over all axis
     for (int axis = 0; axis < 3; axis++) {
         // Sort by axis 
-        std::vector<int> sorted = indices;
-        std::sort(sorted.begin(), sorted.end(), [&](int a, int b) {
+        std::sort(indices.begin() + start, indices.begin() + end, [&](int a, int b) {
             return aabbs[a].center()[axis] < aabbs[b].center()[axis];
         });
 
-        // Compute left and right boxes on current axis
-        std::vector<AABB> leftBoxes(sorted.size()), rightBoxes(sorted.size());
-        AABB leftBox = aabbs[sorted[0]];
-        for (int i = 1; i < sorted.size(); ++i)
-            leftBoxes[i] = leftBox = surroundingBox(leftBox, aabbs[sorted[i]]);
-
-        AABB rightBox = aabbs[sorted.back()];
-        for (int i = (int)sorted.size() - 2; i >= 0; --i)
-            rightBoxes[i] = rightBox = surroundingBox(rightBox, aabbs[sorted[i]]);
+        // Area of the right box for every split position on current axis
+        AABB rightBox = aabbs[indices[end - 1]];
+        rightAreas[end - 1] = rightBox.surfaceArea();
+        for (int i = end - 2; i > start; --i) {
+            rightBox = surroundingBox(rightBox, aabbs[indices[i]]);
+            rightAreas[i] = rightBox.surfaceArea();
+        }
 
         // Compute the SAH cost which uses the surface area of the left and right boxes
-        for (int i = 1; i < sorted.size(); ++i) {
-            float leftArea = leftBoxes[i].surfaceArea();
-            float rightArea = rightBoxes[i].surfaceArea();
-
-            float cost = computeSAHCost(i, leftArea, sorted.size() - i, rightArea);
+        AABB leftBox = aabbs[indices[start]];
+        for (int i = start + 1; i < end; ++i) {
+            float cost = computeSAHCost(i - start, leftBox.surfaceArea(), end - i, rightAreas[i], parentArea);
             if (cost < bestCost) {
                 bestCost = cost;
                 splitAxis = axis;
                 splitIndex = i;
             }
+            leftBox = surroundingBox(leftBox, aabbs[indices[i]]);
         }
     }
 
-    return splitAxis;
-}
+    std::nth_element(indices.begin() + start, indices.begin() + splitIndex, indices.begin() + end, [&](int a, int b) {
+        return aabbs[a].center()[splitAxis] < aabbs[b].center()[splitAxis];
+    });
 
+    return bestCost;
+}
 
-int buildBVH(std::vector<BVHNode>& bvh, const std::vector<Sphere>& spheres, const std::vector<AABB>& aabbs, std::vector<int> sphereIndices) {
-    BVHNode node;
+// Node arena and scratch memory for a build. reset() sizes everything for the worst case up front
+// (2N-1 nodes, one index and one sweep entry per primitive) and only touches the heap when the
+// primitive count grows, so rebuilding a scene every frame does no allocation after the first build.
+// Without a pool the builders below allocate nothing; with one only the task queues do.
+struct BVHBuildContext {
+    std::vector<BVHNode> nodes;     // node arena
+    std::vector<int> indices;       // primitive indices, partitioned in place by the builders
+    std::vector<float> sweepAreas;  // scratch for findBestSAHSplit
+    int nodesUsed = 0;
+
+    void reset(int primitiveCount) {
+        nodes.resize(std::max(2 * primitiveCount - 1, 0));
+        indices.resize(primitiveCount);
+        std::iota(indices.begin(), indices.end(), 0);
+        sweepAreas.resize(primitiveCount);
+        nodesUsed = 0;
+    }
 
-    // Compute bounding box for all spheres in this node
-    AABB box = aabbs[sphereIndices[0]];
-    for (size_t i = 1; i < sphereIndices.size(); i++) {
-        box = surroundingBox(box, aabbs[sphereIndices[i]]);
+    // Bump allocates a block of nodes from the arena
+    int allocateNodes(int count) {
+        int base = nodesUsed;
+        nodesUsed += count;
+        return base;
     }
+};
 
-    node.aabb = box;
+// Binned SAH: instead of sorting on every axis, primitive centroids are dropped into a fixed
+// number of equal width bins over the centroid bounds, and only the bin boundaries are evaluated
+// as split candidates. This is O(n) per node instead of O(n log n).
+const int MAX_SAH_BINS = 64;
+const int DEFAULT_SAH_BINS = 16;
 
-    if (sphereIndices.size() == 1) {
-        node.sphereIndex = sphereIndices[0];
-        node.left = node.right = -1;
-        bvh.push_back(node);
-        return bvh.size() - 1;
-    }
+// Subtrees smaller than this are built serially, bigger ones fork their left child onto the pool
+const int PARALLEL_BUILD_THRESHOLD = 4096;
+// Nodes bigger than this (the few near the root) also bin and compute bounds in parallel chunks
+const int PARALLEL_BIN_THRESHOLD = 1 << 16;
+const int PARALLEL_BIN_GRAIN = 1 << 14;
 
-    // Split: sort by axis
-    // int axis = findMaxVarianceAxis(sphereIndices, aabbs);
-    // int axis = longestAxis(box);
-    // int axis = rand() % 3;
-    // std::sort(sphereIndices.begin(), sphereIndices.end(), [&](int a, int b) {
-    //     return aabbs[a].center()[axis] < aabbs[b].center()[axis];
-    // });
+struct SAHBin {
+    AABB bounds;
+    int count;
+};
 
-    // int mid = sphereIndices.size() / 2;
-    // std::vector<int> leftIndices(sphereIndices.begin(), sphereIndices.begin() + mid);
-    // std::vector<int> rightIndices(sphereIndices.begin() + mid, sphereIndices.end());
+const SAHBin EMPTY_SAH_BIN = { { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) }, 0 };
 
-    int axis, splitIndex;
-    findBestSAHSplit(aabbs, sphereIndices, axis, splitIndex);
+struct SAHBinSet {
+    SAHBin bins[3][MAX_SAH_BINS];
+};
 
-    std::sort(sphereIndices.begin(), sphereIndices.end(), [&](int a, int b) {
-        return aabbs[a].center()[axis] < aabbs[b].center()[axis];
-    });
+int binIndex(const AABB& aabb, int axis, float centroidMin, float binScale, int numBins) {
+    int b = (int)((aabb.center()[axis] - centroidMin) * binScale);
+    return glm::clamp(b, 0, numBins - 1);
+}
 
-    std::vector<int> leftIndices(sphereIndices.begin(), sphereIndices.begin() + splitIndex);
-    std::vector<int> rightIndices(sphereIndices.begin() + splitIndex, sphereIndices.end());
+// Bounds of the primitives in indices[start, end) and of their centroids
+void computeRangeBounds(const std::vector<AABB>& aabbs, const std::vector<int>& indices, int start, int end, AABB& bounds, AABB& centroidBounds) {
+    bounds = aabbs[indices[start]];
+    centroidBounds = { bounds.center(), bounds.center() };
+    for (int i = start + 1; i < end; i++) {
+        const AABB& aabb = aabbs[indices[i]];
+        bounds = surroundingBox(bounds, aabb);
+        centroidBounds.min = glm::min(centroidBounds.min, aabb.center());
+        centroidBounds.max = glm::max(centroidBounds.max, aabb.center());
+    }
+}
+
+// Same as above, split into chunks on the pool for big ranges. Chunks are merged under a lock as they
+// finish, min/max are exact so the result doesn't depend on the order.
+void computeRangeBoundsParallel(const std::vector<AABB>& aabbs, const std::vector<int>& indices, int start, int end, AABB& bounds, AABB& centroidBounds, ThreadPool* pool) {
+    if (!pool || end - start < PARALLEL_BIN_THRESHOLD) {
+        computeRangeBounds(aabbs, indices, start, end, bounds, centroidBounds);
+        return;
+    }
 
-    int leftChild = buildBVH(bvh, spheres, aabbs, leftIndices);
-    int rightChild = buildBVH(bvh, spheres, aabbs, rightIndices);
+    bounds = centroidBounds = EMPTY_SAH_BIN.bounds;
+    std::mutex mergeMutex;
+    parallelFor(pool, start, end, PARALLEL_BIN_GRAIN, [&](int chunkStart, int chunkEnd) {
+        AABB chunkBounds, chunkCentroids;
+        computeRangeBounds(aabbs, indices, chunkStart, chunkEnd, chunkBounds, chunkCentroids);
 
-    node.left = leftChild;
-    node.right = rightChild;
-    bvh.push_back(node);
-    return bvh.size() - 1;
+        std::lock_guard<std::mutex> lock(mergeMutex);
+        bounds = surroundingBox(bounds, chunkBounds);
+        centroidBounds = surroundingBox(centroidBounds, chunkCentroids);
+    });
 }
-struct MortonPrimitive{
-    uint32_t code;
-    int index;
-};
 
-uint32_t expandBits(uint32_t v) {
-    v = (v * 0x00010001u) & 0xFF0000FFu;
-    v = (v * 0x00000101u) & 0x0F00F00Fu;
-    v = (v * 0x00000011u) & 0xC30C30C3u;
-    v = (v * 0x00000005u) & 0x49249249u;
-    return v;
+// Bins all three axis in a single pass over the primitives in indices[start, end)
+void binPrimitives(const std::vector<AABB>& aabbs, const std::vector<int>& indices, int start, int end,
+                   const AABB& centroidBounds, const float binScale[3], int numBins, SAHBinSet& set) {
+    for (int axis = 0; axis < 3; axis++)
+        std::fill(set.bins[axis], set.bins[axis] + numBins, EMPTY_SAH_BIN);
+
+    for (int i = start; i < end; i++) {
+        const AABB& aabb = aabbs[indices[i]];
+        for (int axis = 0; axis < 3; axis++) {
+            SAHBin& bin = set.bins[axis][binIndex(aabb, axis, centroidBounds.min[axis], binScale[axis], numBins)];
+            bin.bounds = surroundingBox(bin.bounds, aabb);
+            bin.count++;
+        }
+    }
 }
 
-uint32_t morton3D(float x, float y, float z) {
-    x = glm::clamp(x * 1024.0f, 0.0f, 1023.0f);
-    y = glm::clamp(y * 1024.0f, 0.0f, 1023.0f);
-    z = glm::clamp(z * 1024.0f, 0.0f, 1023.0f);
+// Finds the best bin boundary over all three axis and its cost. Returns false if no split is possible,
+// which happens when all centroids lie in the same spot.
+bool findBestBinnedSplit(const std::vector<AABB>& aabbs, const std::vector<int>& indices, int start, int end, const AABB& box,
+                         const AABB& centroidBounds, int numBins, int& splitAxis, int& splitBin, float& bestCost, ThreadPool* pool = nullptr) {
+    bestCost = FLT_MAX;
+    float parentArea = box.surfaceArea();
+    bool found = false;
 
-    return (expandBits((uint32_t)x) << 2) |
-            (expandBits((uint32_t)y) << 1) |
-            expandBits((uint32_t)z);
-}
+    float binScale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        binScale[axis] = extent > 0.0f ? numBins / extent : 0.0f;
+    }
 
+    SAHBinSet set;
+    if (!pool || end - start < PARALLEL_BIN_THRESHOLD) {
+        binPrimitives(aabbs, indices, start, end, centroidBounds, binScale, numBins, set);
+    }
+    else {
+        // Bin chunks in parallel and merge them as they finish. Bin counts and bounds are exact so
+        // this gives the same bins as the serial pass whatever order the chunks finish in
+        for (int axis = 0; axis < 3; axis++)
+            std::fill(set.bins[axis], set.bins[axis] + numBins, EMPTY_SAH_BIN);
+
+        std::mutex mergeMutex;
+        parallelFor(pool, start, end, PARALLEL_BIN_GRAIN, [&](int chunkStart, int chunkEnd) {
+            SAHBinSet chunkSet;
+            binPrimitives(aabbs, indices, chunkStart, chunkEnd, centroidBounds, binScale, numBins, chunkSet);
+
+            std::lock_guard<std::mutex> lock(mergeMutex);
+            for (int axis = 0; axis < 3; axis++) {
+                for (int b = 0; b < numBins; b++) {
+                    set.bins[axis][b].bounds = surroundingBox(set.bins[axis][b].bounds, chunkSet.bins[axis][b].bounds);
+                    set.bins[axis][b].count += chunkSet.bins[axis][b].count;
+                }
+            }
+        });
+    }
 
-int findSplit(const std::vector<MortonPrimitive>& mortonPrims, int first, int last) {
-    uint32_t firstCode = mortonPrims[first].code;
-    uint32_t lastCode  = mortonPrims[last - 1].code; 
+    for (int axis = 0; axis < 3; axis++) {
+        if (binScale[axis] == 0.0f)
+            continue;
+
+        const SAHBin* bins = set.bins[axis];
+
+        // Sweep from the right to get the area and count right of every boundary
+        float rightAreas[MAX_SAH_BINS];
+        int rightCounts[MAX_SAH_BINS];
+        SAHBin right = EMPTY_SAH_BIN;
+        for (int b = numBins - 1; b > 0; b--) {
+            right.bounds = surroundingBox(right.bounds, bins[b].bounds);
+            right.count += bins[b].count;
+            rightAreas[b] = right.count > 0 ? right.bounds.surfaceArea() : 0.0f;
+            rightCounts[b] = right.count;
+        }
 
-    if (firstCode == lastCode) {
-        return (first + last) >> 1;
+        // Sweep from the left and evaluate the split after bin b
+        SAHBin left = EMPTY_SAH_BIN;
+        for (int b = 0; b < numBins - 1; b++) {
+            left.bounds = surroundingBox(left.bounds, bins[b].bounds);
+            left.count += bins[b].count;
+            if (left.count == 0 || rightCounts[b + 1] == 0)
+                continue;
+
+            float cost = computeSAHCost(left.count, left.bounds.surfaceArea(), rightCounts[b + 1], rightAreas[b + 1], parentArea);
+            if (cost < bestCost) {
+                bestCost = cost;
+                splitAxis = axis;
+                splitBin = b;
+                found = true;
+            }
+        }
     }
 
-    int commonPrefix = __builtin_clz(firstCode ^ lastCode);
+    return found;
+}
 
-    int split = first;
-    int step = last - first;
+// Builds the subtree over indices[start, end) into the 2n-1 node slots starting at nodeBase.
+// Slots are handed out in post order (left subtree, right subtree, then the node itself in the last
+// slot), so every subtree knows where it goes before it is built. That lets the two children be
+// built as parallel tasks while the result stays identical to a serial build. Leaves with more than
+// one primitive leave their unused slots empty, flattenBVH only visits nodes reachable from the root.
+int buildBVHBinnedRange(std::vector<BVHNode>& bvh, const std::vector<AABB>& aabbs, std::vector<int>& indices,
+                        int start, int end, int nodeBase, int numBins, ThreadPool* pool) {
+    BVHNode node;
 
-    while (step > 1) {
-        int mid = split + (step >> 1);
-        uint32_t midCode = mortonPrims[mid].code;
-        int midPrefix = __builtin_clz(firstCode ^ midCode);
+    // Compute bounding box and centroid bounds for all primitives in this node
+    AABB box, centroidBounds;
+    computeRangeBoundsParallel(aabbs, indices, start, end, box, centroidBounds, pool);
+    node.aabb = box;
+    node.left = node.right = -1;
+
+    int count = end - start;
+    int nodeIndex = nodeBase + 2 * count - 2;
+
+    int mid = start;
+    int axis, splitBin;
+    float splitCost = FLT_MAX;
+    bool canSplit = count > 1 && findBestBinnedSplit(aabbs, indices, start, end, box, centroidBounds, numBins, axis, splitBin, splitCost, pool);
+
+    // Make a leaf when intersecting everything is cheaper than splitting (or there is no split)
+    if (count == 1 || (count <= MAX_LEAF_SIZE && (!canSplit || computeLeafCost(count) <= splitCost))) {
+        node.primOffset = start;
+        node.primCount = count;
+        bvh[nodeIndex] = node;
+        return nodeIndex;
+    }
 
-        if (midPrefix > commonPrefix)
-            split = mid;
+    if (canSplit) {
+        float binScale = numBins / (centroidBounds.max[axis] - centroidBounds.min[axis]);
+        auto first = indices.begin() + start;
+        auto split = std::partition(first, indices.begin() + end, [&](int idx) {
+            return binIndex(aabbs[idx], axis, centroidBounds.min[axis], binScale, numBins) <= splitBin;
+        });
+        mid = (int)(split - indices.begin());
+    }
+
+    // Centroids are all on top of each other, fall back to an object median split
+    if (mid == start || mid == end) {
+        mid = (start + end) / 2;
+        axis = longestAxis(centroidBounds);
+        std::nth_element(indices.begin() + start, indices.begin() + mid, indices.begin() + end, [&](int a, int b) {
+            return aabbs[a].center()[axis] < aabbs[b].center()[axis];
+        });
+    }
 
-        step >>= 1;
+    int leftBase = nodeBase;
+    int rightBase = nodeBase + 2 * (mid - start) - 1;
+    if (pool && end - start >= PARALLEL_BUILD_THRESHOLD) {
+        TaskGroup group(*pool);
+        group.run([&] { node.left = buildBVHBinnedRange(bvh, aabbs, indices, start, mid, leftBase, numBins, pool); });
+        node.right = buildBVHBinnedRange(bvh, aabbs, indices, mid, end, rightBase, numBins, pool);
+        group.wait();
     }
+    else {
+        node.left = buildBVHBinnedRange(bvh, aabbs, indices, start, mid, leftBase, numBins, pool);
+        node.right = buildBVHBinnedRange(bvh, aabbs, indices, mid, end, rightBase, numBins, pool);
+    }
+
+    bvh[nodeIndex] = node;
+    return nodeIndex;
+}
 
-    return split;
+// Builds the tree over all of context.indices into the context's arena and returns the root. The index
+// array is reordered in place. Passing a pool builds in parallel, the output is the same with or without one.
+// There has to be at least one primitive, an empty tree has no root.
+int buildBVHBinned(BVHBuildContext& context, const std::vector<AABB>& aabbs, int numBins = DEFAULT_SAH_BINS, ThreadPool* pool = nullptr) {
+    int count = (int)context.indices.size();
+    assert(count > 0);
+    int nodeBase = context.allocateNodes(2 * count - 1);
+    return buildBVHBinnedRange(context.nodes, aabbs, context.indices, 0, count, nodeBase, glm::clamp(numBins, 2, MAX_SAH_BINS), pool);
 }
 
+// Full sweep SAH builder, evaluates every split position instead of bin boundaries. Slower to build
+// than the binned builder but gives slightly better trees. Same slot layout as buildBVHBinnedRange.
+int buildBVHRange(BVHBuildContext& context, const std::vector<AABB>& aabbs, int start, int end, int nodeBase, ThreadPool* pool) {
+    BVHNode node;
 
-int buildLBVH(std::vector<BVHNode>& nodes, const std::vector<AABB>& aabbs, const std::vector<MortonPrimitive>& mortonPrims, int start, int end) {
-    if (end - start == 1) {
-        // Leaf node
-        BVHNode leaf;
-        leaf.sphereIndex = mortonPrims[start].index;
-        leaf.left = leaf.right = -1;
-        leaf.aabb = aabbs[leaf.sphereIndex];
-        nodes.push_back(leaf);
-        return nodes.size() - 1;
+    // Compute bounding box for all spheres in this node
+    AABB box = aabbs[context.indices[start]];
+    for (int i = start + 1; i < end; i++) {
+        box = surroundingBox(box, aabbs[context.indices[i]]);
     }
 
-    int split = findSplit(mortonPrims, start, end); // end is exclusive
+    node.aabb = box;
+    node.left = node.right = -1;
 
-    int left  = buildLBVH(nodes, aabbs, mortonPrims, start, split + 1);
-    int right = buildLBVH(nodes, aabbs, mortonPrims, split + 1, end);
+    int count = end - start;
+    int nodeIndex = nodeBase + 2 * count - 2;
 
-    BVHNode node;
-    node.left = left;
-    node.right = right;
-    node.sphereIndex = -1;
-    node.aabb = surroundingBox(nodes[left].aabb, nodes[right].aabb);
-    nodes.push_back(node);
-    return nodes.size() - 1;
+    int axis, mid;
+    float splitCost = count > 1 ? findBestSAHSplit(aabbs, context.indices, start, end, box, context.sweepAreas, axis, mid) : FLT_MAX;
+
+    if (count == 1 || (count <= MAX_LEAF_SIZE && computeLeafCost(count) <= splitCost)) {
+        node.primOffset = start;
+        node.primCount = count;
+        context.nodes[nodeIndex] = node;
+        return nodeIndex;
+    }
+
+    int leftBase = nodeBase;
+    int rightBase = nodeBase + 2 * (mid - start) - 1;
+    if (pool && end - start >= PARALLEL_BUILD_THRESHOLD) {
+        TaskGroup group(*pool);
+        group.run([&] { node.left = buildBVHRange(context, aabbs, start, mid, leftBase, pool); });
+        node.right = buildBVHRange(context, aabbs, mid, end, rightBase, pool);
+        group.wait();
+    }
+    else {
+        node.left = buildBVHRange(context, aabbs, start, mid, leftBase, pool);
+        node.right = buildBVHRange(context, aabbs, mid, end, rightBase, pool);
+    }
+
+    context.nodes[nodeIndex] = node;
+    return nodeIndex;
+}
+
+int buildBVH(BVHBuildContext& context, const std::vector<AABB>& aabbs, ThreadPool* pool = nullptr) {
+    int count = (int)context.indices.size();
+    int nodeBase = context.allocateNodes(2 * count - 1);
+    return buildBVHRange(context, aabbs, 0, count, nodeBase, pool);
+}
+
+// SAH cost of a whole tree: expected cost of tracing a ray that hits the root, used to compare builders
+float computeBVHCost(const std::vector<BVHNode>& nodes, int nodeIndex, float rootArea) {
+    const BVHNode& node = nodes[nodeIndex];
+    float probability = node.aabb.surfaceArea() / std::max(rootArea, FLT_MIN);
+    if (node.isLeaf())
+        return probability * computeLeafCost(node.primCount);
+    return probability * SAH_TRAVERSAL_COST
+        + computeBVHCost(nodes, node.left, rootArea)
+        + computeBVHCost(nodes, node.right, rootArea);
+}
+
+float computeBVHCost(const std::vector<BVHNode>& nodes, int root) {
+    return computeBVHCost(nodes, root, nodes[root].aabb.surfaceArea());
 }
 
 int flattenBVH(int nodeIndex, const std::vector<BVHNode>& nodes, std::vector<BVHNodeFlat>& flatNodes, int nextAfterSubtree) {
@@ -304,11 +521,11 @@ int flattenBVH(int nodeIndex, const std::vector<BVHNode>& nodes, std::vector<BVH
 
     
     // Leaf node
-    if (node.sphereIndex != -1) {
+    if (node.isLeaf()) {
         BVHNodeFlat& flat = flatNodes[currentIndex];
         flat.aabbMin = glm::vec4(node.aabb.min, 0.0f);
         flat.aabbMax = glm::vec4(node.aabb.max, 0.0f);
-        flat.meta = glm::ivec4(-1, -1, node.sphereIndex, nextAfterSubtree);
+        flat.meta = glm::ivec4(-1, node.primCount, node.primOffset, nextAfterSubtree);
         return currentIndex;
     }
 
@@ -323,3 +540,12 @@ int flattenBVH(int nodeIndex, const std::vector<BVHNode>& nodes, std::vector<BVH
 
     return currentIndex;
 }
+
+// Reorders a primitive array so the leaf ranges (which index the builder's index order) can be read directly
+template <typename T>
+std::vector<T> reorderPrimitives(const std::vector<T>& primitives, const std::vector<int>& order) {
+    std::vector<T> ordered(order.size());
+    for (size_t i = 0; i < order.size(); i++)
+        ordered[i] = primitives[order[i]];
+    return ordered;
+}
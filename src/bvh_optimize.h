@@ -0,0 +1,215 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "bvh.h"
+
+// Insertion based optimization of a built tree (Bittner, Hapala and Havran 2013, "Fast Insertion-Based
+// Optimization of Bounding Volume Hierarchies"). Top-down builders decide every split greedily, LBVH
+// doesn't look at surface areas at all, and both put big primitives (the ground sphere) deep in the
+// tree. Every pass goes over the nodes from the worst placed looking one down, pulls each one out of the
+// tree together with its parent and puts it back where the SAH cost grows the least. Only the topology
+// changes: leaves keep their primitive ranges, so context.indices and the reordered primitives stay
+// valid, and the result goes through flattenBVH and collapseBVH as before.
+
+struct BVHOptimizeSettings {
+    float batchFraction = 1.0f; // share of the nodes reinserted per pass, worst placed first
+    int maxPasses = 100;
+    float minImprovement = 0.001f; // stop once a pass lowers the SAH cost by less than this fraction
+};
+
+struct BVHOptimizeResult {
+    int root;
+    float costBefore;
+    float costAfter;
+    int passes = 0;
+    int reinsertions = 0;
+};
+
+class BVHOptimizer
+{
+public:
+    BVHOptimizer(std::vector<BVHNode>& nodes, int root) : nodes(nodes), root(root) {}
+
+    // The result holds the new root, which changes when a node is inserted above the old one
+    BVHOptimizeResult optimize(const BVHOptimizeSettings& settings = {}) {
+        BVHOptimizeResult result;
+        result.costBefore = computeBVHCost(nodes, root);
+        float cost = result.costBefore;
+
+        computeParents();
+        std::vector<int> candidates;
+        for (int pass = 0; pass < settings.maxPasses; pass++) {
+            selectCandidates(settings.batchFraction, candidates);
+            if (candidates.empty())
+                break;
+            for (int node : candidates) {
+                if (reinsert(node))
+                    result.reinsertions++;
+            }
+            result.passes++;
+
+            float newCost = computeBVHCost(nodes, root);
+            bool converged = cost - newCost < cost * settings.minImprovement;
+            cost = newCost;
+            if (converged)
+                break;
+        }
+
+        result.root = root;
+        result.costAfter = cost;
+        return result;
+    }
+
+private:
+    std::vector<BVHNode>& nodes;
+    int root;
+    std::vector<int> parents;   // parent of every reachable node, -1 for the root
+
+    // Arena slots the builder didn't use stay at -1, only nodes reachable from the root are touched
+    void computeParents() {
+        parents.assign(nodes.size(), -1);
+        std::vector<int> stack = { root };
+        while (!stack.empty()) {
+            int index = stack.back();
+            stack.pop_back();
+            const BVHNode& node = nodes[index];
+            if (node.isLeaf())
+                continue;
+            parents[node.left] = index;
+            parents[node.right] = index;
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+
+    float area(int node) const { return nodes[node].aabb.surfaceArea(); }
+
+    // Nodes are ranked by how much bigger they are than their children (the paper's M_sum * M_min * M_area):
+    // big nodes with loosely fitting children are the ones a better position helps most. Nodes directly
+    // below the root can't be removed, their parent would be the root.
+    void selectCandidates(float batchFraction, std::vector<int>& candidates) {
+        std::vector<std::pair<float, int>> ranked;
+        std::vector<int> stack = { root };
+        while (!stack.empty()) {
+            int index = stack.back();
+            stack.pop_back();
+            const BVHNode& node = nodes[index];
+            if (parents[index] >= 0 && parents[index] != root) {
+                float nodeArea = area(index);
+                float inefficiency = nodeArea;
+                if (!node.isLeaf()) {
+                    float leftArea = std::max(area(node.left), FLT_MIN);
+                    float rightArea = std::max(area(node.right), FLT_MIN);
+                    inefficiency *= nodeArea / std::min(leftArea, rightArea) * nodeArea / (leftArea + rightArea);
+                }
+                ranked.emplace_back(inefficiency, index);
+            }
+            if (!node.isLeaf()) {
+                stack.push_back(node.left);
+                stack.push_back(node.right);
+            }
+        }
+
+        int batch = std::min((int)ranked.size(), std::max(1, (int)(ranked.size() * batchFraction)));
+        std::partial_sort(ranked.begin(), ranked.begin() + batch, ranked.end(), std::greater<std::pair<float, int>>());
+        candidates.clear();
+        for (int i = 0; i < batch; i++)
+            candidates.push_back(ranked[i].second);
+    }
+
+    // Recomputes the bounds of node and all its ancestors
+    void refitUpwards(int node) {
+        for (; node >= 0; node = parents[node]) {
+            BVHNode& n = nodes[node];
+            n.aabb = surroundingBox(nodes[n.left].aabb, nodes[n.right].aabb);
+        }
+    }
+
+    void replaceChild(int parent, int oldChild, int newChild) {
+        if (nodes[parent].left == oldChild)
+            nodes[parent].left = newChild;
+        else
+            nodes[parent].right = newChild;
+        parents[newChild] = parent;
+    }
+
+    // Branch and bound search for the node whose position gives the cheapest insertion of box. Placing
+    // box next to x costs the area of the new parent (x and box together) plus the area every ancestor of
+    // x grows by, the induced cost. Subtrees are searched in order of induced cost and dropped once even
+    // the smallest possible parent (box alone) can't beat the best position found.
+    int findBestPosition(const AABB& box) const {
+        float boxArea = box.surfaceArea();
+        float bestCost = FLT_MAX;
+        int best = root;
+
+        using Entry = std::pair<float, int>; // induced cost, node
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+        queue.emplace(0.0f, root);
+        while (!queue.empty()) {
+            auto [inducedCost, index] = queue.top();
+            queue.pop();
+            if (inducedCost + boxArea >= bestCost)
+                break;
+
+            const BVHNode& node = nodes[index];
+            float mergedArea = surroundingBox(node.aabb, box).surfaceArea();
+            float cost = inducedCost + mergedArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                best = index;
+            }
+
+            float childInducedCost = cost - node.aabb.surfaceArea();
+            if (!node.isLeaf() && childInducedCost + boxArea < bestCost) {
+                queue.emplace(childInducedCost, node.left);
+                queue.emplace(childInducedCost, node.right);
+            }
+        }
+        return best;
+    }
+
+    // Takes node and its parent out of the tree (the sibling takes the parent's place), then reuses the
+    // parent to insert node at the best position. The old position is one of the positions searched, so
+    // the summed surface area of the inner nodes, the insertion cost findBestPosition minimizes, never
+    // goes up. The leaf cost of computeBVHCost can, as it weighs leaves by their primitive count, which
+    // is why optimize() measures every pass with it. Returns true if the node moved.
+    bool reinsert(int node) {
+        int parent = parents[node];
+        if (parent < 0 || parents[parent] < 0)
+            return false;
+        int grandparent = parents[parent];
+        int sibling = nodes[parent].left == node ? nodes[parent].right : nodes[parent].left;
+
+        replaceChild(grandparent, parent, sibling);
+        refitUpwards(grandparent);
+
+        int target = findBestPosition(nodes[node].aabb);
+
+        // parent becomes the common parent of target and node, in target's place
+        int targetParent = parents[target];
+        if (targetParent >= 0) {
+            replaceChild(targetParent, target, parent);
+        }
+        else {
+            root = parent;
+            parents[parent] = -1;
+        }
+        nodes[parent].left = target;
+        nodes[parent].right = node;
+        parents[target] = parent;
+        parents[node] = parent;
+        refitUpwards(parent);
+
+        return target != sibling;
+    }
+};
+
+// Optimizes the tree at root in place and returns the new root with the cost before and after
+BVHOptimizeResult optimizeBVH(std::vector<BVHNode>& nodes, int root, const BVHOptimizeSettings& settings = {}) {
+    BVHOptimizer optimizer(nodes, root);
+    return optimizer.optimize(settings);
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#include "bvh_wide.h"
+
+// Compressed wide BVH node: the child bounds are stored as 8 bit offsets from the node origin (the
+// min corner of the union of the children), in steps of 2^exponent per axis. Decoded child boxes are
+// always at least as big as the real ones (min rounded down, max rounded up), so a ray never misses a
+// box it would have hit and traversal returns the same closest hit, just with a few extra box hits.
+// 64 bytes for Width 4 and 112 bytes for Width 8, about half the size of BVHNodeWide.
+// Matches the std430 layout of BVHNodeQuantized in compute_shader.glsl, where the byte arrays are read
+// as packed uints (the struct is 16 byte aligned in std430 because of the vec3).
+template <int Width>
+struct alignas(16) BVHNodeQuantized {
+    glm::vec3 origin;
+    int8_t exponent[4];      // x, y, z, unused
+    uint8_t qMin[3 * Width]; // all x, then all y, then all z
+    uint8_t qMax[3 * Width];
+    int child[Width];        // same meaning as BVHNodeWide::child
+    uint8_t count[Width];    // leaf sphere count, fits in a byte since leaves hold at most MAX_LEAF_SIZE
+};
+
+using BVHNodeQuantized4 = BVHNodeQuantized<4>;
+using BVHNodeQuantized8 = BVHNodeQuantized<8>;
+
+static_assert(sizeof(BVHNodeQuantized4) == 64, "BVHNodeQuantized4 must match the std430 layout");
+static_assert(sizeof(BVHNodeQuantized8) == 112, "BVHNodeQuantized8 must match the std430 layout");
+
+// Kept well inside the normal float range so q * 2^exponent is always exact
+const int QUANTIZED_MIN_EXPONENT = -100;
+const int QUANTIZED_MAX_EXPONENT = 100;
+
+// Value of quantized step q on one axis, the same operation as the decode in the shader.
+// q * 2^exponent is exact, so the add is the only rounding and fused or not gives the same result.
+float dequantize(float origin, int exponent, int q) {
+    return origin + std::ldexp((float)q, exponent);
+}
+
+// Smallest exponent for which 255 steps cover [origin, maxValue] after rounding
+int quantizedExponent(float origin, float maxValue) {
+    float extent = maxValue - origin;
+    int exponent = QUANTIZED_MIN_EXPONENT;
+    if (extent > 0.0f)
+        exponent = std::max(exponent, (int)std::ceil(std::log2(extent / 255.0f)));
+
+    while (exponent < QUANTIZED_MAX_EXPONENT && dequantize(origin, exponent, 255) < maxValue)
+        exponent++;
+    return exponent;
+}
+
+// Quantizes one axis of a child box, moving the steps outwards until the decoded range contains it
+void quantizeRange(float origin, int exponent, float minValue, float maxValue, uint8_t& qMin, uint8_t& qMax) {
+    float step = std::ldexp(1.0f, exponent);
+    int lo = std::clamp((int)std::floor((minValue - origin) / step), 0, 255);
+    int hi = std::clamp((int)std::ceil((maxValue - origin) / step), 0, 255);
+
+    while (lo > 0 && dequantize(origin, exponent, lo) > minValue)
+        lo--;
+    while (hi < 255 && dequantize(origin, exponent, hi) < maxValue)
+        hi++;
+
+    qMin = (uint8_t)lo;
+    qMax = (uint8_t)hi;
+}
+
+template <int Width>
+BVHNodeQuantized<Width> quantizeNode(const BVHNodeWide<Width>& wide) {
+    const float* mins[3] = { wide.minX, wide.minY, wide.minZ };
+    const float* maxs[3] = { wide.maxX, wide.maxY, wide.maxZ };
+
+    BVHNodeQuantized<Width> quantized = {};
+    for (int axis = 0; axis < 3; axis++) {
+        float lo = FLT_MAX;
+        float hi = -FLT_MAX;
+        for (int slot = 0; slot < Width; slot++) {
+            if (wide.child[slot] < 0)
+                continue;
+            lo = std::min(lo, mins[axis][slot]);
+            hi = std::max(hi, maxs[axis][slot]);
+        }
+        if (lo > hi)
+            lo = hi = 0.0f; // no children at all
+
+        int exponent = quantizedExponent(lo, hi);
+        quantized.origin[axis] = lo;
+        quantized.exponent[axis] = (int8_t)exponent;
+
+        for (int slot = 0; slot < Width; slot++) {
+            if (wide.child[slot] < 0)
+                continue; // empty slots stay at zero, the traversal skips them on child < 0
+            quantizeRange(lo, exponent, mins[axis][slot], maxs[axis][slot],
+                          quantized.qMin[axis * Width + slot], quantized.qMax[axis * Width + slot]);
+        }
+    }
+
+    for (int slot = 0; slot < Width; slot++) {
+        quantized.child[slot] = wide.child[slot];
+        quantized.count[slot] = (uint8_t)wide.count[slot];
+    }
+    return quantized;
+}
+
+// Wide nodes keep their indices, so child references stay valid
+template <int Width>
+void quantizeBVH(const std::vector<BVHNodeWide<Width>>& wideNodes, std::vector<BVHNodeQuantized<Width>>& quantizedNodes) {
+    quantizedNodes.resize(wideNodes.size());
+    for (size_t i = 0; i < wideNodes.size(); i++)
+        quantizedNodes[i] = quantizeNode(wideNodes[i]);
+}
+
+// CPU decoder, gives the same (conservative) child box the shader tests
+template <int Width>
+AABB decodeQuantizedChild(const BVHNodeQuantized<Width>& node, int slot) {
+    AABB box;
+    for (int axis = 0; axis < 3; axis++) {
+        box.min[axis] = dequantize(node.origin[axis], node.exponent[axis], node.qMin[axis * Width + slot]);
+        box.max[axis] = dequantize(node.origin[axis], node.exponent[axis], node.qMax[axis * Width + slot]);
+    }
+    return box;
+}
+
+template <int Width>
+BVHNodeWide<Width> decodeQuantizedNode(const BVHNodeQuantized<Width>& node) {
+    BVHNodeWide<Width> wide;
+    for (int slot = 0; slot < Width; slot++) {
+        setWideChildBounds(wide, slot, decodeQuantizedChild(node, slot));
+        wide.child[slot] = node.child[slot];
+        wide.count[slot] = node.count[slot];
+    }
+    return wide;
+}
+
+// Round trip check of quantizeBVH: every decoded node keeps the children of the wide node it came from,
+// and every decoded child box contains the exact one, which is what lets traversal skip nothing
+template <int Width>
+bool validateQuantizedBVH(const std::vector<BVHNodeWide<Width>>& wideNodes, const std::vector<BVHNodeQuantized<Width>>& quantizedNodes) {
+    const int MAX_REPORTED = 10;
+    int errors = 0;
+    auto report = [&](const std::string& message) {
+        if (errors++ < MAX_REPORTED)
+            std::cerr << "Quantized BVH validation: " << message << std::endl;
+    };
+
+    if (wideNodes.size() != quantizedNodes.size())
+        report(std::to_string(quantizedNodes.size()) + " nodes instead of " + std::to_string(wideNodes.size()));
+
+    for (size_t i = 0; i < std::min(wideNodes.size(), quantizedNodes.size()); i++) {
+        const BVHNodeWide<Width>& exact = wideNodes[i];
+        BVHNodeWide<Width> decoded = decodeQuantizedNode(quantizedNodes[i]);
+        for (int slot = 0; slot < Width; slot++) {
+            std::string where = "node " + std::to_string(i) + " slot " + std::to_string(slot);
+            if (decoded.child[slot] != exact.child[slot] || decoded.count[slot] != exact.count[slot]) {
+                report(where + " has a different child");
+                continue;
+            }
+            if (exact.child[slot] < 0)
+                continue;
+
+            bool contains = decoded.minX[slot] <= exact.minX[slot] && decoded.maxX[slot] >= exact.maxX[slot]
+                         && decoded.minY[slot] <= exact.minY[slot] && decoded.maxY[slot] >= exact.maxY[slot]
+                         && decoded.minZ[slot] <= exact.minZ[slot] && decoded.maxZ[slot] >= exact.maxZ[slot];
+            if (!contains)
+                report(where + " decodes to a box that doesn't contain the exact one");
+        }
+    }
+
+    if (errors > MAX_REPORTED)
+        std::cerr << "Quantized BVH validation: " << errors - MAX_REPORTED << " more problems" << std::endl;
+    return errors == 0;
+}
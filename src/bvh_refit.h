@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "bvh.h"
+
+// Sorted set of modified array elements, turned into contiguous ranges for partial uploads
+struct DirtyRanges {
+    std::vector<int> indices;
+
+    void add(int index) { indices.push_back(index); }
+    bool empty() const { return indices.empty(); }
+    void clear() { indices.clear(); }
+
+    // Calls func(begin, end) for every range of dirty elements. Ranges closer than maxGap elements are
+    // merged, re-uploading a few clean elements is cheaper than issuing another upload.
+    template <typename F>
+    void forEachRange(int maxGap, F&& func) {
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+        size_t i = 0;
+        while (i < indices.size()) {
+            int begin = indices[i];
+            int end = begin + 1;
+            while (++i < indices.size() && indices[i] - end <= maxGap)
+                end = indices[i] + 1;
+            func(begin, end);
+        }
+    }
+};
+
+// Uploads the dirty elements of data to buffer with one glNamedBufferSubData per range, then clears them
+template <typename T>
+void uploadDirtyRanges(GLuint buffer, const std::vector<T>& data, DirtyRanges& dirty, int maxGap = 16) {
+    dirty.forEachRange(maxGap, [&](int begin, int end) {
+        glNamedBufferSubData(buffer, begin * sizeof(T), (end - begin) * sizeof(T), data.data() + begin);
+    });
+    dirty.clear();
+}
+
+// Keeps a flat binary BVH (flattenBVH layout) valid while spheres move, without rebuilding it. Moved
+// spheres get their leaf and the leaf's ancestors refit bottom-up in place, so an update costs
+// O(changed spheres * depth) and only the touched spheres and nodes need to be re-uploaded.
+// Refitting keeps the topology, so the tree gets worse as spheres drift away from where they were at
+// build time. The SAH cost is tracked incrementally and needsRebuild() reports when it got too far
+// above the cost right after the build.
+class RefitBVH
+{
+public:
+    std::vector<Sphere> spheres;      // leaf order, as uploaded
+    std::vector<BVHNodeFlat> nodes;
+    DirtyRanges dirtySpheres;
+    DirtyRanges dirtyNodes;
+
+    // order is the builder's index order: order[k] is the scene index of the sphere stored at k
+    void reset(std::vector<Sphere> sortedSpheres, std::vector<BVHNodeFlat> flatNodes, const std::vector<int>& order) {
+        spheres = std::move(sortedSpheres);
+        nodes = std::move(flatNodes);
+
+        sortedIndex.resize(order.size());
+        for (size_t k = 0; k < order.size(); k++)
+            sortedIndex[order[k]] = (int)k;
+
+        parents.assign(nodes.size(), -1);
+        leafOf.assign(spheres.size(), -1);
+        for (int i = 0; i < (int)nodes.size(); i++) {
+            const glm::ivec4& meta = nodes[i].meta;
+            if (isLeaf(i)) {
+                for (int k = meta.z; k < meta.z + meta.y; k++)
+                    leafOf[k] = i;
+            }
+            else {
+                parents[meta.x] = i;
+                parents[meta.y] = i;
+            }
+        }
+
+        weightedArea = 0.0;
+        for (int i = 0; i < (int)nodes.size(); i++)
+            weightedArea += costWeight(i) * nodeArea(i);
+        builtCost = cost();
+
+        pendingLeaves.clear();
+        dirtySpheres.clear();
+        dirtyNodes.clear();
+    }
+
+    // Scene order copy of the spheres, to rebuild from
+    std::vector<Sphere> sceneSpheres() const {
+        std::vector<Sphere> scene(spheres.size());
+        for (size_t i = 0; i < sortedIndex.size(); i++)
+            scene[i] = spheres[sortedIndex[i]];
+        return scene;
+    }
+
+    // Moves or resizes a sphere, by its index in the original scene. Takes effect on the next refit().
+    void updateSphere(int sceneIndex, const Sphere& sphere) {
+        int k = sortedIndex[sceneIndex];
+        spheres[k] = sphere;
+        dirtySpheres.add(k);
+        pendingLeaves.push_back(leafOf[k]);
+    }
+
+    // Refits the leaves of every sphere updated since the last call and their ancestors. All leaves are
+    // refit before walking up, so a walk can stop at the first node whose bounds didn't change: whatever
+    // else changed below it gets there with its own walk.
+    void refit() {
+        for (int leaf : pendingLeaves) {
+            const glm::ivec4& meta = nodes[leaf].meta;
+            AABB bounds = computeAABB(spheres[meta.z]);
+            for (int k = meta.z + 1; k < meta.z + meta.y; k++)
+                bounds = surroundingBox(bounds, computeAABB(spheres[k]));
+            setBounds(leaf, bounds);
+        }
+
+        for (int leaf : pendingLeaves) {
+            for (int node = parents[leaf]; node >= 0; node = parents[node]) {
+                const glm::ivec4& meta = nodes[node].meta;
+                AABB bounds = surroundingBox(nodeBounds(meta.x), nodeBounds(meta.y));
+                if (!setBounds(node, bounds))
+                    break;
+            }
+        }
+        pendingLeaves.clear();
+    }
+
+    // SAH cost of the tree as it is now, same measure as computeBVHCost
+    float cost() const {
+        return (float)(weightedArea / std::max(nodeArea(0), FLT_MIN));
+    }
+
+    float costAtBuild() const { return builtCost; }
+
+    // True once refitting made the tree more than threshold times as expensive as when it was built
+    bool needsRebuild(float threshold) const {
+        return cost() > builtCost * threshold;
+    }
+
+private:
+    std::vector<int> sortedIndex;  // scene index -> position in spheres
+    std::vector<int> parents;      // parent node, -1 for the root
+    std::vector<int> leafOf;       // leaf node holding each sphere
+    std::vector<int> pendingLeaves;
+    double weightedArea = 0.0;     // sum over all nodes of costWeight * surface area, double so updates don't drift
+    float builtCost = 0.0f;
+
+    bool isLeaf(int node) const { return nodes[node].meta.z != -1; }
+
+    // Per unit of probability, a node costs a traversal step and a leaf an intersection per primitive
+    float costWeight(int node) const {
+        return isLeaf(node) ? computeLeafCost(nodes[node].meta.y) : SAH_TRAVERSAL_COST;
+    }
+
+    AABB nodeBounds(int node) const {
+        return { glm::vec3(nodes[node].aabbMin), glm::vec3(nodes[node].aabbMax) };
+    }
+
+    float nodeArea(int node) const {
+        return nodeBounds(node).surfaceArea();
+    }
+
+    // Returns false if the bounds are unchanged
+    bool setBounds(int node, const AABB& bounds) {
+        BVHNodeFlat& flat = nodes[node];
+        if (glm::vec3(flat.aabbMin) == bounds.min && glm::vec3(flat.aabbMax) == bounds.max)
+            return false;
+
+        weightedArea -= costWeight(node) * nodeArea(node);
+        flat.aabbMin = glm::vec4(bounds.min, 0.0f);
+        flat.aabbMax = glm::vec4(bounds.max, 0.0f);
+        weightedArea += costWeight(node) * nodeArea(node);
+        dirtyNodes.add(node);
+        return true;
+    }
+};
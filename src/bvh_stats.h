@@ -0,0 +1,224 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "bvh_trace.h"
+
+// Quality metrics and correctness checks for flat binary BVHs (flattenBVH or the GPU LBVH, root first).
+// Everything works on the nodes as uploaded, so a tree is checked the way the shader will see it.
+
+const int LEAF_HISTOGRAM_BUCKETS = 9; // leaves of 1 to 8 primitives, the last bucket holds bigger ones
+const int DEFAULT_VALIDATION_RAYS = 1 << 20;
+
+struct BVHStats {
+    int nodes = 0;
+    int leaves = 0;
+    int primitives = 0;
+    int maxDepth = 0;
+    float averageLeafDepth = 0.0f;
+    float sahCost = 0.0f;
+    float overlap = 0.0f; // summed surface area of sibling box intersections, relative to the root
+    std::array<int, LEAF_HISTOGRAM_BUCKETS> leafSizes{}; // leafSizes[k] = number of leaves with k+1 primitives
+};
+
+BVHStats computeBVHStats(const std::vector<BVHNodeFlat>& nodes, int root = 0) {
+    BVHStats stats;
+    if (nodes.empty())
+        return stats;
+
+    auto bounds = [&](int index) {
+        return AABB{ glm::vec3(nodes[index].aabbMin), glm::vec3(nodes[index].aabbMax) };
+    };
+    float rootArea = std::max(bounds(root).surfaceArea(), FLT_MIN);
+    long long leafDepthSum = 0;
+
+    std::vector<std::pair<int, int>> stack = { { root, 0 } }; // node, depth
+    while (!stack.empty()) {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        const glm::ivec4& meta = nodes[index].meta;
+        float probability = bounds(index).surfaceArea() / rootArea;
+
+        stats.nodes++;
+        stats.maxDepth = std::max(stats.maxDepth, depth);
+        if (meta.z != -1) {
+            stats.leaves++;
+            stats.primitives += meta.y;
+            stats.leafSizes[std::min(meta.y, LEAF_HISTOGRAM_BUCKETS) - 1]++;
+            stats.sahCost += probability * computeLeafCost(meta.y);
+            leafDepthSum += depth;
+            continue;
+        }
+
+        stats.sahCost += probability * SAH_TRAVERSAL_COST;
+        AABB left = bounds(meta.x), right = bounds(meta.y);
+        glm::vec3 overlapMin = glm::max(left.min, right.min);
+        glm::vec3 overlapMax = glm::min(left.max, right.max);
+        if (glm::all(glm::lessThan(overlapMin, overlapMax)))
+            stats.overlap += AABB{ overlapMin, overlapMax }.surfaceArea() / rootArea;
+
+        stack.push_back({ meta.x, depth + 1 });
+        stack.push_back({ meta.y, depth + 1 });
+    }
+    stats.averageLeafDepth = stats.leaves > 0 ? (float)leafDepthSum / stats.leaves : 0.0f;
+    return stats;
+}
+
+// One line for the build log, e.g.
+// "SAH 16.18 | 439 nodes, 220 leaves, depth 12 (avg 8.9) | overlap 0.41 | leaf sizes 1:10 2:96 3:80 4:34"
+std::string formatBVHStats(const BVHStats& stats) {
+    char line[256];
+    snprintf(line, sizeof(line), "SAH %.2f | %d nodes, %d leaves, depth %d (avg %.1f) | overlap %.2f | leaf sizes",
+             stats.sahCost, stats.nodes, stats.leaves, stats.maxDepth, stats.averageLeafDepth, stats.overlap);
+    std::string result = line;
+    for (int k = 0; k < LEAF_HISTOGRAM_BUCKETS; k++) {
+        if (stats.leafSizes[k] == 0)
+            continue;
+        snprintf(line, sizeof(line), " %d%s:%d", k + 1, k + 1 == LEAF_HISTOGRAM_BUCKETS ? "+" : "", stats.leafSizes[k]);
+        result += line;
+    }
+    return result;
+}
+
+// Structural check of the trees at roots (one per BLAS, or just 0), which together must reference every
+// primitive exactly once. Child links are followed to find the node that has to come after each one, and
+// every skip link (meta.w) must point there, so the stackless traversal reaches every node whose box is
+// hit. Child boxes must lie inside their parent's and leaf boxes must hold the boxes of their primitives
+// (primitiveAABBs, in leaf order). Prints the first problems found to std::cerr and returns false if
+// there were any.
+bool validateBVH(const std::vector<BVHNodeFlat>& nodes, const std::vector<AABB>& primitiveAABBs, const std::vector<int>& roots = { 0 }) {
+    const int MAX_REPORTED = 10;
+    int errors = 0;
+    auto report = [&](const std::string& message) {
+        if (errors++ < MAX_REPORTED)
+            std::cerr << "BVH validation: " << message << std::endl;
+    };
+    auto contains = [](const BVHNodeFlat& outer, const AABB& inner) {
+        return glm::all(glm::lessThanEqual(glm::vec3(outer.aabbMin), inner.min))
+            && glm::all(glm::greaterThanEqual(glm::vec3(outer.aabbMax), inner.max));
+    };
+
+    std::vector<int> nodeVisits(nodes.size(), 0);
+    std::vector<int> primitiveVisits(primitiveAABBs.size(), 0);
+    std::vector<std::pair<int, int>> stack; // node, the node the traversal must continue with after it
+
+    for (int root : roots) {
+        stack.push_back({ root, -1 });
+        while (!stack.empty()) {
+            auto [index, next] = stack.back();
+            stack.pop_back();
+            if (index < 0 || index >= (int)nodes.size()) {
+                report("node index " + std::to_string(index) + " out of range");
+                continue;
+            }
+            if (nodeVisits[index]++ > 0) {
+                report("node " + std::to_string(index) + " is reachable twice");
+                continue;
+            }
+
+            const BVHNodeFlat& node = nodes[index];
+            if (node.meta.w != next)
+                report("node " + std::to_string(index) + " skips to " + std::to_string(node.meta.w) + " instead of " + std::to_string(next));
+
+            if (node.meta.z != -1) {
+                int first = node.meta.z, count = node.meta.y;
+                if (count <= 0 || first < 0 || first + count > (int)primitiveAABBs.size()) {
+                    report("leaf " + std::to_string(index) + " has an invalid primitive range");
+                    continue;
+                }
+                for (int i = first; i < first + count; i++) {
+                    primitiveVisits[i]++;
+                    if (!contains(node, primitiveAABBs[i]))
+                        report("leaf " + std::to_string(index) + " doesn't bound primitive " + std::to_string(i));
+                }
+                continue;
+            }
+
+            // Left then right, so the left subtree continues with the right child
+            for (int child : { node.meta.x, node.meta.y }) {
+                if (child >= 0 && child < (int)nodes.size()) {
+                    const BVHNodeFlat& c = nodes[child];
+                    if (!contains(node, { glm::vec3(c.aabbMin), glm::vec3(c.aabbMax) }))
+                        report("node " + std::to_string(index) + " doesn't bound its child " + std::to_string(child));
+                }
+            }
+            stack.push_back({ node.meta.y, next });
+            stack.push_back({ node.meta.x, node.meta.y });
+        }
+    }
+
+    for (size_t i = 0; i < primitiveAABBs.size(); i++) {
+        if (primitiveVisits[i] != 1)
+            report("primitive " + std::to_string(i) + " is in " + std::to_string(primitiveVisits[i]) + " leaves");
+    }
+
+    if (errors > MAX_REPORTED)
+        std::cerr << "BVH validation: " << errors - MAX_REPORTED << " more problems" << std::endl;
+    return errors == 0;
+}
+
+bool validateBVH(const std::vector<BVHNodeFlat>& nodes, const std::vector<Sphere>& spheres, const std::vector<int>& roots = { 0 }) {
+    std::vector<AABB> aabbs;
+    aabbs.reserve(spheres.size());
+    for (const Sphere& sphere : spheres)
+        aabbs.push_back(computeAABB(sphere));
+    return validateBVH(nodes, aabbs, roots);
+}
+
+// Closest hit by testing every sphere, the CPU version of world_hit
+int traceBruteForce(const std::vector<Sphere>& spheres, const Ray& ray, float tMin, float& closest) {
+    int hitIndex = -1;
+    for (int i = 0; i < (int)spheres.size(); i++) {
+        if (hitSphere(spheres[i], ray, tMin, closest))
+            hitIndex = i;
+    }
+    return hitIndex;
+}
+
+// Traces rayCount random rays (origins in and around the scene, uniform directions) through the BVH and
+// by brute force and returns how many disagree. A ray grazing a sphere can hit it and still miss the
+// rounded box, so a handful of mismatches on millions of rays is expected, more means a broken tree.
+int crossCheckTraversal(const std::vector<BVHNodeFlat>& nodes, const std::vector<Sphere>& spheres, int rayCount, ThreadPool* pool = nullptr) {
+    if (nodes.empty() || spheres.empty())
+        return 0;
+
+    // The scene without very large spheres (the ground), so most rays start near the small ones
+    AABB scene = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+    for (const Sphere& sphere : spheres) {
+        if (sphere.radius < 100.0f)
+            scene = surroundingBox(scene, computeAABB(sphere));
+    }
+    if (scene.min.x > scene.max.x)
+        scene = computeAABB(spheres[0]);
+    glm::vec3 margin = 0.1f * (scene.max - scene.min);
+    scene.min -= margin;
+    scene.max += margin;
+
+    const int CHUNK = 1 << 12;
+    std::atomic<int> mismatches{ 0 };
+    parallelFor(pool, 0, rayCount, CHUNK, [&](int chunkBegin, int chunkEnd) {
+        std::mt19937 generator(chunkBegin);
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        std::normal_distribution<float> normal(0.0f, 1.0f);
+        int chunkMismatches = 0;
+        for (int i = chunkBegin; i < chunkEnd; i++) {
+            glm::vec3 t(uniform(generator), uniform(generator), uniform(generator));
+            glm::vec3 direction(normal(generator), normal(generator), normal(generator));
+            Ray ray = { scene.min + t * (scene.max - scene.min), glm::normalize(direction) };
+
+            float bvhClosest = FLT_MAX, bruteClosest = FLT_MAX;
+            int bvhHit = traceBVH(nodes, spheres, ray, 0.001f, bvhClosest);
+            int bruteHit = traceBruteForce(spheres, ray, 0.001f, bruteClosest);
+            if (bvhHit != bruteHit && bvhClosest != bruteClosest)
+                chunkMismatches++;
+        }
+        mismatches.fetch_add(chunkMismatches, std::memory_order_relaxed);
+    });
+    return mismatches.load();
+}
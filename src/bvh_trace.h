@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "bvh.h"
+
+// CPU versions of the shader's sphere test and stackless traversal, to measure and check BVHs without
+// rendering. They read the same flat nodes and leaf ordered spheres that are uploaded.
+
+struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction;
+};
+
+// Same as hit_sphere in compute_shader.glsl, shrinks closest on a hit
+bool hitSphere(const Sphere& sphere, const Ray& ray, float tMin, float& closest) {
+    glm::vec3 oc = sphere.position - ray.origin;
+    float a = glm::dot(ray.direction, ray.direction);
+    float h = glm::dot(oc, ray.direction);
+    float c = glm::dot(oc, oc) - sphere.radius * sphere.radius;
+
+    float discriminant = h * h - a * c;
+    if (discriminant < 0.0f)
+        return false;
+
+    float sqrtd = std::sqrt(discriminant);
+    float root = (h - sqrtd) / a;
+    if (root < tMin || root > closest) {
+        root = (h + sqrtd) / a;
+        if (root < tMin || root > closest)
+            return false;
+    }
+    closest = root;
+    return true;
+}
+
+bool intersectAABB(const glm::vec3& boxMin, const glm::vec3& boxMax, const Ray& ray, const glm::vec3& invDir, float tMax) {
+    glm::vec3 t0 = (boxMin - ray.origin) * invDir;
+    glm::vec3 t1 = (boxMax - ray.origin) * invDir;
+    glm::vec3 tNear = glm::min(t0, t1);
+    glm::vec3 tFar = glm::max(t0, t1);
+    float nearest = std::max(std::max(tNear.x, tNear.y), tNear.z);
+    float farthest = std::min(std::min(tFar.x, tFar.y), tFar.z);
+    return nearest < farthest && farthest > 0.0f && nearest < tMax;
+}
+
+// Stackless traversal following the skip links, like world_hit_aabb_stackless. Returns the index of the
+// closest sphere hit (in leaf order) or -1, closest is the hit distance.
+int traceBVH(const std::vector<BVHNodeFlat>& nodes, const std::vector<Sphere>& spheres, const Ray& ray, float tMin, float& closest) {
+    glm::vec3 invDir = 1.0f / ray.direction;
+    int hitIndex = -1;
+    int index = nodes.empty() ? -1 : 0;
+    while (index >= 0) {
+        const BVHNodeFlat& node = nodes[index];
+        if (intersectAABB(glm::vec3(node.aabbMin), glm::vec3(node.aabbMax), ray, invDir, closest)) {
+            if (node.meta.z != -1) {
+                for (int i = node.meta.z; i < node.meta.z + node.meta.y; i++) {
+                    if (hitSphere(spheres[i], ray, tMin, closest))
+                        hitIndex = i;
+                }
+                index = node.meta.w;
+            }
+            else {
+                index = node.meta.x;
+            }
+        }
+        else {
+            index = node.meta.w;
+        }
+    }
+    return hitIndex;
+}
+
+// A fixed set of rays for benchmarking: one primary ray per pixel of a width x height image of the camera
+// (matrices as in CameraData), plus a diffuse bounce from every primary hit so incoherent rays are
+// measured too. Seeded, so two trees over the same scene are measured with the same rays.
+std::vector<Ray> generateBenchmarkRays(const glm::vec3& cameraPosition, const glm::mat4& invView, const glm::mat4& invProjection,
+                                       int width, int height, const std::vector<BVHNodeFlat>& nodes, const std::vector<Sphere>& spheres) {
+    std::mt19937 generator(1234);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+
+    std::vector<Ray> rays;
+    rays.reserve(2 * (size_t)width * height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            // Same unprojection as main() in compute_shader.glsl, through the pixel center
+            glm::vec2 ndc = (glm::vec2(x, y) + 0.5f) / glm::vec2(width, height) * 2.0f - 1.0f;
+            glm::vec4 viewPos = invProjection * glm::vec4(ndc, -1.0f, 1.0f);
+            viewPos /= viewPos.w;
+            glm::vec3 worldPos = glm::vec3(invView * viewPos);
+            Ray primary = { cameraPosition, glm::normalize(worldPos - cameraPosition) };
+            rays.push_back(primary);
+
+            float closest = FLT_MAX;
+            int hit = traceBVH(nodes, spheres, primary, 0.001f, closest);
+            if (hit < 0)
+                continue;
+            glm::vec3 point = primary.origin + closest * primary.direction;
+            glm::vec3 surfaceNormal = glm::normalize(point - spheres[hit].position);
+            glm::vec3 scatter = glm::normalize(glm::vec3(normal(generator), normal(generator), normal(generator)));
+            rays.push_back({ point, glm::normalize(surfaceNormal + scatter * 0.999f) });
+        }
+    }
+    return rays;
+}
+
+// Closest hit rays per second over rays, best of a few runs after a warm up run so a one off stall or
+// cold caches don't count
+double measureRaysPerSecond(const std::vector<BVHNodeFlat>& nodes, const std::vector<Sphere>& spheres,
+                            const std::vector<Ray>& rays, ThreadPool* pool = nullptr, int runs = 3) {
+    double bestSeconds = DBL_MAX;
+    std::atomic<int> hits{ 0 }; // keeps the traversals from being optimized away
+    for (int run = -1; run < runs; run++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        parallelFor(pool, 0, (int)rays.size(), 1024, [&](int chunkBegin, int chunkEnd) {
+            int chunkHits = 0;
+            for (int i = chunkBegin; i < chunkEnd; i++) {
+                float closest = FLT_MAX;
+                chunkHits += traceBVH(nodes, spheres, rays[i], 0.001f, closest) >= 0;
+            }
+            hits.fetch_add(chunkHits, std::memory_order_relaxed);
+        });
+        auto end = std::chrono::high_resolution_clock::now();
+        if (run >= 0)
+            bestSeconds = std::min(bestSeconds, std::chrono::duration<double>(end - start).count());
+    }
+    return rays.size() / std::max(bestSeconds, 1e-9);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "bvh.h"
+
+// Wide BVH node with the child bounds stored structure of arrays (all min.x together, and so on), so a
+// single node fetch has everything needed to test every child, and the CPU can test them with SIMD.
+// Matches the std430 layout of BVHNodeWide in compute_shader.glsl (float arrays are tightly packed).
+// child[i] is the wide node index of an inner child, or the first primitive of a leaf child when
+// count[i] > 0. Empty slots have child[i] = -1.
+template <int Width>
+struct BVHNodeWide {
+    float minX[Width];
+    float minY[Width];
+    float minZ[Width];
+    float maxX[Width];
+    float maxY[Width];
+    float maxZ[Width];
+    int child[Width];
+    int count[Width];
+};
+
+using BVHNode4 = BVHNodeWide<4>;
+using BVHNode8 = BVHNodeWide<8>;
+
+template <int Width>
+void setWideChildBounds(BVHNodeWide<Width>& wide, int slot, const AABB& aabb) {
+    wide.minX[slot] = aabb.min.x;
+    wide.minY[slot] = aabb.min.y;
+    wide.minZ[slot] = aabb.min.z;
+    wide.maxX[slot] = aabb.max.x;
+    wide.maxY[slot] = aabb.max.y;
+    wide.maxZ[slot] = aabb.max.z;
+}
+
+// Collapses the binary subtree below nodeIndex into wide nodes, appended to wideNodes in depth first
+// order, and returns the index of the wide node. Starting from the two children of the binary node,
+// the inner child with the biggest surface area is repeatedly replaced by its own two children until
+// Width slots are used. Picking the biggest boxes removes the levels rays are most likely to visit.
+template <int Width>
+int collapseBVH(const std::vector<BVHNode>& nodes, int nodeIndex, std::vector<BVHNodeWide<Width>>& wideNodes) {
+    const BVHNode& node = nodes[nodeIndex];
+
+    int children[Width];
+    int numChildren = 0;
+    if (node.isLeaf()) {
+        children[numChildren++] = nodeIndex;
+    }
+    else {
+        children[numChildren++] = node.left;
+        children[numChildren++] = node.right;
+    }
+
+    while (numChildren < Width) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (int i = 0; i < numChildren; i++) {
+            const BVHNode& child = nodes[children[i]];
+            if (!child.isLeaf() && child.aabb.surfaceArea() > bestArea) {
+                bestArea = child.aabb.surfaceArea();
+                best = i;
+            }
+        }
+        if (best < 0)
+            break; // only leaves left
+
+        const BVHNode& expanded = nodes[children[best]];
+        children[best] = expanded.left;
+        children[numChildren++] = expanded.right;
+    }
+
+    int wideIndex = (int)wideNodes.size();
+    wideNodes.emplace_back();
+
+    for (int slot = 0; slot < Width; slot++) {
+        BVHNodeWide<Width>& wide = wideNodes[wideIndex];
+        if (slot >= numChildren) {
+            setWideChildBounds(wide, slot, AABB{ glm::vec3(0.0f), glm::vec3(0.0f) });
+            wide.child[slot] = -1;
+            wide.count[slot] = 0;
+            continue;
+        }
+
+        const BVHNode& child = nodes[children[slot]];
+        setWideChildBounds(wide, slot, child.aabb);
+        if (child.isLeaf()) {
+            wide.child[slot] = child.primOffset;
+            wide.count[slot] = child.primCount;
+        }
+        else {
+            // Recursion may grow wideNodes, so don't hold on to the reference across it
+            int childIndex = collapseBVH(nodes, children[slot], wideNodes);
+            wideNodes[wideIndex].child[slot] = childIndex;
+            wideNodes[wideIndex].count[slot] = 0;
+        }
+    }
+
+    return wideIndex;
+}
+
+// collapseBVH for a flattened binary BVH (root first), when only the uploaded nodes are at hand
+template <int Width>
+void collapseFlatBVH(const BVHNodeFlat* flatNodes, int nodeCount, std::vector<BVHNodeWide<Width>>& wideNodes) {
+    std::vector<BVHNode> nodes(nodeCount);
+    for (int i = 0; i < nodeCount; i++) {
+        const BVHNodeFlat& flat = flatNodes[i];
+        nodes[i].aabb = AABB{ glm::vec3(flat.aabbMin), glm::vec3(flat.aabbMax) };
+        if (flat.meta.z == -1) {
+            nodes[i].left = flat.meta.x;
+            nodes[i].right = flat.meta.y;
+        }
+        else {
+            nodes[i].left = nodes[i].right = -1;
+            nodes[i].primOffset = flat.meta.z;
+            nodes[i].primCount = flat.meta.y;
+        }
+    }
+    wideNodes.clear();
+    if (nodeCount > 0)
+        collapseBVH(nodes, 0, wideNodes);
+}
+
+// Depth of the deepest node of a collapsed BVH, the root being at depth 0
+template <int Width>
+int wideBVHDepth(const std::vector<BVHNodeWide<Width>>& wideNodes) {
+    int maxDepth = 0;
+    std::vector<std::pair<int, int>> stack; // node, depth
+    if (!wideNodes.empty())
+        stack.push_back({ 0, 0 });
+    while (!stack.empty()) {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        maxDepth = std::max(maxDepth, depth);
+
+        const BVHNodeWide<Width>& node = wideNodes[index];
+        for (int slot = 0; slot < Width; slot++) {
+            if (node.child[slot] >= 0 && node.count[slot] == 0)
+                stack.push_back({ node.child[slot], depth + 1 });
+        }
+    }
+    return maxDepth;
+}
+
+// Entries the shader's wide traversal stack needs. Pushing the children of a node at depth d leaves at
+// most width - 1 pending siblings on each level from 1 to d, plus the width children themselves, which
+// is (width - 1) * (d + 1) + 1 entries, and children only exist down to d + 1 = depth.
+int wideStackSize(int width, int depth) {
+    return (width - 1) * depth + 1;
+}
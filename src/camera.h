@@ -1,3 +1,5 @@
+#pragma once
+
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 struct CameraSettings
@@ -67,8 +69,9 @@ class Camera {
             right = glm::normalize(glm::cross(forward, settings.vup));
             up = glm::cross(right, forward); // ensures orthonormal
             
-            yaw = -165.0f; // initialized looking toward -Z
-            pitch = -5.0f;
+            // Angles of the initial view direction, update() rebuilds the direction from them every frame
+            yaw = glm::degrees(std::atan2(forward.z, forward.x));
+            pitch = glm::degrees(std::asin(glm::clamp(forward.y, -1.0f, 1.0f)));
 
             data.view = glm::lookAt(settings.lookfrom, settings.lookat, settings.vup);
             data.projection = glm::perspective(glm::radians(settings.vfov), settings.aspect_ratio, 0.1f, 1000.0f);
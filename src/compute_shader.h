@@ -5,6 +5,7 @@
 #include <sstream>
 #include <iostream>
 #include <filesystem>
+#include <vector>
 
 class ComputeShader
 {
@@ -13,12 +14,13 @@ public:
     // ------------------------------------------------------------------------
     ComputeShader() {} // default constructor
 
-    ComputeShader(const std::filesystem::path& path)
+    // defines are "NAME" or "NAME VALUE" strings, added as #define lines to the source
+    ComputeShader(const std::filesystem::path& path, const std::vector<std::string>& defines = {})
     {
-        ID = loadShader(path);
+        ID = loadShader(path, defines);
     }
 
-    uint32_t loadShader(const std::filesystem::path& path) {
+    uint32_t loadShader(const std::filesystem::path& path, const std::vector<std::string>& defines = {}) {
         std::ifstream file(path);
 
         if (!file.is_open())
@@ -29,6 +31,13 @@ public:
         std::ostringstream contentStream;
         contentStream << file.rdbuf();
         std::string shaderSource = contentStream.str();
+
+        // Defines go right after the #version line, which has to stay first
+        std::string defineBlock;
+        for (const std::string& define : defines)
+            defineBlock += "#define " + define + "\n";
+        size_t versionEnd = shaderSource.find('\n', shaderSource.find("#version"));
+        shaderSource.insert(versionEnd == std::string::npos ? 0 : versionEnd + 1, defineBlock);
     
         GLuint shaderHandle = glCreateShader(GL_COMPUTE_SHADER);
     
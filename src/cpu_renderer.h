@@ -0,0 +1,640 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include <glm/gtc/constants.hpp>
+
+#include "bvh_trace.h"
+#include "bvh_wide.h"
+#include "camera.h"
+#include "primitives.h"
+#include "simd_trace.h"
+#include "thread_pool.h"
+
+// Headless path tracer on the CPU, a line by line port of ray_color2 in compute_shader.glsl: the same
+// camera (CameraData's inverse matrices and defocus disk), materials and stackless traversal of the
+// binary BVH, reading the same leaf ordered arrays that are uploaded. It needs no GL context, so it
+// renders on machines without a GPU and gives a reference to check the shader against.
+// The image is split into tiles that are tasks on the work-stealing pool, so cores that finish their
+// tiles early steal the remaining ones. With SIMD (simd_trace.h) primary rays are traced in packets
+// and bounces a ray at a time through a wide BVH, everything else stays scalar.
+
+const int CPU_TILE_SIZE = 16; // the shader's work group size
+
+// The arrays of an uploaded scene. Quads and primitive references are set for mixed scenes, the mesh
+// arrays with a mesh, everything else is nullptr.
+struct CPUScene
+{
+    const Sphere* spheres = nullptr;
+    const Material* materials = nullptr;
+    const BVHNodeFlat* nodes = nullptr;
+    int nodeCount = 0;
+    int primitiveCount = 0; // leaf slots: spheres, or primitive references in mixed scenes
+    const GPUQuad* quads = nullptr;
+    const uint32_t* primitiveRefs = nullptr;
+    const BVHNodeFlat* meshNodes = nullptr;
+    const glm::vec4* meshVertices = nullptr;
+    const glm::uvec4* meshTriangles = nullptr;
+};
+
+struct CPUHitRecord
+{
+    glm::vec3 point;
+    glm::vec3 normal;
+    uint32_t matIndex;
+    float t;
+    bool frontFace;
+};
+
+struct CPURenderStats
+{
+    double seconds = 0.0;
+    uint64_t rays = 0; // closest hit traversals, primary rays and bounces
+    unsigned threads = 1;
+    SimdISA isa = SimdISA::Scalar;
+};
+
+// The widest instruction set there are kernels for that this CPU runs
+SimdISA detectSimdISA() {
+#if defined(SIMD_AVX_KERNELS) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SimdISA::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SimdISA::AVX2;
+#endif
+#ifdef SIMD_SSE_KERNELS
+    return SimdISA::SSE;
+#else
+    return SimdISA::Scalar;
+#endif
+}
+
+const char* simdISAName(SimdISA isa) {
+    switch (isa) {
+    case SimdISA::SSE: return "SSE";
+    case SimdISA::AVX2: return "AVX2";
+    case SimdISA::AVX512: return "AVX-512";
+    default: return "scalar";
+    }
+}
+
+static_assert(sizeof(SimdBinaryNode) == sizeof(BVHNodeFlat), "SimdBinaryNode must match BVHNodeFlat");
+static_assert(sizeof(SimdWideNode<4>) == sizeof(BVHNode4) && sizeof(SimdWideNode<8>) == sizeof(BVHNode8), "SimdWideNode must match BVHNodeWide");
+
+// What the SIMD kernels of one instruction set need of a CPUScene: the leaf slots as structure of
+// arrays and the binary BVH collapsed to the kernels' node width. Without kernels (Scalar) it stays
+// empty and the scalar code runs.
+struct CPUSimdScene
+{
+    SimdISA isa = SimdISA::Scalar;
+    SimdTraceRay traceRay = nullptr;
+    SimdTracePacket tracePacket = nullptr;
+    int packetWidth = 1;
+    SimdScene scene = {};
+    std::vector<float> slotArrays; // the arrays of scene.primitives, one after the other
+    std::vector<BVHNode4> nodes4;
+    std::vector<BVHNode8> nodes8;
+};
+
+void prepareSimdScene(const CPUScene& scene, SimdISA isa, CPUSimdScene& simd) {
+    simd = CPUSimdScene();
+    int nodeWidth = 0;
+    switch (isa) {
+#ifdef SIMD_SSE_KERNELS
+    case SimdISA::SSE:
+        simd.traceRay = traceRaySSE;
+        simd.tracePacket = tracePacketSSE;
+        simd.packetWidth = 4;
+        nodeWidth = 4;
+        break;
+#endif
+#ifdef SIMD_AVX_KERNELS
+    case SimdISA::AVX2:
+        simd.traceRay = traceRayAVX2;
+        simd.tracePacket = tracePacketAVX2;
+        simd.packetWidth = 8;
+        nodeWidth = 8;
+        break;
+    case SimdISA::AVX512:
+        simd.traceRay = traceRayAVX2;
+        simd.tracePacket = tracePacketAVX512;
+        simd.packetWidth = 16;
+        nodeWidth = 8;
+        break;
+#endif
+    default:
+        return;
+    }
+    simd.isa = isa;
+
+    // Padded so the kernels can load a full vector from any slot; padding and quad slots have NaN
+    // sphere centers, padding and sphere slots zero quad normals
+    size_t stride = (size_t)scene.primitiveCount + SIMD_MAX_WIDTH;
+    int arrayCount = scene.quads ? 17 : 4;
+    simd.slotArrays.assign(arrayCount * stride, 0.0f);
+    float* arrays[17] = {};
+    for (int i = 0; i < arrayCount; i++)
+        arrays[i] = simd.slotArrays.data() + i * stride;
+    std::fill(arrays[0], arrays[3], std::numeric_limits<float>::quiet_NaN()); // the three center arrays
+    std::fill(arrays[3], arrays[3] + stride, -1.0f);
+
+    for (int slot = 0; slot < scene.primitiveCount; slot++) {
+        uint32_t ref = scene.primitiveRefs ? scene.primitiveRefs[slot] : encodePrimitiveRef(PRIMITIVE_SPHERE, (uint32_t)slot);
+        if (primitiveRefType(ref) == PRIMITIVE_SPHERE) {
+            const Sphere& sphere = scene.spheres[primitiveRefIndex(ref)];
+            const float values[4] = { sphere.position.x, sphere.position.y, sphere.position.z, sphere.radius };
+            for (int i = 0; i < 4; i++)
+                arrays[i][slot] = values[i];
+        }
+        else {
+            const GPUQuad& quad = scene.quads[primitiveRefIndex(ref)];
+            const float values[13] = { quad.normal.x, quad.normal.y, quad.normal.z, quad.D,
+                                       quad.corner_point.x, quad.corner_point.y, quad.corner_point.z,
+                                       quad.uAxis.x, quad.uAxis.y, quad.uAxis.z, quad.vAxis.x, quad.vAxis.y, quad.vAxis.z };
+            for (int i = 0; i < 13; i++)
+                arrays[4 + i][slot] = values[i];
+        }
+    }
+    simd.scene.primitives = { arrays[0], arrays[1], arrays[2], arrays[3], arrays[4], arrays[5], arrays[6], arrays[7], arrays[8],
+                              arrays[9], arrays[10], arrays[11], arrays[12], arrays[13], arrays[14], arrays[15], arrays[16],
+                              scene.quads != nullptr };
+
+    simd.scene.binaryNodes = reinterpret_cast<const SimdBinaryNode*>(scene.nodes);
+    if (nodeWidth == 4) {
+        collapseFlatBVH(scene.nodes, scene.nodeCount, simd.nodes4);
+        simd.scene.wideNodes = simd.nodes4.data();
+    }
+    else {
+        collapseFlatBVH(scene.nodes, scene.nodeCount, simd.nodes8);
+        simd.scene.wideNodes = simd.nodes8.data();
+    }
+}
+
+// The shader's generator, so both backends draw the same kind of numbers
+uint32_t xorShift32(uint32_t& state) {
+    uint32_t x = state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state = x;
+    return x;
+}
+
+float randomUnilateral(uint32_t& state) {
+    return (float)xorShift32(state) / 4294967295.0f;
+}
+
+float randomBilateral(uint32_t& state) {
+    return 2.0f * randomUnilateral(state) - 1.0f;
+}
+
+glm::vec3 randomUnitVector(uint32_t& state) {
+    float z = randomBilateral(state);
+    float phi = 2.0f * glm::pi<float>() * randomUnilateral(state);
+    float r = std::sqrt(std::max(1.0f - z * z, 0.0f));
+    return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// Concentric square to disk mapping, like sample_disk
+glm::vec2 sampleDisk(uint32_t& state) {
+    float x = 2.0f * randomUnilateral(state) - 1.0f;
+    float y = 2.0f * randomUnilateral(state) - 1.0f;
+    if (x == 0.0f && y == 0.0f)
+        return glm::vec2(0.0f);
+
+    float r, theta;
+    if (std::abs(x) > std::abs(y)) {
+        r = x;
+        theta = (glm::pi<float>() / 4.0f) * (y / x);
+    }
+    else {
+        r = y;
+        theta = (glm::pi<float>() / 2.0f) - (glm::pi<float>() / 4.0f) * (x / y);
+    }
+    return r * glm::vec2(std::cos(theta), std::sin(theta));
+}
+
+// Non zero start state of a pixel, decorrelated across pixels and seeds (integer hash by Chris Wellons)
+uint32_t pixelSeed(uint32_t seed, uint32_t pixel) {
+    uint32_t x = seed * 0x9e3779b9u ^ pixel;
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x != 0 ? x : 1;
+}
+
+void setFaceNormal(const Ray& ray, const glm::vec3& outwardNormal, CPUHitRecord& hit) {
+    hit.frontFace = glm::dot(ray.direction, outwardNormal) < 0.0f;
+    hit.normal = hit.frontFace ? outwardNormal : -outwardNormal;
+}
+
+bool hitSphere(const Sphere& sphere, const Ray& ray, float tMin, float tMax, CPUHitRecord& hit) {
+    float t = tMax;
+    if (!hitSphere(sphere, ray, tMin, t))
+        return false;
+    hit.t = t;
+    hit.point = ray.origin + t * ray.direction;
+    setFaceNormal(ray, glm::normalize(hit.point - sphere.position), hit);
+    hit.matIndex = sphere.material_index;
+    return true;
+}
+
+bool hitQuad(const GPUQuad& quad, const Ray& ray, float tMin, float tMax, CPUHitRecord& hit) {
+    float denom = glm::dot(quad.normal, ray.direction);
+    if (std::abs(denom) < 1e-8f)
+        return false;
+
+    float t = (quad.D - glm::dot(quad.normal, ray.origin)) / denom;
+    if (t < tMin || t > tMax)
+        return false;
+
+    glm::vec3 intersection = ray.origin + t * ray.direction;
+    glm::vec3 planarHit = intersection - quad.corner_point;
+    float alpha = glm::dot(planarHit, quad.uAxis);
+    float beta = glm::dot(planarHit, quad.vAxis);
+    if (alpha < 0.0f || alpha > 1.0f || beta < 0.0f || beta > 1.0f)
+        return false;
+
+    hit.t = t;
+    hit.point = intersection;
+    hit.matIndex = quad.material_index;
+    setFaceNormal(ray, quad.normal, hit);
+    return true;
+}
+
+// Moller-Trumbore, as hit_triangle
+bool hitTriangle(const CPUScene& scene, const glm::uvec4& triangle, const Ray& ray, float tMin, float tMax, CPUHitRecord& hit) {
+    glm::vec3 v0 = glm::vec3(scene.meshVertices[triangle.x]);
+    glm::vec3 edge1 = glm::vec3(scene.meshVertices[triangle.y]) - v0;
+    glm::vec3 edge2 = glm::vec3(scene.meshVertices[triangle.z]) - v0;
+
+    glm::vec3 p = glm::cross(ray.direction, edge2);
+    float det = glm::dot(edge1, p);
+    if (det == 0.0f)
+        return false;
+    float invDet = 1.0f / det;
+
+    glm::vec3 s = ray.origin - v0;
+    float u = glm::dot(s, p) * invDet;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+
+    glm::vec3 q = glm::cross(s, edge1);
+    float v = glm::dot(ray.direction, q) * invDet;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+
+    float t = glm::dot(edge2, q) * invDet;
+    if (t < tMin || t > tMax)
+        return false;
+
+    hit.t = t;
+    hit.point = ray.origin + t * ray.direction;
+    hit.matIndex = triangle.w;
+    setFaceNormal(ray, glm::normalize(glm::cross(edge1, edge2)), hit);
+    return true;
+}
+
+// Primitive i of a leaf range, a sphere or whatever primitiveRefs[i] references
+bool hitPrimitive(const CPUScene& scene, int i, const Ray& ray, float tMin, float tMax, CPUHitRecord& hit) {
+    if (!scene.primitiveRefs)
+        return hitSphere(scene.spheres[i], ray, tMin, tMax, hit);
+    uint32_t ref = scene.primitiveRefs[i];
+    if (primitiveRefType(ref) == PRIMITIVE_QUAD)
+        return hitQuad(scene.quads[primitiveRefIndex(ref)], ray, tMin, tMax, hit);
+    return hitSphere(scene.spheres[primitiveRefIndex(ref)], ray, tMin, tMax, hit);
+}
+
+// Stackless traversal of a binary BVH with skip links, testLeaf(first, count, closest) tests a leaf
+template <typename F>
+bool traverseStackless(const BVHNodeFlat* nodes, const Ray& ray, float tMax, F&& testLeaf) {
+    glm::vec3 invDir = 1.0f / ray.direction;
+    bool hitSomething = false;
+    float closest = tMax;
+    int index = 0;
+    while (index >= 0) {
+        const BVHNodeFlat& node = nodes[index];
+        if (!intersectAABB(glm::vec3(node.aabbMin), glm::vec3(node.aabbMax), ray, invDir, closest)) {
+            index = node.meta.w;
+            continue;
+        }
+        if (node.meta.z == -1) {
+            index = node.meta.x;
+            continue;
+        }
+        if (testLeaf(node.meta.z, node.meta.y, closest))
+            hitSomething = true;
+        index = node.meta.w;
+    }
+    return hitSomething;
+}
+
+// The hit record of a SIMD kernel's hit, the primitive in leaf slot hit at t
+void slotHit(const CPUScene& scene, int slot, const Ray& ray, float t, CPUHitRecord& hit) {
+    hit.t = t;
+    hit.point = ray.origin + t * ray.direction;
+    uint32_t ref = scene.primitiveRefs ? scene.primitiveRefs[slot] : encodePrimitiveRef(PRIMITIVE_SPHERE, (uint32_t)slot);
+    if (primitiveRefType(ref) == PRIMITIVE_QUAD) {
+        const GPUQuad& quad = scene.quads[primitiveRefIndex(ref)];
+        setFaceNormal(ray, quad.normal, hit);
+        hit.matIndex = quad.material_index;
+    }
+    else {
+        const Sphere& sphere = scene.spheres[primitiveRefIndex(ref)];
+        setFaceNormal(ray, glm::normalize(hit.point - sphere.position), hit);
+        hit.matIndex = sphere.material_index;
+    }
+}
+
+// The mesh's BVH, which only has to beat the closest hit so far (tMax)
+bool meshHit(const CPUScene& scene, const Ray& ray, float tMin, float tMax, CPUHitRecord& hit) {
+    return traverseStackless(scene.meshNodes, ray, tMax, [&](int first, int count, float& closest) {
+        bool hitLeaf = false;
+        for (int i = first; i < first + count; i++) {
+            if (hitTriangle(scene, scene.meshTriangles[i], ray, tMin, closest, hit)) {
+                closest = hit.t;
+                hitLeaf = true;
+            }
+        }
+        return hitLeaf;
+    });
+}
+
+// world_hit_bvh: the scene's BVH, with the SIMD kernel when there is one, then the mesh's
+bool worldHit(const CPUScene& scene, const CPUSimdScene& simd, const Ray& ray, float tMin, float tMax, CPUHitRecord& hit) {
+    bool hitSomething;
+    if (simd.traceRay) {
+        SimdHit simdHit = simd.traceRay(simd.scene, &ray.origin.x, &ray.direction.x, tMin, tMax);
+        hitSomething = simdHit.slot >= 0;
+        if (hitSomething)
+            slotHit(scene, simdHit.slot, ray, simdHit.t, hit);
+    }
+    else {
+        hitSomething = traverseStackless(scene.nodes, ray, tMax, [&](int first, int count, float& closest) {
+            bool hitLeaf = false;
+            for (int i = first; i < first + count; i++) {
+                if (hitPrimitive(scene, i, ray, tMin, closest, hit)) {
+                    closest = hit.t;
+                    hitLeaf = true;
+                }
+            }
+            return hitLeaf;
+        });
+    }
+    if (scene.meshNodes && meshHit(scene, ray, tMin, hitSomething ? hit.t : tMax, hit))
+        hitSomething = true;
+    return hitSomething;
+}
+
+float reflectance(float cosine, float refIdx) {
+    cosine = glm::clamp(cosine, 0.0f, 1.0f);
+    float r0 = (1.0f - refIdx) / (1.0f + refIdx);
+    r0 = r0 * r0;
+    return r0 + (1.0f - r0) * std::pow(1.0f - cosine, 5.0f);
+}
+
+bool scatter(const Material& mat, uint32_t& state, const Ray& rayIn, const CPUHitRecord& hit, glm::vec3& matColor, Ray& scattered) {
+    if (mat.type == MAT_EMISSIVE) {
+        matColor = mat.color;
+        return false;
+    }
+
+    if (mat.type == MAT_LAMBERTIAN) {
+        glm::vec3 scatterDir = hit.normal + randomUnitVector(state);
+        if (glm::length(scatterDir) < 0.0001f)
+            scatterDir = hit.normal;
+        scattered = { hit.point, glm::normalize(scatterDir) };
+        matColor = mat.color;
+        return true;
+    }
+
+    if (mat.type == MAT_METAL) {
+        glm::vec3 reflected = glm::reflect(glm::normalize(rayIn.direction), hit.normal);
+        reflected += mat.fuzz * randomUnitVector(state);
+        scattered = { hit.point, glm::normalize(reflected) };
+        matColor = mat.color;
+        return glm::dot(scattered.direction, hit.normal) > 0.0f;
+    }
+
+    if (mat.type == MAT_DIELECTRIC) {
+        matColor = glm::vec3(1.0f);
+        float ri = hit.frontFace ? (1.0f / mat.refractive_index) : mat.refractive_index;
+
+        glm::vec3 unitDir = glm::normalize(rayIn.direction);
+        float cosTheta = glm::clamp(glm::dot(-unitDir, hit.normal), 0.0f, 1.0f);
+        float sinTheta = std::sqrt(1.0f - cosTheta * cosTheta);
+
+        bool cannotRefract = ri * sinTheta > 1.0f;
+        glm::vec3 direction;
+        if (cannotRefract || reflectance(cosTheta, ri) > randomUnilateral(state))
+            direction = glm::reflect(unitDir, hit.normal);
+        else
+            direction = glm::refract(unitDir, hit.normal, ri);
+
+        if (glm::length(direction) < 0.0001f)
+            direction = hit.normal;
+        scattered = { hit.point, glm::normalize(direction) };
+        return true;
+    }
+    return false;
+}
+
+// ray_color2 for a ray that was already traced, hitSomething and hit are its closest hit. Traces at
+// most maxBounces rays in all, the first one included.
+glm::vec3 shadePath(const CPUScene& scene, const CPUSimdScene& simd, Ray ray, bool hitSomething, CPUHitRecord hit,
+                    int maxBounces, uint32_t& state, uint64_t& rays) {
+    glm::vec3 accumulated(1.0f);
+    glm::vec3 color(0.0f);
+    for (int bounce = 1; ; bounce++) {
+        if (!hitSomething) {
+            glm::vec3 unitDirection = glm::normalize(ray.direction);
+            float blend = 0.5f * (unitDirection.y + 1.0f);
+            color += accumulated * glm::mix(glm::vec3(1.0f), glm::vec3(0.5f, 0.7f, 1.0f), blend);
+            break;
+        }
+
+        const Material& mat = scene.materials[hit.matIndex];
+        Ray scattered;
+        glm::vec3 matColor;
+        if (!scatter(mat, state, ray, hit, matColor, scattered)) {
+            color += accumulated * matColor * mat.emission;
+            break;
+        }
+        accumulated *= matColor;
+        ray = scattered;
+        if (!(glm::length(accumulated) > 0.001f) || bounce >= maxBounces)
+            break;
+
+        rays++;
+        hitSomething = worldHit(scene, simd, ray, 0.001f, FLT_MAX, hit);
+    }
+    return color;
+}
+
+glm::vec3 rayColor(const CPUScene& scene, const CPUSimdScene& simd, const Ray& ray, int maxBounces, uint32_t& state, uint64_t& rays) {
+    if (maxBounces <= 0)
+        return glm::vec3(0.0f);
+    CPUHitRecord hit = {};
+    rays++;
+    bool hitSomething = worldHit(scene, simd, ray, 0.001f, FLT_MAX, hit);
+    return shadePath(scene, simd, ray, hitSomething, hit, maxBounces, state, rays);
+}
+
+// Renders samplesPerPixel samples of every pixel into image (linear, row 0 at the bottom like the
+// GL texture), with the SIMD kernels of isa unless it is Scalar. Every pixel draws its own random
+// numbers in the same order on every path, so for a seed the image doesn't depend on how the tiles end
+// up spread over the threads, and the instruction sets differ only by rounding.
+CPURenderStats renderCPU(const CPUScene& scene, const CameraData& camera, int width, int height, int samplesPerPixel,
+                         int maxBounces, uint32_t seed, SimdISA isa, std::vector<glm::vec3>& image, ThreadPool* pool = nullptr) {
+    CPUSimdScene simd;
+    prepareSimdScene(scene, isa, simd);
+
+    image.assign((size_t)width * height, glm::vec3(0.0f));
+    int tilesX = (width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+    int tilesY = (height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+    // Packets are 2x2, 4x2 or 4x4 pixel blocks, always within a tile
+    int packetWidth = simd.packetWidth >= 8 ? 4 : (simd.packetWidth == 4 ? 2 : 1);
+    int packetHeight = simd.packetWidth / packetWidth;
+
+    glm::vec2 invResolution = 1.0f / glm::vec2(width, height);
+    glm::vec3 cameraRight = glm::vec3(camera.inv_view[0]);
+    glm::vec3 cameraUp = glm::vec3(camera.inv_view[1]);
+    float lensRadius = std::tan(glm::radians(camera.defocus_angle * 0.5f)) * camera.focus_distance;
+
+    // Same unprojection and thin lens as main() in the shader
+    auto cameraRay = [&](int x, int y, uint32_t& state) {
+        glm::vec2 offset(randomUnilateral(state) - 0.5f, randomUnilateral(state) - 0.5f);
+        glm::vec2 ndc = (glm::vec2(x, y) + offset) * invResolution * 2.0f - 1.0f;
+        glm::vec4 viewPos = camera.inv_projection * glm::vec4(ndc, -1.0f, 1.0f);
+        viewPos /= viewPos.w;
+        glm::vec3 worldPos = glm::vec3(camera.inv_view * viewPos);
+        glm::vec3 dir = glm::normalize(worldPos - camera.lookfrom);
+
+        glm::vec2 lens = sampleDisk(state) * lensRadius;
+        glm::vec3 origin = camera.lookfrom + cameraRight * lens.x + cameraUp * lens.y;
+        glm::vec3 focalPoint = camera.lookfrom + dir * camera.focus_distance;
+        return Ray{ origin, glm::normalize(focalPoint - origin) };
+    };
+
+    std::atomic<uint64_t> totalRays{ 0 };
+    auto start = std::chrono::high_resolution_clock::now();
+    parallelFor(pool, 0, tilesX * tilesY, 1, [&](int tileBegin, int tileEnd) {
+        uint64_t rays = 0;
+        for (int tile = tileBegin; tile < tileEnd; tile++) {
+            int x0 = (tile % tilesX) * CPU_TILE_SIZE;
+            int y0 = (tile / tilesX) * CPU_TILE_SIZE;
+            int x1 = std::min(x0 + CPU_TILE_SIZE, width);
+            int y1 = std::min(y0 + CPU_TILE_SIZE, height);
+            if (!simd.tracePacket) {
+                for (int y = y0; y < y1; y++) {
+                    for (int x = x0; x < x1; x++) {
+                        uint32_t state = pixelSeed(seed, (uint32_t)(y * width + x));
+                        glm::vec3 pixelColor(0.0f);
+                        for (int s = 0; s < samplesPerPixel; s++)
+                            pixelColor += rayColor(scene, simd, cameraRay(x, y, state), maxBounces, state, rays);
+                        image[(size_t)y * width + x] = pixelColor / (float)samplesPerPixel;
+                    }
+                }
+                continue;
+            }
+
+            for (int py = y0; py < y1; py += packetHeight) {
+                for (int px = x0; px < x1; px += packetWidth) {
+                    int pixels[SIMD_MAX_WIDTH];
+                    uint32_t states[SIMD_MAX_WIDTH];
+                    glm::vec3 pixelColors[SIMD_MAX_WIDTH];
+                    int count = 0;
+                    for (int y = py; y < std::min(py + packetHeight, y1); y++) {
+                        for (int x = px; x < std::min(px + packetWidth, x1); x++) {
+                            pixels[count] = y * width + x;
+                            states[count] = pixelSeed(seed, (uint32_t)pixels[count]);
+                            pixelColors[count] = glm::vec3(0.0f);
+                            count++;
+                        }
+                    }
+
+                    for (int s = 0; s < samplesPerPixel && maxBounces > 0; s++) {
+                        Ray primary[SIMD_MAX_WIDTH];
+                        SimdPacket packet;
+                        packet.count = count;
+                        for (int i = 0; i < simd.packetWidth; i++) {
+                            // Lanes past count repeat the first ray, the kernel ignores them
+                            if (i < count)
+                                primary[i] = cameraRay(pixels[i] % width, pixels[i] / width, states[i]);
+                            const Ray& ray = primary[i < count ? i : 0];
+                            packet.originX[i] = ray.origin.x;
+                            packet.originY[i] = ray.origin.y;
+                            packet.originZ[i] = ray.origin.z;
+                            packet.directionX[i] = ray.direction.x;
+                            packet.directionY[i] = ray.direction.y;
+                            packet.directionZ[i] = ray.direction.z;
+                        }
+
+                        SimdHit hits[SIMD_MAX_WIDTH];
+                        simd.tracePacket(simd.scene, packet, 0.001f, hits);
+                        for (int i = 0; i < count; i++) {
+                            CPUHitRecord hit = {};
+                            bool hitSomething = hits[i].slot >= 0;
+                            if (hitSomething)
+                                slotHit(scene, hits[i].slot, primary[i], hits[i].t, hit);
+                            if (scene.meshNodes && meshHit(scene, primary[i], 0.001f, hitSomething ? hit.t : FLT_MAX, hit))
+                                hitSomething = true;
+                            rays++;
+                            pixelColors[i] += shadePath(scene, simd, primary[i], hitSomething, hit, maxBounces, states[i], rays);
+                        }
+                    }
+                    for (int i = 0; i < count; i++)
+                        image[pixels[i]] = pixelColors[i] / (float)samplesPerPixel;
+                }
+            }
+        }
+        totalRays.fetch_add(rays, std::memory_order_relaxed);
+    });
+    auto end = std::chrono::high_resolution_clock::now();
+
+    CPURenderStats stats;
+    stats.seconds = std::chrono::duration<double>(end - start).count();
+    stats.rays = totalRays.load();
+    stats.threads = pool ? pool->size() : 1;
+    stats.isa = simd.isa;
+    return stats;
+}
+
+float linearToSRGB(float linear) {
+    return linear <= 0.0031308f ? linear * 12.92f : std::pow(linear, 1.0f / 2.4f) * 1.055f - 0.055f;
+}
+
+// Binary PPM with the shader's sRGB curve, top row first. Returns false on errors, after printing them.
+bool writePPM(const std::filesystem::path& path, const std::vector<glm::vec3>& image, int width, int height) {
+    FILE* file = fopen(path.string().c_str(), "wb");
+    if (!file) {
+        std::cerr << "Failed to open " << path.string() << " for writing" << std::endl;
+        return false;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    std::vector<unsigned char> row(3 * (size_t)width);
+    for (int y = height - 1; y >= 0; y--) {
+        for (int x = 0; x < width; x++) {
+            const glm::vec3& color = image[(size_t)y * width + x];
+            for (int c = 0; c < 3; c++)
+                row[3 * x + c] = (unsigned char)(glm::clamp(linearToSRGB(color[c]), 0.0f, 1.0f) * 255.0f + 0.5f);
+        }
+        fwrite(row.data(), 1, row.size(), file);
+    }
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+        std::cerr << "Failed to write " << path.string() << std::endl;
+    return ok;
+}
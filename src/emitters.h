@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/gtc/constants.hpp>
+
+#include "primitives.h"
+#include "world.h"
+
+// Emissive primitives for next event estimation. Every sphere and quad with an emissive material gets
+// a record holding its geometry, its radiance and the probability of picking it, so the shader can
+// sample a point on a light without touching the primitive buffers. Records are sorted by primitive
+// reference: lights are picked by binary search over the cumulative probabilities and a light found by
+// a BSDF sampled ray is looked up by binary search over the references.
+
+// Matches Emitter in the shader (std430)
+struct alignas(16) GPUEmitter
+{
+    glm::vec4 position; // sphere: center and radius, quad: corner and area
+    glm::vec4 u;        // quad edge, w = probability of picking this emitter
+    glm::vec4 v;        // quad edge, w = probability of picking this emitter or one before it
+    glm::vec3 radiance; // color * emission, as the path tracer adds it on a hit
+    uint32_t primitiveRef; // encodePrimitiveRef of the primitive in its uploaded buffer
+};
+
+float luminance(const glm::vec3& color) {
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+// Emitters of spheres and quads in their uploaded (leaf) order. Lights are picked in proportion to
+// their power, luminance times area; lights that give no light are left out.
+std::vector<GPUEmitter> buildEmitters(const Sphere* spheres, size_t sphereCount, const std::vector<Quad>& quads, const Material* materials) {
+    std::vector<GPUEmitter> emitters;
+    std::vector<float> power;
+    auto add = [&](const GPUEmitter& emitter, float area) {
+        float p = luminance(emitter.radiance) * area;
+        if (p > 0.0f) {
+            emitters.push_back(emitter);
+            power.push_back(p);
+        }
+    };
+
+    for (uint32_t i = 0; i < (uint32_t)sphereCount; i++) {
+        const Material& material = materials[spheres[i].material_index];
+        if (material.type != MAT_EMISSIVE)
+            continue;
+        GPUEmitter emitter = {};
+        emitter.position = glm::vec4(spheres[i].position, spheres[i].radius);
+        emitter.radiance = material.color * material.emission;
+        emitter.primitiveRef = encodePrimitiveRef(PRIMITIVE_SPHERE, i);
+        add(emitter, 4.0f * glm::pi<float>() * spheres[i].radius * spheres[i].radius);
+    }
+    for (uint32_t i = 0; i < (uint32_t)quads.size(); i++) {
+        const Material& material = materials[quads[i].material_index];
+        if (material.type != MAT_EMISSIVE)
+            continue;
+        float area = glm::length(glm::cross(quads[i].u, quads[i].v));
+        GPUEmitter emitter = {};
+        emitter.position = glm::vec4(quads[i].corner_point, area);
+        emitter.u = glm::vec4(quads[i].u, 0.0f);
+        emitter.v = glm::vec4(quads[i].v, 0.0f);
+        emitter.radiance = material.color * material.emission;
+        emitter.primitiveRef = encodePrimitiveRef(PRIMITIVE_QUAD, i);
+        add(emitter, area);
+    }
+
+    double totalPower = 0.0;
+    for (float p : power)
+        totalPower += p;
+    double cumulative = 0.0;
+    for (size_t i = 0; i < emitters.size(); i++) {
+        cumulative += power[i];
+        emitters[i].u.w = (float)(power[i] / totalPower);
+        emitters[i].v.w = (float)(cumulative / totalPower);
+    }
+    if (!emitters.empty())
+        emitters.back().v.w = 1.0f; // rounding must not leave a gap at the top for the search to fall into
+    return emitters;
+}
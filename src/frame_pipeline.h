@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+
+// Keeps up to framesInFlight frames queued on the GPU, so the CPU prepares the next frame (camera,
+// uploads) while the GPU still runs the previous ones, instead of waiting for every frame's timer.
+// Each frame in flight has a slot with its own camera uniforms, traversal counters and timer query;
+// a slot is only reused once the fence of the frame that last used it has signaled, so nothing the
+// GPU may still read is overwritten. Timer results and counters are polled and arrive a few frames
+// late.
+class FramePipeline
+{
+public:
+    static const int MAX_FRAMES_IN_FLIGHT = 3;
+
+    // What a finished frame measured
+    struct FrameResult
+    {
+        GLuint64 computeTime = 0; // ns
+        GLuint nodeVisits = 0;    // traversal counters, zero without stats
+        GLuint traversals = 0;
+    };
+
+    FramePipeline() {}
+
+    FramePipeline(int framesInFlight, size_t uniformSize, bool stats) :
+        slotCount(std::clamp(framesInFlight, 1, MAX_FRAMES_IN_FLIGHT)), uniformSize(uniformSize)
+    {
+        GLint uniformAlignment = 1, storageAlignment = 1;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storageAlignment);
+        uniformStride = alignUp(uniformSize, uniformAlignment);
+
+        // Persistently mapped, written directly for each frame
+        const GLbitfield mapFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glCreateBuffers(1, &uniforms);
+        glNamedBufferStorage(uniforms, uniformStride * slotCount, nullptr, mapFlags);
+        mappedUniforms = (char*)glMapNamedBufferRange(uniforms, 0, uniformStride * slotCount, mapFlags);
+
+        if (stats) {
+            statsStride = alignUp(2 * sizeof(GLuint), storageAlignment);
+            glCreateBuffers(1, &counters);
+            glNamedBufferStorage(counters, statsStride * slotCount, nullptr, GL_DYNAMIC_STORAGE_BIT);
+        }
+
+        for (int i = 0; i < slotCount; i++)
+            glGenQueries(1, &slots[i].query);
+    }
+
+    // Makes the next slot current, waiting for the frame that used it last if it's still running
+    void beginFrame()
+    {
+        current = (current + 1) % slotCount;
+        Slot& slot = slots[current];
+        if (slot.fence) {
+            while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+            glDeleteSync(slot.fence);
+            slot.fence = nullptr;
+        }
+        // Its timer is done now and about to be reused
+        if (slot.pending)
+            readSlot(current);
+    }
+
+    // Copies this frame's uniforms into its slot and binds them
+    void uploadUniforms(const void* data, GLuint binding)
+    {
+        std::memcpy(mappedUniforms + current * uniformStride, data, uniformSize);
+        glBindBufferRange(GL_UNIFORM_BUFFER, binding, uniforms, current * uniformStride, uniformSize);
+    }
+
+    // Zeroes this frame's traversal counters and binds them
+    void bindStats(GLuint binding)
+    {
+        if (!counters)
+            return;
+        glClearNamedBufferSubData(counters, GL_R32UI, current * statsStride, 2 * sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, binding, counters, current * statsStride, 2 * sizeof(GLuint));
+    }
+
+    void beginTimer()
+    {
+        glBeginQuery(GL_TIME_ELAPSED, slots[current].query);
+    }
+
+    void endTimer()
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        slots[current].pending = true;
+        slots[current].frame = ++submitted;
+    }
+
+    // Fences everything the frame submitted, call once its slot is no longer used this frame
+    void endFrame()
+    {
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT); // counters are read back with glGetNamedBufferSubData
+        slots[current].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    // The newest frame that finished since the last call, without waiting. False if none did.
+    bool pollFinished(FrameResult& result)
+    {
+        // Oldest first, the slots after the current one were used longest ago
+        for (int k = 1; k <= slotCount; k++) {
+            int i = (current + k) % slotCount;
+            if (!slots[i].pending)
+                continue;
+            GLint available = 0;
+            glGetQueryObjectiv(slots[i].query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break; // later frames can't have finished before this one
+            readSlot(i);
+        }
+        if (!hasResult)
+            return false;
+        result = latest;
+        hasResult = false;
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        GLuint query = 0;
+        GLsync fence = nullptr;
+        bool pending = false; // timer not read yet
+        long long frame = 0;  // order of submission
+    };
+
+    Slot slots[MAX_FRAMES_IN_FLIGHT];
+    int slotCount = 1;
+    int current = 0;
+    long long submitted = 0;
+
+    GLuint uniforms = 0;
+    char* mappedUniforms = nullptr;
+    size_t uniformSize = 0;
+    size_t uniformStride = 0;
+    GLuint counters = 0; // two GLuint per slot, when stats are on
+    size_t statsStride = 0;
+
+    FrameResult latest;
+    long long latestFrame = 0;
+    bool hasResult = false;
+
+    static size_t alignUp(size_t size, GLint alignment)
+    {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+
+    // The slot's frame has finished, so neither read waits
+    void readSlot(int i)
+    {
+        Slot& slot = slots[i];
+        slot.pending = false;
+        if (slot.frame < latestFrame)
+            return;
+
+        latestFrame = slot.frame;
+        glGetQueryObjectui64v(slot.query, GL_QUERY_RESULT, &latest.computeTime);
+        if (counters) {
+            GLuint stats[2];
+            glGetNamedBufferSubData(counters, i * statsStride, sizeof(stats), stats);
+            latest.nodeVisits = stats[0];
+            latest.traversals = stats[1];
+        }
+        hasResult = true;
+    }
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <filesystem>
+#include <initializer_list>
+#include <string>
+
+#include "compute_shader.h"
+
+// Builds a linear BVH on the GPU (shader/lbvh.glsl), so a scene whose spheres change every frame can be
+// rebuilt without a CPU build or a node upload. build() reads the spheres from a source buffer and writes
+// the flat nodes (2n-1 BVHNodeFlat, root at 0) and the spheres in leaf order into the buffers the tracer
+// reads. The source buffer is left untouched, so the scene can keep being updated in its original order.
+class GpuLBVHBuilder
+{
+public:
+    static const int GROUP_SIZE = 256;    // matches lbvh.glsl
+    static const int RADIX_BITS = 4;
+    static const int RADIX_BUCKETS = 1 << RADIX_BITS;
+
+    GpuLBVHBuilder() {}
+
+    GpuLBVHBuilder(const std::filesystem::path& shaderPath)
+    {
+        boundsPass = ComputeShader(shaderPath, { "LBVH_PASS_BOUNDS" });
+        mortonPass = ComputeShader(shaderPath, { "LBVH_PASS_MORTON" });
+        histogramPass = ComputeShader(shaderPath, { "LBVH_PASS_HISTOGRAM" });
+        scanPass = ComputeShader(shaderPath, { "LBVH_PASS_SCAN" });
+        scatterPass = ComputeShader(shaderPath, { "LBVH_PASS_SCATTER" });
+        hierarchyPass = ComputeShader(shaderPath, { "LBVH_PASS_HIERARCHY" });
+        fitPass = ComputeShader(shaderPath, { "LBVH_PASS_FIT" });
+        flattenPass = ComputeShader(shaderPath, { "LBVH_PASS_FLATTEN" });
+        reorderPass = ComputeShader(shaderPath, { "LBVH_PASS_REORDER" });
+        glGenQueries(1, &timerQuery);
+    }
+
+    // sortedSpheres must hold count spheres and flatNodes 2*count-1 nodes
+    void build(GLuint sourceSpheres, GLuint sortedSpheres, GLuint flatNodes, int count)
+    {
+        if (count <= 0)
+            return;
+        reserve(count);
+
+        // The passes use low binding points, put back whatever the tracer had bound there afterwards
+        GLint savedBindings[MAX_PASS_BINDINGS];
+        for (int i = 0; i < MAX_PASS_BINDINGS; i++)
+            glGetIntegeri_v(GL_SHADER_STORAGE_BUFFER_BINDING, i, &savedBindings[i]);
+
+        glBeginQuery(GL_TIME_ELAPSED, timerQuery);
+
+        GLuint groups = groupCount(count);
+
+        // Centroid bounds, reduced with atomics into a buffer reset to (max, min)
+        const GLuint emptyBounds[8] = { 0xFFFFFFFFu, 0xFFFFFFFFu, 0xFFFFFFFFu, 0, 0, 0, 0, 0 };
+        glNamedBufferSubData(sceneBounds, 0, sizeof(emptyBounds), emptyBounds);
+        dispatch(boundsPass, groups, count, { sourceSpheres, sceneBounds });
+        dispatch(mortonPass, groups, count, { sourceSpheres, sceneBounds, keys[0], values[0] });
+
+        // 16 passes of 4 bits, even so the sorted keys end up back in keys[0]
+        for (int shift = 0; shift < 64; shift += RADIX_BITS) {
+            setSortUniforms(histogramPass, shift, groups);
+            dispatch(histogramPass, groups, count, { keys[0], histogram });
+            setSortUniforms(scanPass, shift, groups);
+            dispatch(scanPass, 1, count, { histogram });
+            setSortUniforms(scatterPass, shift, groups);
+            dispatch(scatterPass, groups, count, { keys[0], values[0], keys[1], values[1], histogram });
+            std::swap(keys[0], keys[1]);
+            std::swap(values[0], values[1]);
+        }
+
+        if (count > 1)
+            dispatch(hierarchyPass, groupCount(count - 1), count, { keys[0], children, parents, visits });
+        dispatch(fitPass, groups, count, { sourceSpheres, values[0], children, parents, nodeBounds, leafCounts, visits });
+        dispatch(flattenPass, groupCount(2 * count - 1), count, { children, parents, nodeBounds, leafCounts, flatNodes });
+        dispatch(reorderPass, groups, count, { sourceSpheres, values[0], sortedSpheres });
+
+        glEndQuery(GL_TIME_ELAPSED);
+
+        for (int i = 0; i < MAX_PASS_BINDINGS; i++)
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, i, savedBindings[i]);
+    }
+
+    // GPU time of the last build, waits for it to finish
+    double lastBuildTimeMs() const
+    {
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(timerQuery, GL_QUERY_RESULT, &elapsed);
+        return elapsed / 1e6;
+    }
+
+private:
+    static const int MAX_PASS_BINDINGS = 7;
+
+    ComputeShader boundsPass, mortonPass, histogramPass, scanPass, scatterPass;
+    ComputeShader hierarchyPass, fitPass, flattenPass, reorderPass;
+    GLuint timerQuery = 0;
+
+    GLuint sceneBounds = 0;
+    GLuint keys[2] = { 0, 0 };    // uvec2 Morton codes, ping-ponged by the sort
+    GLuint values[2] = { 0, 0 };  // sphere indices
+    GLuint histogram = 0;
+    GLuint children = 0;          // ivec2 per internal node
+    GLuint parents = 0;           // int per node
+    GLuint nodeBounds = 0;        // min and max vec4 per node
+    GLuint leafCounts = 0;        // int per node
+    GLuint visits = 0;            // uint per internal node
+    int capacity = 0;
+
+    static GLuint groupCount(int items)
+    {
+        return (GLuint)((items + GROUP_SIZE - 1) / GROUP_SIZE);
+    }
+
+    static void resizeBuffer(GLuint& buffer, size_t bytes)
+    {
+        if (buffer)
+            glDeleteBuffers(1, &buffer);
+        glCreateBuffers(1, &buffer);
+        glNamedBufferData(buffer, std::max(bytes, (size_t)16), nullptr, GL_DYNAMIC_COPY);
+    }
+
+    // Scratch buffers only grow, so rebuilding every frame doesn't reallocate
+    void reserve(int count)
+    {
+        if (count <= capacity)
+            return;
+        capacity = count;
+        size_t nodes = 2 * (size_t)count - 1;
+
+        resizeBuffer(sceneBounds, 8 * sizeof(GLuint));
+        for (int i = 0; i < 2; i++) {
+            resizeBuffer(keys[i], count * 2 * sizeof(GLuint));
+            resizeBuffer(values[i], count * sizeof(GLuint));
+        }
+        resizeBuffer(histogram, groupCount(count) * RADIX_BUCKETS * sizeof(GLuint));
+        resizeBuffer(children, count * 2 * sizeof(GLint));
+        resizeBuffer(parents, nodes * sizeof(GLint));
+        resizeBuffer(nodeBounds, nodes * 2 * 4 * sizeof(float));
+        resizeBuffer(leafCounts, nodes * sizeof(GLint));
+        resizeBuffer(visits, count * sizeof(GLuint));
+    }
+
+    static void setSortUniforms(ComputeShader& pass, int shift, GLuint groups)
+    {
+        pass.use();
+        pass.setInt("shift", shift);
+        pass.setInt("numGroups", (int)groups);
+    }
+
+    // Binds buffers to bindings 0, 1, ... in order, runs the pass and makes its writes visible to the next one
+    static void dispatch(ComputeShader& pass, GLuint groups, int count, std::initializer_list<GLuint> buffers)
+    {
+        pass.use();
+        pass.setInt("count", count);
+        GLuint binding = 0;
+        for (GLuint buffer : buffers)
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding++, buffer);
+        glDispatchCompute(groups, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+};
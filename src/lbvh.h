@@ -0,0 +1,258 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "bvh.h"
+
+// Linear BVH (Karras 2012, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees").
+// Primitives are sorted along a 63 bit Morton curve, then every internal node is built independently
+// from the sorted codes and bounds are filled in bottom-up. Every pass is a flat parallel loop, so this
+// is the builder to use when the tree has to be rebuilt every frame. Trees are worse than SAH ones.
+//
+// Node layout in the context arena: internal node i (0 <= i < n-1) is node i, leaf k is node n-1+k,
+// and the root is node 0. Leaves hold one primitive.
+
+// 21 bits per axis, 63 bits total, so small primitives packed closely still get distinct codes
+const int MORTON_BITS_PER_AXIS = 21;
+
+const int LBVH_GRAIN = 1 << 12;
+const int RADIX_SORT_GRAIN = 1 << 14;
+const int RADIX_BITS = 8;
+const int RADIX_BUCKETS = 1 << RADIX_BITS;
+
+struct MortonPrimitive {
+    uint64_t code;
+    int index;
+};
+
+// Scratch memory for buildLBVH, grows to the biggest scene seen and is reused after that
+struct LBVHBuildScratch {
+    std::vector<MortonPrimitive> mortonPrims;
+    std::vector<MortonPrimitive> sortBuffer;
+    std::vector<int> histograms;             // RADIX_BUCKETS counts per sort chunk
+    std::vector<int> parents;                // parent of every node, -1 for the root
+    std::unique_ptr<std::atomic<int>[]> visits; // children that reached each internal node in the bounds pass
+    int visitsCapacity = 0;
+
+    void reserve(int primitiveCount) {
+        mortonPrims.resize(primitiveCount);
+        sortBuffer.resize(primitiveCount);
+        parents.resize(std::max(2 * primitiveCount - 1, 0));
+        if (primitiveCount > visitsCapacity) {
+            visits.reset(new std::atomic<int>[primitiveCount]);
+            visitsCapacity = primitiveCount;
+        }
+    }
+};
+
+// Spreads the low 21 bits of v so there are two zero bits between each of them
+uint64_t expandBits(uint64_t v) {
+    v &= 0x1FFFFFull;
+    v = (v | (v << 32)) & 0x1F00000000FFFFull;
+    v = (v | (v << 16)) & 0x1F0000FF0000FFull;
+    v = (v | (v << 8))  & 0x100F00F00F00F00Full;
+    v = (v | (v << 4))  & 0x10C30C30C30C30C3ull;
+    v = (v | (v << 2))  & 0x1249249249249249ull;
+    return v;
+}
+
+// p is normalized to [0, 1] on every axis
+uint64_t morton3D(const glm::vec3& p) {
+    const float scale = float(1u << MORTON_BITS_PER_AXIS);
+    const float maxValue = scale - 1.0f;
+    uint64_t x = (uint64_t)glm::clamp(p.x * scale, 0.0f, maxValue);
+    uint64_t y = (uint64_t)glm::clamp(p.y * scale, 0.0f, maxValue);
+    uint64_t z = (uint64_t)glm::clamp(p.z * scale, 0.0f, maxValue);
+    return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+// Codes of the primitive centroids, normalized over the centroid bounds (not the primitive bounds, which
+// would waste code space on the extent of the primitives at the border)
+void computeMortonCodes(const std::vector<AABB>& aabbs, const std::vector<int>& indices, std::vector<MortonPrimitive>& mortonPrims, ThreadPool* pool) {
+    int count = (int)aabbs.size();
+
+    AABB bounds, centroidBounds;
+    computeRangeBoundsParallel(aabbs, indices, 0, count, bounds, centroidBounds, pool);
+
+    // Flat axes (all centroids in a plane) map to 0 instead of dividing by zero
+    glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+    glm::vec3 invExtent;
+    for (int axis = 0; axis < 3; axis++)
+        invExtent[axis] = extent[axis] > 0.0f ? 1.0f / extent[axis] : 0.0f;
+
+    parallelFor(pool, 0, count, LBVH_GRAIN, [&](int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++) {
+            glm::vec3 normalized = (aabbs[i].center() - centroidBounds.min) * invExtent;
+            mortonPrims[i] = { morton3D(normalized), i };
+        }
+    });
+}
+
+// Stable least significant digit radix sort on the codes, RADIX_BITS per pass. Each pass splits the
+// array into the same chunks: every chunk counts its digits in parallel, a serial prefix sum over
+// (digit, chunk) gives every chunk its output offsets, and the chunks scatter in parallel. Passes over
+// digits that are the same for every code are skipped, so clustered scenes need fewer passes.
+void radixSortMorton(std::vector<MortonPrimitive>& prims, std::vector<MortonPrimitive>& buffer, std::vector<int>& histograms, ThreadPool* pool) {
+    int count = (int)prims.size();
+    if (count <= 1)
+        return;
+
+    int numChunks = 1;
+    if (pool)
+        numChunks = std::max(1, std::min((int)pool->size() * 4, count / RADIX_SORT_GRAIN));
+    int chunkSize = (count + numChunks - 1) / numChunks;
+    histograms.resize(numChunks * RADIX_BUCKETS);
+
+    // Bits that differ between codes, all other digits are already sorted
+    uint64_t varyingBits = 0;
+    for (int i = 1; i < count; i++)
+        varyingBits |= prims[i].code ^ prims[0].code;
+
+    MortonPrimitive* src = prims.data();
+    MortonPrimitive* dst = buffer.data();
+    for (int shift = 0; shift < 64; shift += RADIX_BITS) {
+        if (((varyingBits >> shift) & (RADIX_BUCKETS - 1)) == 0)
+            continue;
+
+        parallelFor(pool, 0, numChunks, 1, [&](int chunkBegin, int chunkEnd) {
+            for (int c = chunkBegin; c < chunkEnd; c++) {
+                int* histogram = &histograms[c * RADIX_BUCKETS];
+                std::fill(histogram, histogram + RADIX_BUCKETS, 0);
+                int end = std::min((c + 1) * chunkSize, count);
+                for (int i = c * chunkSize; i < end; i++)
+                    histogram[(src[i].code >> shift) & (RADIX_BUCKETS - 1)]++;
+            }
+        });
+
+        // Turn the counts into output offsets, digit major so equal digits stay in chunk order
+        int offset = 0;
+        for (int digit = 0; digit < RADIX_BUCKETS; digit++) {
+            for (int c = 0; c < numChunks; c++) {
+                int digitCount = histograms[c * RADIX_BUCKETS + digit];
+                histograms[c * RADIX_BUCKETS + digit] = offset;
+                offset += digitCount;
+            }
+        }
+
+        parallelFor(pool, 0, numChunks, 1, [&](int chunkBegin, int chunkEnd) {
+            for (int c = chunkBegin; c < chunkEnd; c++) {
+                int* offsets = &histograms[c * RADIX_BUCKETS];
+                int end = std::min((c + 1) * chunkSize, count);
+                for (int i = c * chunkSize; i < end; i++)
+                    dst[offsets[(src[i].code >> shift) & (RADIX_BUCKETS - 1)]++] = src[i];
+            }
+        });
+
+        std::swap(src, dst);
+    }
+
+    if (src != prims.data())
+        std::copy(src, src + count, prims.data());
+}
+
+// Length of the common prefix of the keys at i and j, -1 if j is out of range.
+// Duplicate codes are made unique by appending the index to the key.
+int commonPrefix(const std::vector<MortonPrimitive>& prims, int i, int j) {
+    if (j < 0 || j >= (int)prims.size())
+        return -1;
+    uint64_t a = prims[i].code;
+    uint64_t b = prims[j].code;
+    if (a == b)
+        return 64 + __builtin_clz((uint32_t)(i ^ j));
+    return __builtin_clzll(a ^ b);
+}
+
+// Builds internal node i: finds the range of keys it covers and where that range splits, then links
+// the two children (internal or leaf) and records their parent
+void buildLBVHNode(BVHBuildContext& context, LBVHBuildScratch& scratch, int i) {
+    const std::vector<MortonPrimitive>& prims = scratch.mortonPrims;
+    int count = (int)prims.size();
+
+    // Direction of the range: towards the neighbour sharing the longer prefix
+    int direction = commonPrefix(prims, i, i + 1) - commonPrefix(prims, i, i - 1) >= 0 ? 1 : -1;
+    int minPrefix = commonPrefix(prims, i, i - direction);
+
+    // Upper bound for the range length, then binary search for the other end
+    int maxLength = 2;
+    while (commonPrefix(prims, i, i + maxLength * direction) > minPrefix)
+        maxLength *= 2;
+    int length = 0;
+    for (int step = maxLength / 2; step >= 1; step /= 2) {
+        if (commonPrefix(prims, i, i + (length + step) * direction) > minPrefix)
+            length += step;
+    }
+    int j = i + length * direction;
+
+    // Binary search for the last key that shares more than the node prefix with i
+    int nodePrefix = commonPrefix(prims, i, j);
+    int split = 0;
+    int step = length;
+    do {
+        step = (step + 1) >> 1;
+        if (commonPrefix(prims, i, i + (split + step) * direction) > nodePrefix)
+            split += step;
+    } while (step > 1);
+    int gamma = i + split * direction + std::min(direction, 0);
+
+    int leafBase = count - 1;
+    int left = std::min(i, j) == gamma ? leafBase + gamma : gamma;
+    int right = std::max(i, j) == gamma + 1 ? leafBase + gamma + 1 : gamma + 1;
+
+    BVHNode& node = context.nodes[i];
+    node.left = left;
+    node.right = right;
+    node.primOffset = -1;
+    node.primCount = 0;
+    scratch.parents[left] = i;
+    scratch.parents[right] = i;
+    scratch.visits[i].store(0, std::memory_order_relaxed);
+}
+
+// Builds the tree over aabbs into the context's arena (after context.reset) and returns the root.
+// context.indices is set to the Morton order, so reorderPrimitives works as with the SAH builders.
+int buildLBVH(BVHBuildContext& context, LBVHBuildScratch& scratch, const std::vector<AABB>& aabbs, ThreadPool* pool = nullptr) {
+    int count = (int)aabbs.size();
+    if (count == 0)
+        return -1;
+
+    scratch.reserve(count);
+    computeMortonCodes(aabbs, context.indices, scratch.mortonPrims, pool);
+    radixSortMorton(scratch.mortonPrims, scratch.sortBuffer, scratch.histograms, pool);
+
+    context.allocateNodes(2 * count - 1);
+    int leafBase = count - 1;
+    scratch.parents[0] = -1;
+
+    // Internal nodes don't depend on each other
+    parallelFor(pool, 0, count - 1, LBVH_GRAIN, [&](int chunkStart, int chunkEnd) {
+        for (int i = chunkStart; i < chunkEnd; i++)
+            buildLBVHNode(context, scratch, i);
+    });
+
+    // Bounds, bottom up: every leaf walks towards the root, and at each internal node the first child to
+    // arrive stops while the second one (which now knows both children are done) merges and carries on.
+    // Every internal node is merged exactly once.
+    parallelFor(pool, 0, count, LBVH_GRAIN, [&](int chunkStart, int chunkEnd) {
+        for (int k = chunkStart; k < chunkEnd; k++) {
+            int primitive = scratch.mortonPrims[k].index;
+            context.indices[k] = primitive;
+
+            BVHNode& leaf = context.nodes[leafBase + k];
+            leaf.aabb = aabbs[primitive];
+            leaf.left = leaf.right = -1;
+            leaf.primOffset = k;
+            leaf.primCount = 1;
+
+            int parent = scratch.parents[leafBase + k];
+            while (parent >= 0 && scratch.visits[parent].fetch_add(1, std::memory_order_acq_rel) == 1) {
+                BVHNode& node = context.nodes[parent];
+                node.aabb = surroundingBox(context.nodes[node.left].aabb, context.nodes[node.right].aabb);
+                parent = scratch.parents[parent];
+            }
+        }
+    });
+
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 #include <iostream>
 #include <vector>
 #include <chrono>
@@ -12,11 +13,33 @@
 #include "world.h"
 #include "camera.h"
 #include "bvh.h"
+#include "bvh_wide.h"
+#include "bvh_quantized.h"
+#include "lbvh.h"
+#include "gpu_lbvh.h"
+#include "bvh_refit.h"
+#include "bvh_optimize.h"
+#include "bvh_trace.h"
+#include "bvh_stats.h"
+#include "tlas.h"
+#include "mesh.h"
+#include "obj_loader.h"
+#include "primitives.h"
+#include "scene.h"
+#include "material_palette.h"
+#include "emitters.h"
+#include "cpu_renderer.h"
+#include "scene_cache.h"
+#include "wavefront.h"
+#include "persistent_threads.h"
+#include "frame_pipeline.h"
+#include "options.h"
 
 #define MAX_NUM_SPHERES 10
 
 static ComputeShader compute;
 static const std::filesystem::path computeShaderPath = "shader/compute_shader.glsl";
+static const std::filesystem::path lbvhShaderPath = "shader/lbvh.glsl";
 
 static void ErrorCallback(int error, const char* description)
 {
@@ -24,198 +47,624 @@ static void ErrorCallback(int error, const char* description)
 }
 
 
-float randomFloat() {
-    static std::mt19937 generator(std::random_device{}()); // internal state but no manual seed
-    static std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
-    return distribution(generator);
-}
+int main(int argc, char** argv) {
 
-int main() {
+    RenderOptions options;
+    if (!parseOptions(argc, argv, options))
+        return 1;
 
     glfwSetErrorCallback(ErrorCallback);
-    
-    CameraSettings camSettings{};
-    camSettings.aspect_ratio = 16.0f / 9.0f;
-    camSettings.image_width = 1200;
-    
-    camSettings.samples_per_pixel = 1;
-    camSettings.max_bounces = 8;
-    
-    camSettings.vfov = 20.0;
-    camSettings.focus_dist = 10.0;
-    camSettings.defocus_angle = 0.0;
 
-    camSettings.lookfrom = glm::vec3(13, 2, 3);
-    camSettings.lookat = glm::vec3(0, 0, 0);
-    camSettings.vup = glm::vec3(0, 1, 0);
+    // Scene from a file or a generator. Without --seed a random one is picked and printed, so any run
+    // can be repeated.
+    uint32_t seed = options.seed >= 0 ? (uint32_t)options.seed : std::random_device{}();
+    Scene scene;
+    scene.camera = defaultCameraSettings();
+    bool sceneLoaded = options.scenePath.empty() ? generateScene(options.generator, seed, {}, scene)
+                                                 : loadScene(options.scenePath, scene, seed);
+    if (!sceneLoaded)
+        return 1;
+    std::cout << "Scene: " << (options.scenePath.empty() ? options.generator : options.scenePath.string()) << ", seed " << seed << std::endl;
+
+    if (!options.saveScenePath.empty()) {
+        if (saveScene(options.saveScenePath, scene))
+            std::cout << "Saved scene as " << options.saveScenePath.string() << std::endl;
+        else
+            std::cerr << "Failed to save scene " << options.saveScenePath.string() << std::endl;
+    }
 
+    CameraSettings camSettings = scene.camera;
+    if (options.samplesPerPixel > 0)
+        camSettings.samples_per_pixel = options.samplesPerPixel;
     Camera camera = Camera(camSettings);
-    
-    Window window(camera.image_width, camera.image_height, "window");
-    
-    window.makeCurrentContext();
+    std::cout << "Image Dimensions: " << camera.image_width << " x " << camera.image_height << std::endl;
 
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
-        std::cerr << "Failed to initialize GLAD" << std::endl;
-        return -1;
+    // Polished metal for the --mesh triangles
+    uint32_t meshMaterial = 0;
+    if (!options.meshPath.empty()) {
+        scene.materials.push_back(Metal(glm::vec3(0.8f, 0.85f, 0.9f), 0.05f));
+        meshMaterial = scene.materials.size() - 1;
     }
-    glfwSwapInterval(0); // disable vsync
 
-    std::cout << "OpenGL version: " << glGetString(GL_VERSION) << std::endl;
-    std::cout << "Image Dimensions: " << camera.image_width << " x " << camera.image_height << std::endl;
+    // Quad panels for --quads: a mirror wall behind the field and a light above the big spheres
+    if (options.quads) {
+        scene.materials.push_back(Metal(glm::vec3(0.9f, 0.9f, 0.9f), 0.0f));
+        scene.quads.push_back(createQuad(glm::vec3(-10.0f, 0.0f, -12.0f), glm::vec3(20.0f, 0.0f, 0.0f), glm::vec3(0.0f, 4.0f, 0.0f), scene.materials.size() - 1));
+        scene.materials.push_back(Emissive(glm::vec3(1.0f, 1.0f, 1.0f), glm::vec3(4.0f, 4.0f, 4.0f)));
+        scene.quads.push_back(createQuad(glm::vec3(-5.0f, 3.0f, -1.0f), glm::vec3(10.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 2.0f), scene.materials.size() - 1));
+    }
 
-    // World scene
-
-    // Spheres format is [center_x, center_y, center_z, radius, material_index]
-    // std::vector<Sphere> spheres = {
-    //     Sphere{glm::vec3 (0.0f, -100.5f, -1.0f), 100.0f, 1}, // ground
-    //     Sphere{glm::vec3( 0.0f,    0.0f, -1.2f), 0.5f, 0},  // mid sphere
-    //     Sphere{glm::vec3(-1.0,    0.0, -1.0), 0.5f, 3},     // left sphere
-    //     Sphere{glm::vec3( 1.0,    0.0, -1.0), 0.5f, 2},     // right sphere
-    // };
-
-    // // Materials format is [r, g, b, a] where a is the fuzziness level or the refraction index
-    // std::vector<Material> materials = {
-    //     Material{glm::vec4(0.0f, 1.0f, 0.0f, 0.0f), 0.0f}, // mid mat
-    //     Material{glm::vec4(1.0f, 0.0f, 0.0f, 0.0f), 0.0f}, // ground mat
-    //     Material{glm::vec4(0.8, 0.8, 0.8, 0.3), 0.0f}, // right mat
-    //     Material{glm::vec4(1.0, 1.0, 1.0, -1.0), 1.0 / 1.5f}, // left mat
-    // };
-    
-    std::vector<Sphere> spheres;
-    // spheres.reserve(25);
-    std::vector<Material> materials;
-    // materials.reserve(25);
-
-    // Ground sphere and mat
-    materials.push_back(Lambertian(glm::vec3(0.5f, 0.5f, 0.5f)));
-    spheres.push_back(createSphere(glm::vec3(0.0f, -1000.0f, 0.0f), 1000.0f, materials.size() - 1));
-
-    for(int a = -11; a < 11; a++) {
-        for(int b = -11; b < 11; b++) {
-            float choose_mat = randomFloat();
-            glm::vec3 center = glm::vec3(a + 0.9f * randomFloat(), 0.2f, b + 0.9f * randomFloat());
-            if (choose_mat < 0.8f) {
-                // diffuse
-                glm::vec3 color = glm::vec3(randomFloat(), randomFloat(), randomFloat());
-                materials.push_back(Lambertian(color));
-                spheres.push_back(createSphere(center, 0.2f, materials.size() - 1));
+    // One copy of every distinct material, grouped by type
+    size_t sceneMaterialCount = scene.materials.size();
+    MaterialCompaction compaction = compactMaterials(scene);
+    if (!options.meshPath.empty())
+        meshMaterial = compaction.remap[meshMaterial];
+    std::cout << "Materials: " << scene.materials.size() << " unique of " << sceneMaterialCount << " (lambertian "
+              << compaction.typeOffsets[MAT_LAMBERTIAN + 1] - compaction.typeOffsets[MAT_LAMBERTIAN] << ", metal "
+              << compaction.typeOffsets[MAT_METAL + 1] - compaction.typeOffsets[MAT_METAL] << ", dielectric "
+              << compaction.typeOffsets[MAT_DIELECTRIC + 1] - compaction.typeOffsets[MAT_DIELECTRIC] << ", emissive "
+              << compaction.typeOffsets[MAT_EMISSIVE + 1] - compaction.typeOffsets[MAT_EMISSIVE] << ")" << std::endl;
+
+    // Instanced objects only survive as such with --instancing, everything else traces them as plain spheres
+    std::vector<Sphere> spheres = std::move(scene.spheres);
+    std::vector<Material> materials = std::move(scene.materials);
+    std::vector<Quad> quads = std::move(scene.quads);
+    if (!options.instancing)
+        flattenInstances(scene.world, spheres);
 
-            }
-            else if (choose_mat < 0.95f) {
-                // metal
-                glm::vec3 color = glm::vec3(randomFloat(), randomFloat(), randomFloat());
-                float fuzz = 0.5f * randomFloat();
-                materials.push_back(Metal(color, fuzz));
-                spheres.push_back(createSphere(center, 0.2f, materials.size() - 1));
+    std::cout << "Number of spheres: " << spheres.size() << std::endl;
+    if (!quads.empty())
+        std::cout << "Number of quads: " << quads.size() << std::endl;
+    if (!quads.empty() && (options.animate || options.instancing || options.builder == BVHBuilder::GpuLBVH || !options.sceneCacheDir.empty())) {
+        std::cerr << "Scenes with quads need a static CPU built BVH, they can't be combined with --animate, --instancing, gpu-lbvh or --scene-cache" << std::endl;
+        return 1;
+    }
+    if (spheres.empty() && quads.empty() && (!options.instancing || scene.world.instances.empty())) {
+        std::cerr << "The scene is empty" << std::endl;
+        return 1;
+    }
+
+    // A cached build of this scene with these settings replaces the build, its arrays are uploaded
+    // straight from the mapped file
+    SceneCache sceneCache;
+    bool cacheHit = false;
+    uint64_t cacheKey = 0;
+    std::filesystem::path cachePath;
+    if (!options.sceneCacheDir.empty()) {
+        cacheKey = hashScene(spheres, materials);
+        const int buildSettings[] = { (int)options.builder, options.bvhWidth, options.quantizedBVH, options.optimizeBVH, MAX_LEAF_SIZE, DEFAULT_SAH_BINS };
+        cacheKey = hashBytes(buildSettings, sizeof(buildSettings), cacheKey);
+        cacheKey = hashValue(SAH_TRAVERSAL_COST, cacheKey);
+        cacheKey = hashValue(SAH_INTERSECTION_COST, cacheKey);
+        cachePath = sceneCachePath(options.sceneCacheDir, cacheKey);
+        cacheHit = sceneCache.open(cachePath, cacheKey);
+    }
 
+    // Node arena and scratch buffers, sized once for the scene
+    BVHBuildContext buildContext;
+    buildContext.reset(spheres.size());
+    LBVHBuildScratch lbvhScratch;
+    ThreadPool buildPool(options.threads > 0 ? (unsigned)options.threads : std::thread::hardware_concurrency());
+
+    // Triangle mesh with its own BVH, standing between the big spheres and the camera
+    TriangleMesh mesh;
+    std::vector<BVHNodeFlat> meshNodes;
+    if (!options.meshPath.empty()) {
+        auto loadStart = std::chrono::high_resolution_clock::now();
+        if (!loadOBJ(options.meshPath, mesh, meshMaterial, &buildPool))
+            return 1;
+        if (mesh.triangles.empty()) {
+            std::cerr << options.meshPath.string() << " has no triangles" << std::endl;
+            return 1;
+        }
+        placeMesh(mesh, glm::vec3(0.0f, 0.0f, 2.5f), 2.0f);
+        auto loadEnd = std::chrono::high_resolution_clock::now();
+
+        std::vector<AABB> triangleAABBs = computeTriangleAABBs(mesh, &buildPool);
+        BVHBuildContext meshContext;
+        meshContext.reset(triangleAABBs.size());
+        int meshRoot = buildBVHBinned(meshContext, triangleAABBs, DEFAULT_SAH_BINS, &buildPool);
+        if (options.optimizeBVH)
+            meshRoot = optimizeBVH(meshContext.nodes, meshRoot).root;
+        flattenBVH(meshRoot, meshContext.nodes, meshNodes, -1);
+        mesh.triangles = reorderPrimitives(mesh.triangles, meshContext.indices);
+        auto buildEnd = std::chrono::high_resolution_clock::now();
+
+        std::cout << "Mesh: " << mesh.vertices.size() << " vertices, " << mesh.triangles.size() << " triangles"
+                  << " | load: " << std::chrono::duration<double, std::milli>(loadEnd - loadStart).count() << " ms"
+                  << " | BVH build: " << std::chrono::duration<double, std::milli>(buildEnd - loadEnd).count() << " ms" << std::endl;
+        std::cout << "Mesh BVH: " << formatBVHStats(computeBVHStats(meshNodes)) << std::endl;
+    }
+
+    // CPU built nodes (binary, wide or quantized) uploaded to binding 3. The GPU builder writes its
+    // nodes straight into the buffer instead, in the same binary layout.
+    std::vector<BVHNodeFlat> bvhFlat;
+    std::vector<BVHNode4> bvh4;
+    std::vector<BVHNode8> bvh8;
+    std::vector<BVHNodeQuantized4> bvh4Quantized;
+    std::vector<BVHNodeQuantized8> bvh8Quantized;
+    std::vector<uint32_t> primitiveRefs; // leaf ranges index these when the scene has quads
+    const void* bvhData = nullptr;
+    int bvhNodeCount = 2 * (int)spheres.size() - 1;
+    int bvhDepth = 0; // of the wide tree, the shader sizes its traversal stack from it
+    size_t bvhBytes = bvhNodeCount * sizeof(BVHNodeFlat);
+
+    // Runs the selected CPU builder into buildContext and returns the root
+    auto buildOnCPU = [&](const std::vector<AABB>& aabbs) {
+        buildContext.reset(aabbs.size());
+        if (options.builder == BVHBuilder::Sweep)
+            return buildBVH(buildContext, aabbs, &buildPool);
+        if (options.builder == BVHBuilder::LBVH)
+            return buildLBVH(buildContext, lbvhScratch, aabbs, &buildPool);
+        return buildBVHBinned(buildContext, aabbs, DEFAULT_SAH_BINS, &buildPool);
+    };
+
+    // One line summary of every build, and the full checks with --validate-bvh
+    auto reportBVH = [&](const char* label, const std::vector<BVHNodeFlat>& nodes, const std::vector<Sphere>& leafSpheres) {
+        std::cout << label << ": " << formatBVHStats(computeBVHStats(nodes)) << std::endl;
+        if (!options.validateBVH)
+            return;
+        bool valid = validateBVH(nodes, leafSpheres);
+        int mismatches = crossCheckTraversal(nodes, leafSpheres, DEFAULT_VALIDATION_RAYS, &buildPool);
+        std::cout << label << " validation: structure " << (valid ? "ok" : "BROKEN") << ", " << mismatches << " of "
+                  << DEFAULT_VALIDATION_RAYS << " random rays differ from brute force" << std::endl;
+    };
+
+    // Scene order copy, --animate moves spheres relative to it
+    std::vector<Sphere> sceneSpheres = spheres;
+
+    // Instanced scene: the scene's own objects and instances, its loose spheres becoming one more object
+    // placed once. Scenes without instances are split instead: the small spheres become one object placed
+    // as a 3x3 grid of rotated copies, everything else a second object placed once. BLASes are built
+    // once, the TLAS whenever instances move.
+    World world;
+    BLASSet blasSet;
+    TLAS tlas;
+    std::vector<glm::mat4> baseTransforms; // the first baseTransforms.size() instances spin with --animate
+    auto placeInstances = [&](float angle) {
+        for (size_t i = 0; i < baseTransforms.size(); i++)
+            world.instances[i].transform = glm::rotate(baseTransforms[i], angle, glm::vec3(0.0f, 1.0f, 0.0f));
+    };
+
+    if (options.instancing) {
+        if (!scene.world.instances.empty()) {
+            world = std::move(scene.world);
+            for (const Instance& instance : world.instances)
+                baseTransforms.push_back(instance.transform);
+            if (!sceneSpheres.empty()) {
+                world.objects.push_back({ sceneSpheres });
+                world.instances.push_back({ glm::mat4(1.0f), (uint32_t)world.objects.size() - 1 });
             }
-            else {
-                // glass
-                materials.push_back(Dielectric(1.5f));
-                spheres.push_back(createSphere(center, 0.2f, materials.size() - 1));
+        }
+        else {
+            // Either half can be empty, e.g. a scene of only large spheres, and an empty object has no BLAS
+            Object field, fixed;
+            for (const Sphere& sphere : sceneSpheres)
+                (sphere.radius < 0.5f ? field : fixed).spheres.push_back(sphere);
+
+            if (!field.spheres.empty()) {
+                world.objects.push_back(field);
+                for (int x = -1; x <= 1; x++) {
+                    for (int z = -1; z <= 1; z++) {
+                        glm::mat4 transform = glm::translate(glm::mat4(1.0f), glm::vec3(x * 24.0f, 0.0f, z * 24.0f));
+                        baseTransforms.push_back(glm::rotate(transform, glm::radians(90.0f) * (float)baseTransforms.size(), glm::vec3(0.0f, 1.0f, 0.0f)));
+                        world.instances.push_back({ glm::mat4(1.0f), (uint32_t)world.objects.size() - 1 });
+                    }
+                }
+                placeInstances(0.0f);
+            }
+            if (!fixed.spheres.empty()) {
+                world.objects.push_back(fixed);
+                world.instances.push_back({ glm::mat4(1.0f), (uint32_t)world.objects.size() - 1 });
             }
         }
-    }
-    
-    // big spheres
-    materials.push_back(Dielectric(1.5f));
-    spheres.push_back(createSphere(glm::vec3(0.0f, 1.0f, 0.0f), 1.0f, materials.size() - 1));
-    
-    materials.push_back(Lambertian(glm::vec3(0.4f, 0.2f, 0.1f)));
-    spheres.push_back(createSphere(glm::vec3(-4.0f, 1.0f, 0.0f), 1.0f, materials.size() - 1));
-    
-    materials.push_back(Metal(glm::vec3(0.7f, 0.6f, 0.5f), 0.0f));
-    spheres.push_back(createSphere(glm::vec3(4.0f, 1.0f, 0.0f), 1.0f, materials.size() - 1));
 
-    materials.push_back(Emissive(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(15.0f, 6.0f, 2.0f)));
-    spheres.push_back(createSphere(glm::vec3(-8.0f, 1.0f, 0.0f), 1.0f, materials.size() - 1));
-    
-    std::vector<AABB> spheresAABBS;
-    for (const auto& sphere : spheres) {
-        spheresAABBS.push_back(computeAABB(sphere));
+        auto buildStart = std::chrono::high_resolution_clock::now();
+        buildBLASes(world, blasSet, buildContext, &buildPool, options.optimizeBVH);
+        auto blasEnd = std::chrono::high_resolution_clock::now();
+        buildTLAS(world, blasSet, buildContext, tlas);
+        auto tlasEnd = std::chrono::high_resolution_clock::now();
+
+        size_t instancedSpheres = 0;
+        for (const Instance& instance : world.instances)
+            instancedSpheres += world.objects[instance.object].spheres.size();
+        std::cout << "Instances: " << world.instances.size() << " of " << world.objects.size() << " objects, "
+                  << blasSet.spheres.size() << " spheres stored for " << instancedSpheres << " placed" << std::endl;
+        std::cout << "BLAS build: " << std::chrono::duration<double, std::milli>(blasEnd - buildStart).count() << " ms"
+                  << " | TLAS build: " << std::chrono::duration<double, std::milli>(tlasEnd - blasEnd).count() << " ms" << std::endl;
+
+        std::cout << "TLAS: " << formatBVHStats(computeBVHStats(tlas.nodes)) << std::endl;
+        for (size_t i = 0; i < blasSet.roots.size(); i++)
+            std::cout << "BLAS " << i << ": " << formatBVHStats(computeBVHStats(blasSet.nodes, blasSet.roots[i])) << std::endl;
+        if (options.validateBVH)
+            std::cout << "BLAS validation: structure " << (validateBVH(blasSet.nodes, blasSet.spheres, blasSet.roots) ? "ok" : "BROKEN") << std::endl;
+
+        spheres = blasSet.spheres;
+        bvhData = blasSet.nodes.data();
+        bvhNodeCount = (int)blasSet.nodes.size();
+        bvhBytes = blasSet.nodes.size() * sizeof(BVHNodeFlat);
     }
-    std::cout << "Number of spheres: " << spheres.size() << std::endl;
+    else if (cacheHit) {
+        bvhData = sceneCache.nodes;
+        bvhNodeCount = sceneCache.nodeCount;
+        bvhDepth = sceneCache.nodeDepth;
+        bvhBytes = sceneCache.nodeBytes;
+        std::cout << "Loaded cached scene " << cachePath.string() << " (" << bvhNodeCount << " BVH nodes)" << std::endl;
+    }
+    else if (options.builder != BVHBuilder::GpuLBVH) {
+        std::vector<AABB> spheresAABBS;
+        if (quads.empty()) {
+            spheresAABBS.reserve(spheres.size());
+            for (const auto& sphere : spheres)
+                spheresAABBS.push_back(computeAABB(sphere));
+        }
+        else {
+            // One tree over spheres and quads, its leaves index typed references to both
+            collectPrimitives(spheres, quads, primitiveRefs, spheresAABBS);
+        }
+
+        auto buildStart = std::chrono::high_resolution_clock::now();
+        int root = buildOnCPU(spheresAABBS);
+        auto buildEnd = std::chrono::high_resolution_clock::now();
+
+        std::cout << builderName(options.builder) << " build: " << std::chrono::duration<double, std::milli>(buildEnd - buildStart).count() << " ms"
+                  << " | SAH cost: " << computeBVHCost(buildContext.nodes, root) << std::endl;
+
+        if (options.optimizeBVH && !quads.empty()) {
+            // The CPU tracer only knows spheres, so mixed scenes just report the SAH cost
+            BVHOptimizeResult optimized = optimizeBVH(buildContext.nodes, root);
+            root = optimized.root;
+            std::cout << "BVH optimization: " << optimized.passes << " passes, " << optimized.reinsertions << " nodes moved"
+                      << " | SAH cost: " << optimized.costBefore << " -> " << optimized.costAfter << std::endl;
+        }
+        else if (options.optimizeBVH) {
+            // The gain is measured by tracing the same rays through the tree before and after on the CPU
+            std::vector<Sphere> sortedSpheres = reorderPrimitives(spheres, buildContext.indices);
+            std::vector<BVHNodeFlat> flatBefore;
+            flattenBVH(root, buildContext.nodes, flatBefore, -1);
+            std::vector<Ray> benchmarkRays = generateBenchmarkRays(camera.data.lookfrom, camera.data.inv_view, camera.data.inv_projection,
+                                                                   camera.image_width / 4, camera.image_height / 4, flatBefore, sortedSpheres);
+            double raysBefore = measureRaysPerSecond(flatBefore, sortedSpheres, benchmarkRays, &buildPool);
+
+            auto optimizeStart = std::chrono::high_resolution_clock::now();
+            BVHOptimizeResult optimized = optimizeBVH(buildContext.nodes, root);
+            auto optimizeEnd = std::chrono::high_resolution_clock::now();
+            root = optimized.root;
+
+            std::vector<BVHNodeFlat> flatAfter;
+            flattenBVH(root, buildContext.nodes, flatAfter, -1);
+            double raysAfter = measureRaysPerSecond(flatAfter, sortedSpheres, benchmarkRays, &buildPool);
+
+            std::cout << "BVH optimization: " << std::chrono::duration<double, std::milli>(optimizeEnd - optimizeStart).count() << " ms, "
+                      << optimized.passes << " passes, " << optimized.reinsertions << " nodes moved"
+                      << " | SAH cost: " << optimized.costBefore << " -> " << optimized.costAfter << std::endl;
+            std::cout << "CPU rays/s (" << benchmarkRays.size() << " rays): " << raysBefore / 1e6 << "M -> " << raysAfter / 1e6 << "M ("
+                      << (raysAfter / raysBefore - 1.0) * 100.0 << "%)" << std::endl;
+        }
 
-    std::vector<BVHNode> bvhNodes;
+        bvhFlat.reserve(buildContext.nodes.size());
+        flattenBVH(root, buildContext.nodes, bvhFlat, -1);
+        bvhNodeCount = (int)bvhFlat.size();
+        std::cout << "BVH nodes: " << bvhFlat.size() << " (" << bvhFlat.size() * sizeof(BVHNodeFlat) / 1024 << " KB)" << std::endl;
+
+        // Optionally collapse into a wide BVH, the tracer then reads those nodes from binding 3 instead
+        bvhData = bvhFlat.data();
+        bvhBytes = bvhFlat.size() * sizeof(BVHNodeFlat);
+        if (options.bvhWidth == 4) {
+            collapseBVH(buildContext.nodes, root, bvh4);
+            bvhDepth = wideBVHDepth(bvh4);
+            bvhData = bvh4.data();
+            bvhBytes = bvh4.size() * sizeof(BVHNode4);
+            std::cout << "BVH4 nodes: " << bvh4.size() << " (" << bvhBytes / 1024 << " KB), depth " << bvhDepth << std::endl;
+            if (options.quantizedBVH) {
+                quantizeBVH(bvh4, bvh4Quantized);
+                if (options.validateBVH)
+                    std::cout << "Quantized BVH4 validation: " << (validateQuantizedBVH(bvh4, bvh4Quantized) ? "ok" : "BROKEN") << std::endl;
+                bvhData = bvh4Quantized.data();
+                bvhBytes = bvh4Quantized.size() * sizeof(BVHNodeQuantized4);
+                std::cout << "Quantized BVH4: " << bvhBytes / 1024 << " KB" << std::endl;
+            }
+        }
+        else if (options.bvhWidth == 8) {
+            collapseBVH(buildContext.nodes, root, bvh8);
+            bvhDepth = wideBVHDepth(bvh8);
+            bvhData = bvh8.data();
+            bvhBytes = bvh8.size() * sizeof(BVHNode8);
+            std::cout << "BVH8 nodes: " << bvh8.size() << " (" << bvhBytes / 1024 << " KB), depth " << bvhDepth << std::endl;
+            if (options.quantizedBVH) {
+                quantizeBVH(bvh8, bvh8Quantized);
+                if (options.validateBVH)
+                    std::cout << "Quantized BVH8 validation: " << (validateQuantizedBVH(bvh8, bvh8Quantized) ? "ok" : "BROKEN") << std::endl;
+                bvhData = bvh8Quantized.data();
+                bvhBytes = bvh8Quantized.size() * sizeof(BVHNodeQuantized8);
+                std::cout << "Quantized BVH8: " << bvhBytes / 1024 << " KB" << std::endl;
+            }
+        }
+
+        // Leaves reference contiguous ranges of the builder's index order, so store the spheres in that order
+        if (quads.empty()) {
+            spheres = reorderPrimitives(spheres, buildContext.indices);
+            reportBVH("BVH", bvhFlat, spheres);
+        }
+        else {
+            // The references take the builder's order, the spheres and quads follow their references
+            primitiveRefs = reorderPrimitives(primitiveRefs, buildContext.indices);
+            sortPrimitivesByReference(primitiveRefs, spheres, quads);
+            std::cout << "BVH: " << formatBVHStats(computeBVHStats(bvhFlat)) << std::endl;
+            if (options.validateBVH) {
+                bool valid = validateBVH(bvhFlat, computePrimitiveAABBs(primitiveRefs, spheres, quads));
+                std::cout << "BVH validation: structure " << (valid ? "ok" : "BROKEN") << " (no ray cross check for quads)" << std::endl;
+            }
+        }
 
+        if (!options.sceneCacheDir.empty()) {
+            if (writeSceneCache(cachePath, cacheKey, spheres, materials, bvhData, bvhBytes, bvhNodeCount, bvhDepth))
+                std::cout << "Cached scene as " << cachePath.string() << std::endl;
+            else
+                std::cerr << "Failed to write scene cache " << cachePath.string() << std::endl;
+        }
+    }
 
-    // Build Morton-encoded primitives
-    // AABB sceneBounds = computeSceneAABB(spheres); 
-    // std::vector<MortonPrimitive> mortonPrims;
-    // for (size_t i = 0; i < spheresAABBS.size(); ++i) {
-    //     glm::vec3 center = spheresAABBS[i].center();
-    //     glm::vec3 normalized = (center - sceneBounds.min) / (sceneBounds.max - sceneBounds.min);
-    //     mortonPrims.push_back({ morton3D(normalized.x, normalized.y, normalized.z), (int)i });
-    // }
+    // What gets uploaded, from the mapped cache file on a hit
+    const Sphere* sphereData = cacheHit ? sceneCache.spheres : spheres.data();
+    size_t sphereCount = cacheHit ? sceneCache.sphereCount : spheres.size();
+    const Material* materialData = cacheHit ? sceneCache.materials : materials.data();
+    size_t materialCount = cacheHit ? sceneCache.materialCount : materials.size();
+
+    // Animated CPU built scenes are refit in place instead of rebuilt every frame
+    RefitBVH refitBVH;
+    if (options.animate && options.builder != BVHBuilder::GpuLBVH && !options.instancing)
+        refitBVH.reset(spheres, bvhFlat, buildContext.indices);
+
+    // Every fourth small sphere bounces when animating
+    std::vector<int> animatedSpheres;
+    for (int i = 0; i < (int)sceneSpheres.size(); i++) {
+        if (sceneSpheres[i].radius < 0.5f && i % 4 == 0)
+            animatedSpheres.push_back(i);
+    }
+    std::vector<Sphere> animatedScene = sceneSpheres;
+    DirtyRanges dirtySceneSpheres;
+
+    // Emitters for next event estimation. They index spheres in leaf order, so BVH rebuilds renumber
+    // them, and they carry a copy of the geometry, so moving emissive spheres changes them too.
+    std::vector<GPUEmitter> emitters;
+    bool emittersMove = false;
+    if (options.nextEventEstimation) {
+        emitters = buildEmitters(sphereData, sphereCount, quads, materialData);
+        std::cout << "Emitters: " << emitters.size() << std::endl;
+        if (emitters.empty())
+            std::cout << "--nee: the scene has no emitters, only BSDF sampling will find light" << std::endl;
+        for (int i : animatedSpheres) {
+            if (options.animate && materials[sceneSpheres[i].material_index].type == MAT_EMISSIVE)
+                emittersMove = true;
+        }
+    }
 
-    // std::sort(mortonPrims.begin(), mortonPrims.end(), [](const MortonPrimitive& a, const MortonPrimitive& b) {
-    //     return a.code < b.code;
-    // });
 
+    // Quads with their planes precomputed, as both renderers read them
+    std::vector<GPUQuad> gpuQuads;
+    gpuQuads.reserve(quads.size());
+    for (const Quad& quad : quads)
+        gpuQuads.push_back(prepareQuad(quad));
+
+    // Headless: one image on the CPU from the same arrays the GPU would get, then exit
+    if (!options.cpuOutputPath.empty()) {
+        CPUScene cpuScene;
+        cpuScene.spheres = sphereData;
+        cpuScene.materials = materialData;
+        cpuScene.nodes = static_cast<const BVHNodeFlat*>(bvhData);
+        cpuScene.nodeCount = bvhNodeCount;
+        cpuScene.primitiveCount = quads.empty() ? (int)sphereCount : (int)primitiveRefs.size();
+        if (!quads.empty()) {
+            cpuScene.quads = gpuQuads.data();
+            cpuScene.primitiveRefs = primitiveRefs.data();
+        }
+        if (!mesh.triangles.empty()) {
+            cpuScene.meshNodes = meshNodes.data();
+            cpuScene.meshVertices = mesh.vertices.data();
+            cpuScene.meshTriangles = mesh.triangles.data();
+        }
 
-    // int root = buildLBVH(bvhNodes, spheresAABBS, mortonPrims, 0, mortonPrims.size());
+        SimdISA isa = std::min(options.cpuSimd, detectSimdISA());
+        if (isa != options.cpuSimd && options.cpuSimdRequested)
+            std::cout << simdISAName(options.cpuSimd) << " is not available on this CPU, using " << simdISAName(isa) << std::endl;
+
+        std::vector<glm::vec3> image;
+        CPURenderStats stats = renderCPU(cpuScene, camera.data, camera.image_width, camera.image_height, camera.settings.samples_per_pixel,
+                                         camera.settings.max_bounces, seed, isa, image, &buildPool);
+        double raysPerSecond = stats.rays / std::max(stats.seconds, 1e-9);
+        std::cout << "CPU render (" << simdISAName(stats.isa) << "): " << stats.seconds * 1000.0 << " ms, " << camera.settings.samples_per_pixel
+                  << " spp on " << stats.threads << " threads | " << raysPerSecond / 1e6 << " Mrays/s ("
+                  << raysPerSecond / 1e6 / stats.threads << " per core)" << std::endl;
+        if (!writePPM(options.cpuOutputPath, image, camera.image_width, camera.image_height))
+            return 1;
+        std::cout << "Wrote " << options.cpuOutputPath.string() << std::endl;
+        return 0;
+    }
 
-    std::vector<int> sphereIndices(spheres.size());
-    std::iota(sphereIndices.begin(), sphereIndices.end(), 0); // [0, 1, 2, ..., N]
+    Window window(camera.image_width, camera.image_height, "window");
     
-    int root = buildBVH(bvhNodes, spheres, spheresAABBS, sphereIndices);
+    window.makeCurrentContext();
 
-    std::vector<BVHNodeFlat> bvhFlat;
-    bvhFlat.reserve(bvhNodes.size());
-    flattenBVH(root, bvhNodes, bvhFlat, -1);
+    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
+        std::cerr << "Failed to initialize GLAD" << std::endl;
+        return -1;
+    }
+    glfwSwapInterval(0); // disable vsync
 
+    std::cout << "OpenGL version: " << glGetString(GL_VERSION) << std::endl;
 
-    // Create and bind SSBO for spheres
+    // Create and bind SSBO for spheres. The SoA layout puts the geometry at the same binding and the
+    // material indices in a second buffer.
     GLuint spheres_ssbo;
+    GLuint sphere_materials_ssbo = 0;
     glCreateBuffers(1, &spheres_ssbo);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, spheres_ssbo);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, spheres.size() * sizeof(Sphere), spheres.data(), GL_DYNAMIC_READ); //data upload
+    if (options.sphereSoA) {
+        SphereSoA sphereSoA = splitSpheres(sphereData, sphereCount);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sphereCount * sizeof(glm::vec4), sphereSoA.geometry.data(), GL_DYNAMIC_READ);
+        glCreateBuffers(1, &sphere_materials_ssbo);
+        glNamedBufferData(sphere_materials_ssbo, sphereCount * sizeof(uint32_t), sphereSoA.materials.data(), GL_STATIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, sphere_materials_ssbo); // binding location
+        std::cout << "Sphere geometry: " << sphereCount * sizeof(glm::vec4) / 1024 << " KB (SoA, "
+                  << sphereCount * sizeof(Sphere) / 1024 << " KB as AoS)" << std::endl;
+    }
+    else {
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sphereCount * sizeof(Sphere), sphereData, GL_DYNAMIC_READ); //data upload
+    }
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, spheres_ssbo); // binding location
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-    // Create and bind SSBO for materials
+    // Create and bind SSBO for materials, optionally in the 16 byte encoding
+    std::vector<PackedMaterial> packedMaterials;
+    if (options.packedMaterials)
+        packedMaterials = packMaterials(materialData, materialCount);
     GLuint mats_ssbo;
     glCreateBuffers(1, &mats_ssbo);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, mats_ssbo);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, materials.size() * sizeof(Material), materials.data(), GL_DYNAMIC_READ); //data upload
+    if (options.packedMaterials)
+        glBufferData(GL_SHADER_STORAGE_BUFFER, materialCount * sizeof(PackedMaterial), packedMaterials.data(), GL_DYNAMIC_READ);
+    else
+        glBufferData(GL_SHADER_STORAGE_BUFFER, materialCount * sizeof(Material), materialData, GL_DYNAMIC_READ); //data upload
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, mats_ssbo); // binding location
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
     
 
-    // Create and bind UBO for camera
-    GLuint cam_ubo;
-    glCreateBuffers(1, &cam_ubo);;
-    glBindBuffer(GL_UNIFORM_BUFFER, cam_ubo);
-    glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraData), &camera.data, GL_STATIC_READ); //data upload, Change to dynamic draw once camera can move
-    glBindBufferBase(GL_UNIFORM_BUFFER, 2, cam_ubo); // binding location
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
     // Create and bind SSBO for bvh nodes
     GLuint bvhnodes_ssbo;
     glCreateBuffers(1, &bvhnodes_ssbo);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvhnodes_ssbo);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, bvhFlat.size() * sizeof(BVHNodeFlat), bvhFlat.data(), GL_DYNAMIC_READ); //data upload
+    glBufferData(GL_SHADER_STORAGE_BUFFER, bvhBytes, bvhData, GL_DYNAMIC_READ); //data upload
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, bvhnodes_ssbo); // binding location
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-    unsigned int num_objects = spheres.size() * sizeof(Sphere);
-    compute = ComputeShader(computeShaderPath);
-    compute.use();
-    compute.setInt("num_objects", num_objects);
-    compute.setVec2("imageDimensions", glm::vec2(camera.image_width, camera.image_height));
-    compute.setInt("bvh_size", bvhNodes.size());
-    compute.setInt("root_index", root);
-    compute.setInt("samples_per_pixel", camera.settings.samples_per_pixel);
-    compute.setInt("max_bounces", camera.settings.max_bounces);
+    // GPU build: the spheres stay in scene order in their own buffer, the builder writes them in leaf
+    // order to spheres_ssbo and the nodes to bvhnodes_ssbo
+    GLuint spheres_src_ssbo = 0;
+    GpuLBVHBuilder gpuBuilder;
+    if (options.builder == BVHBuilder::GpuLBVH) {
+        glCreateBuffers(1, &spheres_src_ssbo);
+        glNamedBufferData(spheres_src_ssbo, spheres.size() * sizeof(Sphere), spheres.data(), GL_DYNAMIC_DRAW);
+
+        gpuBuilder = GpuLBVHBuilder(lbvhShaderPath);
+        gpuBuilder.build(spheres_src_ssbo, spheres_ssbo, bvhnodes_ssbo, (int)spheres.size());
+        std::cout << builderName(options.builder) << " build: " << gpuBuilder.lastBuildTimeMs() << " ms (GPU)" << std::endl;
+        std::cout << "BVH nodes: " << bvhNodeCount << " (" << bvhBytes / 1024 << " KB)" << std::endl;
+
+        // The tree only exists on the GPU, read it back once to report on it
+        std::vector<BVHNodeFlat> gpuNodes(bvhNodeCount);
+        std::vector<Sphere> gpuSpheres(spheres.size());
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glGetNamedBufferSubData(bvhnodes_ssbo, 0, bvhBytes, gpuNodes.data());
+        glGetNamedBufferSubData(spheres_ssbo, 0, gpuSpheres.size() * sizeof(Sphere), gpuSpheres.data());
+        reportBVH("BVH", gpuNodes, gpuSpheres);
+    }
+
+    // Mesh BVH, vertices and triangles
+    GLuint mesh_nodes_ssbo = 0, mesh_vertices_ssbo = 0, mesh_triangles_ssbo = 0;
+    if (!mesh.triangles.empty()) {
+        glCreateBuffers(1, &mesh_nodes_ssbo);
+        glNamedBufferData(mesh_nodes_ssbo, meshNodes.size() * sizeof(BVHNodeFlat), meshNodes.data(), GL_STATIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, mesh_nodes_ssbo); // binding location
+
+        glCreateBuffers(1, &mesh_vertices_ssbo);
+        glNamedBufferData(mesh_vertices_ssbo, mesh.vertices.size() * sizeof(glm::vec4), mesh.vertices.data(), GL_STATIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, mesh_vertices_ssbo); // binding location
+
+        glCreateBuffers(1, &mesh_triangles_ssbo);
+        glNamedBufferData(mesh_triangles_ssbo, mesh.triangles.size() * sizeof(glm::uvec4), mesh.triangles.data(), GL_STATIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, mesh_triangles_ssbo); // binding location
+    }
+
+    // Quads with their precomputed planes and the typed references the leaves index
+    GLuint quads_ssbo = 0, primitive_refs_ssbo = 0;
+    if (!quads.empty()) {
+        glCreateBuffers(1, &quads_ssbo);
+        glNamedBufferData(quads_ssbo, gpuQuads.size() * sizeof(GPUQuad), gpuQuads.data(), GL_STATIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, quads_ssbo); // binding location
+
+        glCreateBuffers(1, &primitive_refs_ssbo);
+        glNamedBufferData(primitive_refs_ssbo, primitiveRefs.size() * sizeof(uint32_t), primitiveRefs.data(), GL_STATIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, primitive_refs_ssbo); // binding location
+    }
+
+    // Emitters, at least one record so the binding is never empty
+    GLuint emitters_ssbo = 0;
+    if (options.nextEventEstimation) {
+        glCreateBuffers(1, &emitters_ssbo);
+        glNamedBufferData(emitters_ssbo, std::max<size_t>(emitters.size(), 1) * sizeof(GPUEmitter), nullptr, GL_DYNAMIC_DRAW);
+        glNamedBufferSubData(emitters_ssbo, 0, emitters.size() * sizeof(GPUEmitter), emitters.data());
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, emitters_ssbo); // binding location
+    }
+
+    // Instances and the TLAS over them
+    GLuint instances_ssbo = 0, tlas_ssbo = 0;
+    if (options.instancing) {
+        glCreateBuffers(1, &instances_ssbo);
+        glNamedBufferData(instances_ssbo, tlas.instances.size() * sizeof(GPUInstance), tlas.instances.data(), GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, instances_ssbo); // binding location
+
+        glCreateBuffers(1, &tlas_ssbo);
+        glNamedBufferData(tlas_ssbo, tlas.nodes.size() * sizeof(BVHNodeFlat), tlas.nodes.data(), GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, tlas_ssbo); // binding location
+    }
+
+    unsigned int num_objects = sphereCount * sizeof(Sphere);
+    std::vector<std::string> shaderDefines = { "BVH_WIDTH " + std::to_string(options.bvhWidth) };
+    if (options.bvhWidth > 2)
+        shaderDefines.push_back("WIDE_STACK_SIZE " + std::to_string(wideStackSize(options.bvhWidth, bvhDepth)));
+    if (options.orderedTraversal)
+        shaderDefines.push_back("ORDERED_TRAVERSAL");
+    if (options.traversalStats)
+        shaderDefines.push_back("TRAVERSAL_STATS");
+    if (options.quantizedBVH)
+        shaderDefines.push_back("BVH_QUANTIZED");
+    if (options.instancing)
+        shaderDefines.push_back("INSTANCING");
+    if (!mesh.triangles.empty())
+        shaderDefines.push_back("TRIANGLES");
+    if (!quads.empty())
+        shaderDefines.push_back("MIXED_PRIMITIVES");
+    if (options.packedMaterials)
+        shaderDefines.push_back("PACKED_MATERIALS");
+    if (options.sphereSoA)
+        shaderDefines.push_back("SPHERE_SOA");
+    if (options.nextEventEstimation)
+        shaderDefines.push_back("NEXT_EVENT_ESTIMATION");
+    if (options.persistentGroups != 0)
+        shaderDefines.push_back("PERSISTENT_THREADS");
+    WavefrontPathTracer wavefront;
+    if (options.wavefront) {
+        wavefront = WavefrontPathTracer(computeShaderPath, shaderDefines);
+        wavefront.setInt("num_objects", num_objects);
+        wavefront.setVec2("imageDimensions", glm::vec2(camera.image_width, camera.image_height));
+        wavefront.setInt("bvh_size", bvhNodeCount);
+        wavefront.setInt("root_index", 0);
+        wavefront.setInt("samples_per_pixel", camera.settings.samples_per_pixel);
+        wavefront.setInt("max_bounces", camera.settings.max_bounces);
+        wavefront.setInt("num_emitters", (int)emitters.size());
+    }
+    else {
+        compute = ComputeShader(computeShaderPath, shaderDefines);
+        compute.use();
+        compute.setInt("num_objects", num_objects);
+        compute.setVec2("imageDimensions", glm::vec2(camera.image_width, camera.image_height));
+        compute.setInt("bvh_size", bvhNodeCount);
+        compute.setInt("root_index", 0); // flattenBVH and collapseBVH both put the root first
+        compute.setInt("samples_per_pixel", camera.settings.samples_per_pixel);
+        compute.setInt("max_bounces", camera.settings.max_bounces);
+        compute.setInt("num_emitters", (int)emitters.size());
+    }
     
 
     Texture texture = createTexture(window.m_Width, window.m_Height);
 
     FrameBuffer fb = createFrameBuffer(texture);
 
-    GLuint queryID;
-    glGenQueries(1, &queryID);
+    // Camera uniforms (binding 2), node visit counters written by the shader when built with
+    // TRAVERSAL_STATS (binding 4) and the compute timer, one of each per frame in flight
+    FramePipeline pipeline(options.framesInFlight, sizeof(CameraData), options.traversalStats);
+    FramePipeline::FrameResult finished; // last frame the GPU finished
 
     int frameIndex = 0; // used for accumulating image
     int frameCount = 0; // fps counting
@@ -230,6 +679,12 @@ int main() {
     GLuint numGroupsY = (camera.image_height + workGroupSizeY - 1) / workGroupSizeY;
     std::cout << numGroupsX << " " << numGroupsY << std::endl;
 
+    PersistentThreads persistent;
+    if (options.persistentGroups != 0) {
+        persistent = PersistentThreads(camera.image_width, camera.image_height, options.persistentGroups);
+        std::cout << "Persistent threads: at least " << persistent.groupCount() << " groups of " << PersistentThreads::GROUP_SIZE << std::endl;
+    }
+
     while(!window.shouldClose()){
 
         if (camera.moving) {
@@ -239,35 +694,112 @@ int main() {
 
         camera.update(window.m_Window, deltaTime, camera);
         camera.updateInvMatrices();
-        glBindBuffer(GL_UNIFORM_BUFFER, cam_ubo);
-        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(CameraData), &camera.data);
-        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        pipeline.beginFrame();
+        pipeline.uploadUniforms(&camera.data, 2);
+
+        // Move the animated spheres, then refit the BVH (or rebuild it once refitting made it too slow)
+        // and upload only what changed. The GPU builder rebuilds from the updated source spheres.
+        if (options.animate && options.instancing) {
+            // Only the TLAS is rebuilt, the spheres and BLASes stay where they are
+            placeInstances(0.2f * (float)glfwGetTime());
+            buildTLAS(world, blasSet, buildContext, tlas);
+            glNamedBufferSubData(instances_ssbo, 0, tlas.instances.size() * sizeof(GPUInstance), tlas.instances.data());
+            glNamedBufferData(tlas_ssbo, tlas.nodes.size() * sizeof(BVHNodeFlat), tlas.nodes.data(), GL_DYNAMIC_DRAW);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            frameIndex = 0;
+        }
+        else if (options.animate) {
+            float t = (float)glfwGetTime();
+            for (int i : animatedSpheres) {
+                Sphere moved = sceneSpheres[i];
+                moved.position.y += 0.5f * std::abs(std::sin(2.0f * t + (float)i));
+                if (options.builder == BVHBuilder::GpuLBVH) {
+                    animatedScene[i] = moved;
+                    dirtySceneSpheres.add(i);
+                }
+                else {
+                    refitBVH.updateSphere(i, moved);
+                }
+            }
+
+            if (options.builder == BVHBuilder::GpuLBVH) {
+                uploadDirtyRanges(spheres_src_ssbo, animatedScene, dirtySceneSpheres);
+                gpuBuilder.build(spheres_src_ssbo, spheres_ssbo, bvhnodes_ssbo, (int)animatedScene.size());
+            }
+            else {
+                refitBVH.refit();
+                bool rebuilt = refitBVH.needsRebuild(options.rebuildThreshold);
+                if (rebuilt) {
+                    float refitCost = refitBVH.cost();
+                    std::vector<Sphere> current = refitBVH.sceneSpheres();
+                    std::vector<AABB> aabbs;
+                    aabbs.reserve(current.size());
+                    for (const Sphere& sphere : current)
+                        aabbs.push_back(computeAABB(sphere));
+
+                    int root = buildOnCPU(aabbs);
+                    std::vector<BVHNodeFlat> flat;
+                    flattenBVH(root, buildContext.nodes, flat, -1);
+                    refitBVH.reset(reorderPrimitives(current, buildContext.indices), std::move(flat), buildContext.indices);
+                    std::cout << "BVH rebuilt, SAH cost " << refitCost << " -> " << refitBVH.cost() << std::endl;
+                    reportBVH("BVH", refitBVH.nodes, refitBVH.spheres);
+
+                    glNamedBufferSubData(spheres_ssbo, 0, refitBVH.spheres.size() * sizeof(Sphere), refitBVH.spheres.data());
+                    glNamedBufferData(bvhnodes_ssbo, refitBVH.nodes.size() * sizeof(BVHNodeFlat), refitBVH.nodes.data(), GL_DYNAMIC_READ);
+                }
+                else {
+                    uploadDirtyRanges(spheres_ssbo, refitBVH.spheres, refitBVH.dirtySpheres);
+                    uploadDirtyRanges(bvhnodes_ssbo, refitBVH.nodes, refitBVH.dirtyNodes);
+                }
+
+                // Same emitters, renumbered or moved, so the count stays
+                if (!emitters.empty() && (rebuilt || emittersMove)) {
+                    emitters = buildEmitters(refitBVH.spheres.data(), refitBVH.spheres.size(), quads, materials.data());
+                    glNamedBufferSubData(emitters_ssbo, 0, emitters.size() * sizeof(GPUEmitter), emitters.data());
+                }
+            }
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            frameIndex = 0; // accumulated samples are stale once anything moved
+        }
 
         // Compute 
         {
             ++frameIndex;
-            compute.use();
-            compute.setInt("time", clock());
-            compute.setInt("frameIndex", frameIndex);
+            if (frameIndex == 1)
+                persistent.reset();
+            if (!options.wavefront) {
+                compute.use();
+                compute.setInt("time", clock());
+                compute.setInt("frameIndex", frameIndex);
+            }
             
             // Double buffer texture    
             glBindImageTexture(0, texture.handle, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
             glBindImageTexture(1, texture.handle, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+
+            // Counters are per frame so they can't overflow at high resolutions
+            pipeline.bindStats(4);
             
-            
-            glBeginQuery(GL_TIME_ELAPSED, queryID); // Computer shader timer start
-			glDispatchCompute(numGroupsX, numGroupsY, 1);
-            glEndQuery(GL_TIME_ELAPSED);            // Computer shader timer end
+            pipeline.beginTimer(); // Computer shader timer start
+            if (options.wavefront)
+                wavefront.render(camera.image_width, camera.image_height, camera.settings.samples_per_pixel, camera.settings.max_bounces, clock(), frameIndex);
+            else if (options.persistentGroups != 0)
+                persistent.dispatch(compute);
+            else
+                glDispatchCompute(numGroupsX, numGroupsY, 1);
+            pipeline.endTimer();   // Computer shader timer end
             
             // make sure writing to image has finished before read
             glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
             
         }
 
-        GLuint64 executionTime;
-        glGetQueryObjectui64v(queryID, GL_QUERY_RESULT, &executionTime); // computer shader timer result
+        // Timings arrive a few frames late, the budget follows each one once
+        if (pipeline.pollFinished(finished) && options.persistentGroups != 0)
+            persistent.adaptToBudget(finished.computeTime / 1e6, options.frameBudgetMs);
         
         blitFrameBuffer(fb);
+        pipeline.endFrame();
         
         window.swapBuffers();
         window.pollEvents();
@@ -280,7 +812,16 @@ int main() {
 
         
         if (currentTime - timer >= 1.0) {
-            std::cout << "FPS: " << frameCount << " | Frame Time: " << (1000.0 / float(frameCount)) << " ms" << " | Compute Time: " << (executionTime / 1e6) << " ms" << std::endl;
+            std::cout << "FPS: " << frameCount << " | Frame Time: " << (1000.0 / float(frameCount)) << " ms" << " | Compute Time: " << (finished.computeTime / 1e6) << " ms";
+            if (options.frameBudgetMs > 0.0f)
+                std::cout << " | Frames/Image: " << persistent.framesPerImage();
+            if (options.traversalStats) {
+                // Stats of the last finished frame
+                std::cout << " | Nodes/Ray: " << (finished.traversals > 0 ? double(finished.nodeVisits) / finished.traversals : 0.0);
+                // Rays traced per second of compute, comparable between the megakernel and --wavefront
+                std::cout << " | Mrays/s: " << (finished.computeTime > 0 ? finished.traversals * 1e3 / double(finished.computeTime) : 0.0);
+            }
+            std::cout << std::endl;
             frameCount = 0;
             timer = currentTime;
         }
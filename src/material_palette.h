@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "scene.h"
+#include "world.h"
+
+// Material interning and the compact 16 byte encoding. Generators and scene files create one material
+// per primitive, so scenes carry thousands of identical ones (every glass sphere is Dielectric(1.5)).
+// The palette keeps one copy of each, and the table is then ordered by type so materials of one type
+// have contiguous indices.
+
+class MaterialPalette
+{
+public:
+    // Index of material in the palette, added if no equal material is in it yet
+    uint32_t intern(const Material& material) {
+        Key key = makeKey(material);
+        auto [it, inserted] = indices.try_emplace(key, (uint32_t)entries.size());
+        if (inserted)
+            entries.push_back(material);
+        return it->second;
+    }
+
+    const std::vector<Material>& materials() const { return entries; }
+
+private:
+    // The fields as bits, with -0 turned into 0 so equal materials compare and hash equal
+    using Key = std::array<uint32_t, 9>;
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            uint64_t hash = 0xcbf29ce484222325ull;
+            for (uint32_t word : key)
+                hash = (hash ^ word) * 0x100000001b3ull;
+            return (size_t)hash;
+        }
+    };
+
+    static Key makeKey(const Material& material) {
+        const float fields[] = { material.color.x, material.color.y, material.color.z, material.fuzz,
+                                 material.emission.x, material.emission.y, material.emission.z, material.refractive_index };
+        Key key;
+        for (int i = 0; i < 8; i++) {
+            float field = fields[i] + 0.0f;
+            memcpy(&key[i], &field, sizeof(float));
+        }
+        key[8] = material.type;
+        return key;
+    }
+
+    std::vector<Material> entries;
+    std::unordered_map<Key, uint32_t, KeyHash> indices;
+};
+
+struct MaterialCompaction {
+    std::vector<uint32_t> remap; // new index of every old material index
+    std::array<uint32_t, MAT_TYPE_COUNT + 1> typeOffsets{}; // materials of type t are [typeOffsets[t], typeOffsets[t + 1])
+};
+
+// Replaces the scene's materials by their palette, sorted by type, and renumbers every material
+// reference in the scene. Indices held outside the scene go through the returned remap.
+MaterialCompaction compactMaterials(Scene& scene) {
+    MaterialPalette palette;
+    std::vector<uint32_t> interned(scene.materials.size());
+    for (size_t i = 0; i < scene.materials.size(); i++)
+        interned[i] = palette.intern(scene.materials[i]);
+    const std::vector<Material>& unique = palette.materials();
+
+    // Counting sort by type keeps the palette order within each type
+    MaterialCompaction compaction;
+    for (const Material& material : unique)
+        compaction.typeOffsets[std::min(material.type, MAT_TYPE_COUNT - 1) + 1]++;
+    for (uint32_t t = 0; t < MAT_TYPE_COUNT; t++)
+        compaction.typeOffsets[t + 1] += compaction.typeOffsets[t];
+
+    std::array<uint32_t, MAT_TYPE_COUNT + 1> next = compaction.typeOffsets;
+    std::vector<uint32_t> sortedIndex(unique.size());
+    std::vector<Material> sorted(unique.size());
+    for (size_t i = 0; i < unique.size(); i++) {
+        uint32_t slot = next[std::min(unique[i].type, MAT_TYPE_COUNT - 1)]++;
+        sortedIndex[i] = slot;
+        sorted[slot] = unique[i];
+    }
+
+    compaction.remap.resize(scene.materials.size());
+    for (size_t i = 0; i < scene.materials.size(); i++)
+        compaction.remap[i] = sortedIndex[interned[i]];
+
+    for (Sphere& sphere : scene.spheres)
+        sphere.material_index = compaction.remap[sphere.material_index];
+    for (Quad& quad : scene.quads)
+        quad.material_index = compaction.remap[quad.material_index];
+    for (Object& object : scene.world.objects)
+        for (Sphere& sphere : object.spheres)
+            sphere.material_index = compaction.remap[sphere.material_index];
+
+    scene.materials = std::move(sorted);
+    return compaction;
+}
+
+// Material in 16 bytes, all half floats: x = color.rg, y = color.b and the type's parameter (fuzz or
+// refractive index), z = emission.rg, w = emission.b in the low and the type in the high 16 bits
+struct alignas(16) PackedMaterial
+{
+    uint32_t colorRG;
+    uint32_t colorBParameter;
+    uint32_t emissionRG;
+    uint32_t emissionBType;
+};
+
+PackedMaterial packMaterial(const Material& material) {
+    float parameter = material.type == MAT_DIELECTRIC ? material.refractive_index : material.fuzz;
+    PackedMaterial packed;
+    packed.colorRG = glm::packHalf2x16(glm::vec2(material.color.x, material.color.y));
+    packed.colorBParameter = glm::packHalf2x16(glm::vec2(material.color.z, parameter));
+    packed.emissionRG = glm::packHalf2x16(glm::vec2(material.emission.x, material.emission.y));
+    packed.emissionBType = (glm::packHalf2x16(glm::vec2(material.emission.z, 0.0f)) & 0xffffu) | (material.type << 16);
+    return packed;
+}
+
+std::vector<PackedMaterial> packMaterials(const Material* materials, size_t count) {
+    std::vector<PackedMaterial> packed(count);
+    for (size_t i = 0; i < count; i++)
+        packed[i] = packMaterial(materials[i]);
+    return packed;
+}
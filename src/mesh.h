@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+
+// Indexed triangle mesh, stored as separate arrays the way the shader reads them: vertex positions in
+// one buffer and triangles (three vertex indices and a material) in another. A BVH over the mesh indexes
+// triangles, so triangles get reordered into leaf order like spheres and vertices are shared untouched.
+// Positions stay whole vec4s rather than x, y and z arrays: a triangle test gathers three vertices by
+// index, which is one 16 byte load each this way and three scattered 4 byte loads each when split.
+struct TriangleMesh
+{
+    std::vector<glm::vec4> vertices;   // xyz = position, w unused (vec3 arrays have a 16 byte stride in std430)
+    std::vector<glm::uvec4> triangles; // xyz = vertex indices, w = material index
+};
+
+AABB computeTriangleAABB(const TriangleMesh& mesh, const glm::uvec4& triangle) {
+    glm::vec3 a = glm::vec3(mesh.vertices[triangle.x]);
+    glm::vec3 b = glm::vec3(mesh.vertices[triangle.y]);
+    glm::vec3 c = glm::vec3(mesh.vertices[triangle.z]);
+    AABB aabb = { glm::min(a, glm::min(b, c)), glm::max(a, glm::max(b, c)) };
+
+    // Axis aligned triangles have flat boxes, which the slab test misses
+    for (int axis = 0; axis < 3; axis++) {
+        float epsilon = 1e-5f * std::max(1.0f, std::max(std::abs(aabb.min[axis]), std::abs(aabb.max[axis])));
+        if (aabb.max[axis] - aabb.min[axis] < epsilon) {
+            aabb.min[axis] -= epsilon;
+            aabb.max[axis] += epsilon;
+        }
+    }
+    return aabb;
+}
+
+std::vector<AABB> computeTriangleAABBs(const TriangleMesh& mesh, ThreadPool* pool = nullptr) {
+    std::vector<AABB> aabbs(mesh.triangles.size());
+    parallelFor(pool, 0, (int)mesh.triangles.size(), 1 << 14, [&](int chunkBegin, int chunkEnd) {
+        for (int i = chunkBegin; i < chunkEnd; i++)
+            aabbs[i] = computeTriangleAABB(mesh, mesh.triangles[i]);
+    });
+    return aabbs;
+}
+
+// Scales and moves the mesh so it is height units tall and stands centered on base
+void placeMesh(TriangleMesh& mesh, const glm::vec3& base, float height) {
+    if (mesh.vertices.empty())
+        return;
+    glm::vec3 minV(FLT_MAX), maxV(-FLT_MAX);
+    for (const glm::vec4& v : mesh.vertices) {
+        minV = glm::min(minV, glm::vec3(v));
+        maxV = glm::max(maxV, glm::vec3(v));
+    }
+    float scale = height / std::max(maxV.y - minV.y, FLT_MIN);
+    glm::vec3 bottomCenter = glm::vec3(0.5f * (minV.x + maxV.x), minV.y, 0.5f * (minV.z + maxV.z));
+    for (glm::vec4& v : mesh.vertices)
+        v = glm::vec4(base + (glm::vec3(v) - bottomCenter) * scale, 0.0f);
+}
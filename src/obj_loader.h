@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <charconv>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+
+#include "mapped_file.h"
+#include "mesh.h"
+#include "thread_pool.h"
+
+// Wavefront OBJ loader for big meshes. The file is memory mapped and split into chunks at line breaks.
+// A first parallel pass counts the vertices and triangles of every chunk, a prefix sum turns the counts
+// into output offsets, and a second parallel pass parses each chunk straight into its slice of the mesh
+// arrays. Only positions (v) and faces (f) are read: polygons are fanned into triangles, everything else
+// (texture coordinates, normals, groups, materials) is skipped.
+
+const size_t OBJ_MIN_CHUNK_SIZE = 1 << 20;
+
+struct OBJChunk {
+    const char* begin;
+    const char* end;
+    int64_t vertexCount = 0;
+    int64_t triangleCount = 0;
+    int64_t vertexBase = 0;   // vertices in the chunks before this one
+    int64_t triangleBase = 0;
+};
+
+bool objIsSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+const char* objSkipSpaces(const char* p, const char* end) {
+    while (p < end && objIsSpace(*p))
+        p++;
+    return p;
+}
+
+const char* objSkipToken(const char* p, const char* end) {
+    while (p < end && !objIsSpace(*p) && *p != '\n')
+        p++;
+    return p;
+}
+
+const char* objNextLine(const char* p, const char* end) {
+    while (p < end && *p != '\n')
+        p++;
+    return p < end ? p + 1 : end;
+}
+
+// Line keyword: 'v' for a vertex position, 'f' for a face, 0 for anything else
+char objLineType(const char* p, const char* end) {
+    if (end - p >= 2 && (p[0] == 'v' || p[0] == 'f') && objIsSpace(p[1]))
+        return p[0];
+    return 0;
+}
+
+// Number of vertex references of a face line, p just after the "f"
+int objCountFaceVertices(const char* p, const char* end) {
+    int count = 0;
+    p = objSkipSpaces(p, end);
+    while (p < end && *p != '\n') {
+        count++;
+        p = objSkipSpaces(objSkipToken(p, end), end);
+    }
+    return count;
+}
+
+// Reads the mesh in path into mesh, every triangle getting material. Returns false on errors, after
+// printing them.
+bool loadOBJ(const std::filesystem::path& path, TriangleMesh& mesh, uint32_t material, ThreadPool* pool = nullptr) {
+    MappedFile file;
+    if (!file.open(path)) {
+        std::cerr << "Failed to open OBJ file " << path.string() << std::endl;
+        return false;
+    }
+    const char* data = reinterpret_cast<const char*>(file.data());
+    const char* dataEnd = data + file.size();
+
+    // Chunks start right after a line break, so no line is split
+    size_t numChunks = pool ? pool->size() * 4 : 1;
+    numChunks = std::max<size_t>(1, std::min(numChunks, file.size() / OBJ_MIN_CHUNK_SIZE));
+    std::vector<OBJChunk> chunks(numChunks);
+    for (size_t c = 0; c < numChunks; c++) {
+        const char* start = data + file.size() * c / numChunks;
+        chunks[c].begin = c == 0 ? data : objNextLine(start - 1, dataEnd);
+    }
+    for (size_t c = 0; c < numChunks; c++)
+        chunks[c].end = c + 1 < numChunks ? chunks[c + 1].begin : dataEnd;
+
+    parallelFor(pool, 0, (int)numChunks, 1, [&](int chunkBegin, int chunkEnd) {
+        for (int c = chunkBegin; c < chunkEnd; c++) {
+            OBJChunk& chunk = chunks[c];
+            for (const char* line = chunk.begin; line < chunk.end; line = objNextLine(line, chunk.end)) {
+                char type = objLineType(line, chunk.end);
+                if (type == 'v')
+                    chunk.vertexCount++;
+                else if (type == 'f')
+                    chunk.triangleCount += std::max(0, objCountFaceVertices(line + 1, chunk.end) - 2);
+            }
+        }
+    });
+
+    int64_t vertexCount = 0, triangleCount = 0;
+    for (OBJChunk& chunk : chunks) {
+        chunk.vertexBase = vertexCount;
+        chunk.triangleBase = triangleCount;
+        vertexCount += chunk.vertexCount;
+        triangleCount += chunk.triangleCount;
+    }
+    mesh.vertices.resize(vertexCount);
+    mesh.triangles.resize(triangleCount);
+
+    // Errors are counted, the first line that failed is reported. Lines all point into the same buffer,
+    // so the earliest one is the lowest address whichever chunk finds it first.
+    std::atomic<int64_t> errors{ 0 };
+    std::atomic<const char*> firstError{ nullptr };
+    auto fail = [&](const char* line) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        const char* expected = firstError.load(std::memory_order_relaxed);
+        while ((expected == nullptr || line < expected) && !firstError.compare_exchange_weak(expected, line)) {
+        }
+    };
+
+    parallelFor(pool, 0, (int)numChunks, 1, [&](int chunkBegin, int chunkEnd) {
+        for (int c = chunkBegin; c < chunkEnd; c++) {
+            const OBJChunk& chunk = chunks[c];
+            int64_t vertex = chunk.vertexBase;
+            int64_t triangle = chunk.triangleBase;
+
+            for (const char* line = chunk.begin; line < chunk.end; line = objNextLine(line, chunk.end)) {
+                char type = objLineType(line, chunk.end);
+                if (type == 'v') {
+                    glm::vec4 position(0.0f);
+                    const char* p = line + 1;
+                    for (int axis = 0; axis < 3; axis++) {
+                        p = objSkipSpaces(p, chunk.end);
+                        auto [next, error] = std::from_chars(p, chunk.end, position[axis]);
+                        if (error != std::errc()) {
+                            fail(line);
+                            break;
+                        }
+                        p = next;
+                    }
+                    mesh.vertices[vertex++] = position;
+                }
+                else if (type == 'f') {
+                    // Indices are 1 based, negative ones count back from the last vertex read so far.
+                    // Only the position index of v/vt/vn is used.
+                    uint32_t first = 0, previous = 0;
+                    int corner = 0;
+                    const char* p = objSkipSpaces(line + 1, chunk.end);
+                    while (p < chunk.end && *p != '\n') {
+                        int64_t index = 0;
+                        auto [next, error] = std::from_chars(p, chunk.end, index);
+                        if (error != std::errc() || index == 0) {
+                            fail(line);
+                            break;
+                        }
+                        index = index > 0 ? index - 1 : vertex + index;
+                        if (index < 0 || index >= vertexCount) {
+                            fail(line);
+                            break;
+                        }
+                        p = objSkipSpaces(objSkipToken(next, chunk.end), chunk.end);
+
+                        uint32_t current = (uint32_t)index;
+                        if (corner == 0)
+                            first = current;
+                        else if (corner >= 2)
+                            mesh.triangles[triangle++] = glm::uvec4(first, previous, current, material);
+                        previous = current;
+                        corner++;
+                    }
+                }
+            }
+        }
+    });
+
+    if (errors.load() > 0) {
+        const char* line = firstError.load();
+        std::cerr << "Failed to parse " << errors.load() << " lines of " << path.string() << ", first: "
+                  << std::string(line, objNextLine(line, dataEnd) - line) << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,333 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include "simd_trace.h"
+
+enum class BVHBuilder
+{
+    Sweep,  // full sweep SAH, best trees, slowest
+    Binned, // binned SAH
+    LBVH,   // Morton code linear BVH, fastest, for per frame rebuilds
+    GpuLBVH, // same LBVH built by compute shaders, nodes never leave the GPU
+};
+
+const char* builderName(BVHBuilder builder)
+{
+    switch (builder) {
+    case BVHBuilder::Sweep: return "SAH";
+    case BVHBuilder::LBVH: return "LBVH";
+    case BVHBuilder::GpuLBVH: return "GPU LBVH";
+    default: return "Binned SAH";
+    }
+}
+
+// Startup options, set from the command line
+struct RenderOptions
+{
+    BVHBuilder builder = BVHBuilder::Binned;
+    int bvhWidth = 2;       // 2 = binary BVH with skip links, 4 or 8 = collapsed wide BVH
+    bool orderedTraversal = false; // visit the nearer child first with a short stack instead of following skip links
+    bool traversalStats = false;   // count BVH node visits per ray on the GPU
+    bool quantizedBVH = false;     // upload wide nodes with 8 bit child bounds (bvh_quantized.h)
+    bool instancing = false;       // trace a TLAS over instanced objects, each with its own BLAS
+    bool animate = false;          // move some spheres every frame, refitting or rebuilding the BVH
+    float rebuildThreshold = 1.5f; // rebuild once refitting made the SAH cost this many times worse
+    bool optimizeBVH = false;      // improve the built tree by reinserting badly placed nodes (bvh_optimize.h)
+    bool validateBVH = false;      // check the built BVH's structure and trace random rays against brute force
+    int64_t seed = -1;             // scene generator seed, -1 for a different scene every run (the seed used is printed)
+    std::filesystem::path sceneCacheDir; // load built scenes from here and store new ones (scene_cache.h), empty = off
+    std::filesystem::path meshPath;      // OBJ file added to the scene as triangles, empty = none
+    bool quads = false;            // add quad panels, the BVH then mixes spheres and quads (primitives.h)
+    std::filesystem::path scenePath;     // scene file to render (scene.h), empty = run the generator
+    std::string generator = "random_spheres"; // scene generator used without a scene file
+    std::filesystem::path saveScenePath; // write the loaded or generated scene here, empty = don't
+    bool packedMaterials = false;  // upload materials as 16 byte half float records (material_palette.h)
+    bool sphereSoA = false;        // upload spheres as vec4 geometry plus a separate material index buffer
+    bool nextEventEstimation = false; // sample emitters with shadow rays at diffuse hits, MIS weighted (emitters.h)
+    bool wavefront = false;        // trace with the wavefront passes (wavefront.h) instead of the megakernel
+    int persistentGroups = 0;      // groups of persistent threads pulling pixels from a counter (persistent_threads.h), 0 = an invocation per pixel, -1 = enough to fill the GPU
+    float frameBudgetMs = 0.0f;    // with persistent threads: adapt the pixels per frame to this compute time, 0 = whole image
+    int framesInFlight = 2;        // frames the CPU may queue ahead of the GPU (frame_pipeline.h), 1 to 3
+    std::filesystem::path cpuOutputPath; // render once on the CPU into this PPM file instead of opening a window
+    int samplesPerPixel = -1;      // overrides the scene's samples per pixel, -1 = keep
+    int threads = 0;               // worker threads for building and CPU rendering, 0 = one per core
+    SimdISA cpuSimd = SimdISA::AVX512; // widest instruction set the CPU renderer may use, lowered to what the CPU has
+    bool cpuSimdRequested = false; // --simd was given, so falling back to a narrower instruction set is reported
+};
+
+void printUsage(const char* program)
+{
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  --builder <sah|binned|lbvh|gpu-lbvh>\n"
+              << "                        BVH build algorithm (default binned)\n"
+              << "  --bvh-width <2|4|8>   BVH branching factor used for traversal (default 2)\n"
+              << "  --traversal <stackless|ordered>\n"
+              << "                        BVH traversal order (default stackless)\n"
+              << "  --bvh-quantized       Compress wide BVH nodes to 8 bit child bounds (needs --bvh-width 4 or 8)\n"
+              << "  --traversal-stats     Print the average number of BVH nodes visited per ray\n"
+              << "  --instancing          Build the scene as instanced objects with a two level BVH\n"
+              << "  --animate             Bounce some spheres, refitting the BVH every frame\n"
+              << "  --rebuild-threshold <x>\n"
+              << "                        Rebuild once refitting made the SAH cost x times worse (default 1.5)\n"
+              << "  --bvh-optimize        Lower the SAH cost of the CPU built BVH by reinserting nodes, slower build\n"
+              << "  --validate-bvh        Check the BVH after building and compare it with brute force on random rays\n"
+              << "  --seed <n>            Seed of the random scene, so runs can share a cached build\n"
+              << "  --scene-cache <dir>   Load the built scene and BVH from dir if cached, cache them there otherwise\n"
+              << "  --mesh <file.obj>     Add a triangle mesh to the scene\n"
+              << "  --quads               Add quad panels to the scene, built into the same BVH as the spheres\n"
+              << "  --scene <file>        Render a scene file, text or binary (see scene.h)\n"
+              << "  --generator <name>    Scene generator used without --scene: random_spheres (default) or cornell_box\n"
+              << "  --save-scene <file>   Save the scene, binary if the file ends in .sceneb, text otherwise\n"
+              << "  --sphere-layout <aos|soa>\n"
+              << "                        Upload 32 byte spheres, or 16 byte geometry plus material indices (default aos)\n"
+              << "  --packed-materials    Upload 16 byte half float materials instead of 48 byte ones\n"
+              << "  --nee                 Sample emissive spheres and quads with shadow rays at diffuse hits\n"
+              << "  --wavefront           Trace paths in separate generate, extend, shade and accumulate passes\n"
+              << "  --persistent-groups <n|auto>\n"
+              << "                        Launch n groups of 64 threads that pull pixels from a shared counter, auto for enough to fill the GPU\n"
+              << "  --frame-budget <ms>   With --persistent-groups, render as many pixels per frame as fit in ms of compute time\n"
+              << "  --frames-in-flight <n>\n"
+              << "                        Frames queued ahead of the GPU, 1 to 3 (default 2)\n"
+              << "  --cpu <file.ppm>      Render once on the CPU without a window or GPU and write the image\n"
+              << "  --samples <n>         Samples per pixel (per frame on the GPU), overriding the scene's\n"
+              << "  --threads <n>         Worker threads for BVH builds and the CPU renderer (default one per core)\n"
+              << "  --simd <off|sse|avx2|avx512>\n"
+              << "                        Widest SIMD instruction set the CPU renderer may use (default the widest the CPU has)\n"
+              << "  --help                Show this message\n";
+}
+
+// Returns false if the program should exit (bad option or --help)
+bool parseOptions(int argc, char** argv, RenderOptions& options)
+{
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (strcmp(arg, "--builder") == 0 && hasValue) {
+            const char* name = argv[++i];
+            if (strcmp(name, "sah") == 0)
+                options.builder = BVHBuilder::Sweep;
+            else if (strcmp(name, "binned") == 0)
+                options.builder = BVHBuilder::Binned;
+            else if (strcmp(name, "lbvh") == 0)
+                options.builder = BVHBuilder::LBVH;
+            else if (strcmp(name, "gpu-lbvh") == 0)
+                options.builder = BVHBuilder::GpuLBVH;
+            else {
+                std::cerr << "--builder must be sah, binned, lbvh or gpu-lbvh" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--bvh-width") == 0 && hasValue) {
+            options.bvhWidth = atoi(argv[++i]);
+            if (options.bvhWidth != 2 && options.bvhWidth != 4 && options.bvhWidth != 8) {
+                std::cerr << "--bvh-width must be 2, 4 or 8" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--traversal") == 0 && hasValue) {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "ordered") == 0)
+                options.orderedTraversal = true;
+            else if (strcmp(mode, "stackless") == 0)
+                options.orderedTraversal = false;
+            else {
+                std::cerr << "--traversal must be stackless or ordered" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--bvh-quantized") == 0) {
+            options.quantizedBVH = true;
+        }
+        else if (strcmp(arg, "--traversal-stats") == 0) {
+            options.traversalStats = true;
+        }
+        else if (strcmp(arg, "--instancing") == 0) {
+            options.instancing = true;
+        }
+        else if (strcmp(arg, "--animate") == 0) {
+            options.animate = true;
+        }
+        else if (strcmp(arg, "--rebuild-threshold") == 0 && hasValue) {
+            options.rebuildThreshold = (float)atof(argv[++i]);
+            if (options.rebuildThreshold < 1.0f) {
+                std::cerr << "--rebuild-threshold must be at least 1" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--bvh-optimize") == 0) {
+            options.optimizeBVH = true;
+        }
+        else if (strcmp(arg, "--validate-bvh") == 0) {
+            options.validateBVH = true;
+        }
+        else if (strcmp(arg, "--seed") == 0 && hasValue) {
+            options.seed = strtoll(argv[++i], nullptr, 10);
+            if (options.seed < 0) {
+                std::cerr << "--seed must not be negative" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--scene-cache") == 0 && hasValue) {
+            options.sceneCacheDir = argv[++i];
+        }
+        else if (strcmp(arg, "--mesh") == 0 && hasValue) {
+            options.meshPath = argv[++i];
+        }
+        else if (strcmp(arg, "--quads") == 0) {
+            options.quads = true;
+        }
+        else if (strcmp(arg, "--scene") == 0 && hasValue) {
+            options.scenePath = argv[++i];
+        }
+        else if (strcmp(arg, "--generator") == 0 && hasValue) {
+            options.generator = argv[++i];
+        }
+        else if (strcmp(arg, "--sphere-layout") == 0 && hasValue) {
+            const char* layout = argv[++i];
+            if (strcmp(layout, "soa") == 0)
+                options.sphereSoA = true;
+            else if (strcmp(layout, "aos") == 0)
+                options.sphereSoA = false;
+            else {
+                std::cerr << "--sphere-layout must be aos or soa" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--packed-materials") == 0) {
+            options.packedMaterials = true;
+        }
+        else if (strcmp(arg, "--nee") == 0) {
+            options.nextEventEstimation = true;
+        }
+        else if (strcmp(arg, "--wavefront") == 0) {
+            options.wavefront = true;
+        }
+        else if (strcmp(arg, "--persistent-groups") == 0 && hasValue) {
+            const char* groups = argv[++i];
+            bool automatic = strcmp(groups, "auto") == 0;
+            options.persistentGroups = automatic ? -1 : atoi(groups);
+            if (!automatic && options.persistentGroups < 1) {
+                std::cerr << "--persistent-groups must be auto or at least 1" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--frame-budget") == 0 && hasValue) {
+            options.frameBudgetMs = (float)atof(argv[++i]);
+            if (options.frameBudgetMs <= 0.0f) {
+                std::cerr << "--frame-budget must be positive" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--frames-in-flight") == 0 && hasValue) {
+            options.framesInFlight = atoi(argv[++i]);
+            if (options.framesInFlight < 1 || options.framesInFlight > 3) {
+                std::cerr << "--frames-in-flight must be 1, 2 or 3" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--cpu") == 0 && hasValue) {
+            options.cpuOutputPath = argv[++i];
+        }
+        else if (strcmp(arg, "--samples") == 0 && hasValue) {
+            options.samplesPerPixel = atoi(argv[++i]);
+            if (options.samplesPerPixel < 1) {
+                std::cerr << "--samples must be at least 1" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--threads") == 0 && hasValue) {
+            options.threads = atoi(argv[++i]);
+            if (options.threads < 1) {
+                std::cerr << "--threads must be at least 1" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--simd") == 0 && hasValue) {
+            const char* value = argv[++i];
+            if (strcmp(value, "off") == 0)
+                options.cpuSimd = SimdISA::Scalar;
+            else if (strcmp(value, "sse") == 0)
+                options.cpuSimd = SimdISA::SSE;
+            else if (strcmp(value, "avx2") == 0)
+                options.cpuSimd = SimdISA::AVX2;
+            else if (strcmp(value, "avx512") == 0)
+                options.cpuSimd = SimdISA::AVX512;
+            else {
+                std::cerr << "--simd must be off, sse, avx2 or avx512" << std::endl;
+                return false;
+            }
+            options.cpuSimdRequested = true;
+        }
+        else if (strcmp(arg, "--save-scene") == 0 && hasValue) {
+            options.saveScenePath = argv[++i];
+        }
+        else if (strcmp(arg, "--help") == 0) {
+            printUsage(argv[0]);
+            return false;
+        }
+        else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+
+    if (options.builder == BVHBuilder::GpuLBVH && options.bvhWidth != 2) {
+        std::cerr << "--builder gpu-lbvh only builds binary BVHs (--bvh-width 2)" << std::endl;
+        return false;
+    }
+    if (options.instancing && (options.bvhWidth != 2 || options.builder == BVHBuilder::GpuLBVH)) {
+        std::cerr << "--instancing builds binary BVHs on the CPU, it needs --bvh-width 2 and a CPU builder" << std::endl;
+        return false;
+    }
+    if (options.animate && options.bvhWidth != 2) {
+        std::cerr << "--animate refits the binary BVH, it needs --bvh-width 2" << std::endl;
+        return false;
+    }
+    if (options.optimizeBVH && options.builder == BVHBuilder::GpuLBVH) {
+        std::cerr << "--bvh-optimize works on CPU built trees, it needs a CPU builder" << std::endl;
+        return false;
+    }
+    if (!options.sceneCacheDir.empty() && (options.animate || options.instancing || options.builder == BVHBuilder::GpuLBVH)) {
+        std::cerr << "--scene-cache stores static CPU built scenes, it can't be combined with --animate, --instancing or gpu-lbvh" << std::endl;
+        return false;
+    }
+    if (!options.sceneCacheDir.empty() && options.seed < 0 && options.scenePath.empty())
+        std::cout << "--scene-cache without --seed generates a new scene every run, the cache will never hit" << std::endl;
+    if (options.sphereSoA && (options.builder == BVHBuilder::GpuLBVH || (options.animate && !options.instancing))) {
+        std::cerr << "--sphere-layout soa uploads static spheres, it can't be combined with gpu-lbvh or sphere --animate" << std::endl;
+        return false;
+    }
+    if (options.nextEventEstimation && (options.instancing || options.builder == BVHBuilder::GpuLBVH)) {
+        std::cerr << "--nee needs the emitters in world space and in CPU leaf order, it can't be combined with --instancing or gpu-lbvh" << std::endl;
+        return false;
+    }
+    if (options.wavefront && (options.nextEventEstimation || !options.cpuOutputPath.empty())) {
+        std::cerr << "--wavefront splits the BSDF sampled GPU paths into passes, it can't be combined with --nee or --cpu" << std::endl;
+        return false;
+    }
+    if (options.persistentGroups != 0 && options.wavefront) {
+        std::cerr << "--persistent-groups schedules the megakernel, it can't be combined with --wavefront" << std::endl;
+        return false;
+    }
+    if (options.frameBudgetMs > 0.0f && options.persistentGroups == 0) {
+        std::cerr << "--frame-budget needs --persistent-groups" << std::endl;
+        return false;
+    }
+    if (!options.cpuOutputPath.empty() && (options.bvhWidth != 2 || options.instancing || options.animate || options.nextEventEstimation || options.builder == BVHBuilder::GpuLBVH)) {
+        std::cerr << "--cpu renders a static scene through the binary BVH with BSDF sampling, it can't be combined with --bvh-width 4 or 8, --instancing, --animate, --nee or gpu-lbvh" << std::endl;
+        return false;
+    }
+    if (options.quantizedBVH && options.bvhWidth == 2) {
+        std::cerr << "--bvh-quantized needs --bvh-width 4 or 8" << std::endl;
+        return false;
+    }
+    return true;
+}
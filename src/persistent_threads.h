@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+
+#include "compute_shader.h"
+
+// NV_shader_thread_group queries, in case the loader was generated without the extension
+#ifndef GL_WARP_SIZE_NV
+#define GL_WARP_SIZE_NV 0x9339
+#define GL_WARPS_PER_SM_NV 0x933A
+#define GL_SM_COUNT_NV 0x933B
+#endif
+
+// Work distribution of the PERSISTENT_THREADS build of compute_shader.glsl: groups of 64 invocations,
+// by default enough to fill the GPU, pull pixel items from an atomic counter until the frame's items
+// run out or they took their share. A frame takes the next itemsPerFrame items in the shader's tiled
+// Morton order, so with a frame budget the items per frame follow the measured compute time and
+// frames may cover only part of the image, the next frame carrying on where the last one stopped.
+class PersistentThreads
+{
+public:
+    static const int GROUP_SIZE = 64; // matches the shader's local size
+    static const int TILE_SIZE = 8;   // WORK_TILE_SIZE
+    // Groups launched when the device can't tell how many it runs at once: 256K invocations, more than
+    // current GPUs keep resident. Surplus groups only cost an atomicAdd each before they exit.
+    static const int FALLBACK_GROUPS = 4096;
+    // Items one invocation may take in a frame. An invocation running for the whole frame trips GPU
+    // watchdogs, and on llvmpipe it ran past the 65535 loop iterations an invocation gets in total,
+    // after which every loop exits early and traversals miss hits.
+    static const int MAX_ITEMS_PER_INVOCATION = 8;
+
+    PersistentThreads() {}
+
+    // groups <= 0 picks defaultGroupCount()
+    PersistentThreads(int width, int height, int groups) : groups(groups > 0 ? groups : defaultGroupCount())
+    {
+        itemCount = ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE) * TILE_SIZE * TILE_SIZE;
+        itemsPerFrame = itemCount;
+        itemsSinceReset = 0;
+
+        const GLuint zero = 0;
+        glCreateBuffers(1, &counter);
+        glNamedBufferData(counter, sizeof(zero), &zero, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, counter); // binding location
+    }
+
+    // Accumulation starts over, items rendered before no longer count
+    void reset()
+    {
+        itemsSinceReset = 0;
+    }
+
+    // Runs a frame of the shader, which must be in use with its other uniforms set
+    void dispatch(ComputeShader& shader)
+    {
+        // Items up to a full sweep after a reset start their pixel's accumulation over
+        int fresh = std::max(itemCount - itemsSinceReset, 0);
+        shader.setInt("work_start", start);
+        shader.setInt("work_count", itemsPerFrame);
+        shader.setInt("fresh_items", fresh);
+        // Twice the even share leaves room to balance. Past MAX_ITEMS_PER_INVOCATION more groups are
+        // launched instead, so the invocations can always take every item between them.
+        int perInvocation = std::clamp(2 * ceilDiv(itemsPerFrame, groups * GROUP_SIZE), 1, MAX_ITEMS_PER_INVOCATION);
+        int launched = std::max(groups, ceilDiv(itemsPerFrame, perInvocation * GROUP_SIZE));
+        shader.setInt("work_per_invocation", perInvocation);
+
+        // Every invocation of the last frame ends on an atomicAdd past its items, those have to land
+        // before the counter is zeroed or they carry over and skip this frame's first items
+        const GLuint zero = 0;
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glNamedBufferSubData(counter, 0, sizeof(zero), &zero);
+        glDispatchCompute((GLuint)launched, 1, 1);
+
+        start = (start + itemsPerFrame) % itemCount;
+        itemsSinceReset = std::min(itemsSinceReset + itemsPerFrame, itemCount);
+    }
+
+    // Scales the items per frame towards budgetMs of compute time given the last frame took computeMs,
+    // between a tile and the whole image (more would render a pixel twice in a frame)
+    void adaptToBudget(double computeMs, double budgetMs)
+    {
+        if (budgetMs <= 0.0 || computeMs <= 0.0)
+            return;
+        double scale = std::clamp(budgetMs / computeMs, 0.5, 2.0); // damped, one slow frame doesn't halve it
+        int items = (int)(itemsPerFrame * scale);
+        itemsPerFrame = std::clamp(items, TILE_SIZE * TILE_SIZE, itemCount);
+    }
+
+    int framesPerImage() const
+    {
+        return (itemCount + itemsPerFrame - 1) / itemsPerFrame;
+    }
+
+    // Groups launched at least, frames that would need more than MAX_ITEMS_PER_INVOCATION items per
+    // invocation launch more
+    int groupCount() const
+    {
+        return groups;
+    }
+
+    // Enough groups to fill the GPU: with NV_shader_thread_group every warp slot of every multiprocessor,
+    // otherwise FALLBACK_GROUPS
+    static int defaultGroupCount()
+    {
+        GLint extensionCount = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+        for (GLint i = 0; i < extensionCount; i++) {
+            const char* name = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+            if (!name || strcmp(name, "GL_NV_shader_thread_group") != 0)
+                continue;
+            GLint smCount = 0, warpsPerSM = 0, warpSize = 0;
+            glGetIntegerv(GL_SM_COUNT_NV, &smCount);
+            glGetIntegerv(GL_WARPS_PER_SM_NV, &warpsPerSM);
+            glGetIntegerv(GL_WARP_SIZE_NV, &warpSize);
+            int resident = smCount * warpsPerSM * warpSize / GROUP_SIZE;
+            if (resident > 0)
+                return resident;
+        }
+        return FALLBACK_GROUPS;
+    }
+
+private:
+    static int ceilDiv(int a, int b)
+    {
+        return (a + b - 1) / b;
+    }
+
+    GLuint counter = 0;
+    int groups = 1;
+    int itemCount = 0;       // pixels of the whole tiles covering the image
+    int itemsPerFrame = 0;
+    int start = 0;           // first item of the next frame
+    int itemsSinceReset = 0; // capped at itemCount
+};
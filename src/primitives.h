@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+
+// Typed primitive references for BVHs over more than one kind of primitive. Leaves of such a tree index
+// a range of 32 bit references instead of spheres directly: the top PRIMITIVE_TYPE_BITS bits select the
+// primitive buffer (spheres, quads, ...) and the rest index into it. Sphere only scenes skip the
+// references and keep reading spheres straight from the leaf ranges.
+
+enum PrimitiveType : uint32_t
+{
+    PRIMITIVE_SPHERE = 0,
+    PRIMITIVE_QUAD = 1,
+};
+
+const uint32_t PRIMITIVE_TYPE_BITS = 4;
+const uint32_t PRIMITIVE_TYPE_SHIFT = 32 - PRIMITIVE_TYPE_BITS;
+const uint32_t PRIMITIVE_INDEX_MASK = (1u << PRIMITIVE_TYPE_SHIFT) - 1;
+
+uint32_t encodePrimitiveRef(PrimitiveType type, uint32_t index) {
+    return ((uint32_t)type << PRIMITIVE_TYPE_SHIFT) | index;
+}
+
+PrimitiveType primitiveRefType(uint32_t ref) {
+    return (PrimitiveType)(ref >> PRIMITIVE_TYPE_SHIFT);
+}
+
+uint32_t primitiveRefIndex(uint32_t ref) {
+    return ref & PRIMITIVE_INDEX_MASK;
+}
+
+// Quad as uploaded, with everything that only depends on the quad computed once here. A hit then costs
+// a handful of dot products: the plane gives t, and the hit point relative to the corner projected on
+// uAxis and vAxis gives the quad coordinates, both in [0, 1] inside.
+struct alignas(16) GPUQuad
+{
+    glm::vec3 corner_point;
+    uint32_t material_index;
+    glm::vec3 normal;
+    float D;            // plane offset, dot(normal, corner_point)
+    glm::vec3 uAxis;    // cross(v, w) with w = n / dot(n, n), n = cross(u, v)
+    float padding0;
+    glm::vec3 vAxis;    // cross(w, u)
+    float padding1;
+};
+
+GPUQuad prepareQuad(const Quad& quad) {
+    glm::vec3 n = glm::cross(quad.u, quad.v);
+    glm::vec3 w = n / glm::dot(n, n);
+
+    GPUQuad prepared = {};
+    prepared.corner_point = quad.corner_point;
+    prepared.material_index = quad.material_index;
+    prepared.normal = glm::normalize(n);
+    prepared.D = glm::dot(prepared.normal, quad.corner_point);
+    prepared.uAxis = glm::cross(quad.v, w);
+    prepared.vAxis = glm::cross(w, quad.u);
+    return prepared;
+}
+
+// References to every primitive in scene order (spheres first, then quads) with their boxes, the input
+// of a mixed build
+void collectPrimitives(const std::vector<Sphere>& spheres, const std::vector<Quad>& quads,
+                       std::vector<uint32_t>& refs, std::vector<AABB>& aabbs) {
+    refs.clear();
+    aabbs.clear();
+    refs.reserve(spheres.size() + quads.size());
+    aabbs.reserve(spheres.size() + quads.size());
+    for (uint32_t i = 0; i < (uint32_t)spheres.size(); i++) {
+        refs.push_back(encodePrimitiveRef(PRIMITIVE_SPHERE, i));
+        aabbs.push_back(computeAABB(spheres[i]));
+    }
+    for (uint32_t i = 0; i < (uint32_t)quads.size(); i++) {
+        refs.push_back(encodePrimitiveRef(PRIMITIVE_QUAD, i));
+        aabbs.push_back(computeAABB(quads[i]));
+    }
+}
+
+// After the build the references are in leaf order (reorderPrimitives). Every primitive array is sorted
+// into the order its references appear in and the references are renumbered, so the primitives of a
+// leaf sit next to each other in their buffers like sphere only scenes.
+void sortPrimitivesByReference(std::vector<uint32_t>& refs, std::vector<Sphere>& spheres, std::vector<Quad>& quads) {
+    std::vector<Sphere> sortedSpheres;
+    std::vector<Quad> sortedQuads;
+    sortedSpheres.reserve(spheres.size());
+    sortedQuads.reserve(quads.size());
+    for (uint32_t& ref : refs) {
+        uint32_t index = primitiveRefIndex(ref);
+        if (primitiveRefType(ref) == PRIMITIVE_SPHERE) {
+            ref = encodePrimitiveRef(PRIMITIVE_SPHERE, (uint32_t)sortedSpheres.size());
+            sortedSpheres.push_back(spheres[index]);
+        }
+        else {
+            ref = encodePrimitiveRef(PRIMITIVE_QUAD, (uint32_t)sortedQuads.size());
+            sortedQuads.push_back(quads[index]);
+        }
+    }
+    spheres = std::move(sortedSpheres);
+    quads = std::move(sortedQuads);
+}
+
+// Box of every reference, in reference order, for validateBVH
+std::vector<AABB> computePrimitiveAABBs(const std::vector<uint32_t>& refs, const std::vector<Sphere>& spheres, const std::vector<Quad>& quads) {
+    std::vector<AABB> aabbs;
+    aabbs.reserve(refs.size());
+    for (uint32_t ref : refs) {
+        uint32_t index = primitiveRefIndex(ref);
+        aabbs.push_back(primitiveRefType(ref) == PRIMITIVE_SPHERE ? computeAABB(spheres[index]) : computeAABB(quads[index]));
+    }
+    return aabbs;
+}
@@ -0,0 +1,635 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "camera.h"
+#include "world.h"
+
+// Scene descriptions: camera settings, materials, spheres, quads and instanced objects, read from a text
+// or binary file or made by a generator. Both loaders stream straight into the Scene vectors: the text
+// format is read a line at a time, the binary one array by array.
+//
+// Text format, one statement per line, # starts a comment:
+//   camera lookfrom 13 2 3 lookat 0 0 0 vfov 20    any CameraSettings fields, by name
+//   material <name> lambertian <r g b>
+//   material <name> metal <r g b> <fuzz>
+//   material <name> dielectric <refractive index>
+//   material <name> emissive <r g b> <emission r g b>
+//   sphere <x y z> <radius> <material>
+//   quad <corner x y z> <u x y z> <v x y z> <material>
+//   object <name> ... end                           spheres between them belong to the object
+//   instance <object> [translate x y z] [rotate_y degrees] [scale s] [matrix 16 numbers, column major]
+//   generate <generator> [seed n] [<parameter> <value>]...
+//
+// Binary files start with SCENE_BINARY_MAGIC and hold the same data as raw arrays, for scenes too big to
+// parse quickly. saveScene writes either one, so generated scenes can be stored and edited.
+
+struct Scene
+{
+    CameraSettings camera;
+    std::vector<Material> materials;
+    std::vector<Sphere> spheres;
+    std::vector<Quad> quads;
+    World world; // objects and instances of them, in addition to the spheres above
+};
+
+// The view of the original hardcoded scene, used until a scene sets the camera
+CameraSettings defaultCameraSettings() {
+    CameraSettings settings{};
+    settings.aspect_ratio = 16.0f / 9.0f;
+    settings.image_width = 1200;
+    settings.samples_per_pixel = 1;
+    settings.max_bounces = 8;
+    settings.vfov = 20.0f;
+    settings.focus_dist = 10.0f;
+    settings.defocus_angle = 0.0f;
+    settings.lookfrom = glm::vec3(13, 2, 3);
+    settings.lookat = glm::vec3(0, 0, 0);
+    settings.vup = glm::vec3(0, 1, 0);
+    return settings;
+}
+
+/* Generators */
+
+// Generators add to a scene from a seeded random engine and named parameters, so the same seed always
+// gives the same scene. New ones are plugged in with registerSceneGenerator.
+using SceneGeneratorParams = std::unordered_map<std::string, float>;
+using SceneGenerator = std::function<void(Scene& scene, std::mt19937& random, const SceneGeneratorParams& params)>;
+
+float generatorParam(const SceneGeneratorParams& params, const char* name, float fallback) {
+    auto it = params.find(name);
+    return it != params.end() ? it->second : fallback;
+}
+
+// The final scene of "Ray Tracing in One Weekend": a ground sphere, a (2 grid)^2 field of small random
+// spheres, three big ones and a light. Parameters: grid (default 11).
+void generateRandomSpheres(Scene& scene, std::mt19937& random, const SceneGeneratorParams& params) {
+    std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+    auto randomFloat = [&]() { return distribution(random); };
+    int grid = (int)generatorParam(params, "grid", 11.0f);
+    std::vector<Material>& materials = scene.materials;
+    std::vector<Sphere>& spheres = scene.spheres;
+
+    // Ground sphere and mat
+    materials.push_back(Lambertian(glm::vec3(0.5f, 0.5f, 0.5f)));
+    spheres.push_back(createSphere(glm::vec3(0.0f, -1000.0f, 0.0f), 1000.0f, materials.size() - 1));
+
+    for (int a = -grid; a < grid; a++) {
+        for (int b = -grid; b < grid; b++) {
+            float choose_mat = randomFloat();
+            glm::vec3 center = glm::vec3(a + 0.9f * randomFloat(), 0.2f, b + 0.9f * randomFloat());
+            if (choose_mat < 0.8f) {
+                // diffuse
+                glm::vec3 color = glm::vec3(randomFloat(), randomFloat(), randomFloat());
+                materials.push_back(Lambertian(color));
+            }
+            else if (choose_mat < 0.95f) {
+                // metal
+                glm::vec3 color = glm::vec3(randomFloat(), randomFloat(), randomFloat());
+                float fuzz = 0.5f * randomFloat();
+                materials.push_back(Metal(color, fuzz));
+            }
+            else {
+                // glass
+                materials.push_back(Dielectric(1.5f));
+            }
+            spheres.push_back(createSphere(center, 0.2f, materials.size() - 1));
+        }
+    }
+
+    // big spheres
+    materials.push_back(Dielectric(1.5f));
+    spheres.push_back(createSphere(glm::vec3(0.0f, 1.0f, 0.0f), 1.0f, materials.size() - 1));
+
+    materials.push_back(Lambertian(glm::vec3(0.4f, 0.2f, 0.1f)));
+    spheres.push_back(createSphere(glm::vec3(-4.0f, 1.0f, 0.0f), 1.0f, materials.size() - 1));
+
+    materials.push_back(Metal(glm::vec3(0.7f, 0.6f, 0.5f), 0.0f));
+    spheres.push_back(createSphere(glm::vec3(4.0f, 1.0f, 0.0f), 1.0f, materials.size() - 1));
+
+    materials.push_back(Emissive(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(15.0f, 6.0f, 2.0f)));
+    spheres.push_back(createSphere(glm::vec3(-8.0f, 1.0f, 0.0f), 1.0f, materials.size() - 1));
+}
+
+// Cornell box built from quads with a glass and a metal sphere, and a camera looking into it
+void generateCornellBox(Scene& scene, std::mt19937&, const SceneGeneratorParams&) {
+    std::vector<Material>& materials = scene.materials;
+    uint32_t red = materials.size();
+    materials.push_back(Lambertian(glm::vec3(0.65f, 0.05f, 0.05f)));
+    uint32_t white = materials.size();
+    materials.push_back(Lambertian(glm::vec3(0.73f, 0.73f, 0.73f)));
+    uint32_t green = materials.size();
+    materials.push_back(Lambertian(glm::vec3(0.12f, 0.45f, 0.15f)));
+    uint32_t light = materials.size();
+    materials.push_back(Emissive(glm::vec3(1.0f, 1.0f, 1.0f), glm::vec3(15.0f, 15.0f, 15.0f)));
+    uint32_t glass = materials.size();
+    materials.push_back(Dielectric(1.5f));
+    uint32_t metal = materials.size();
+    materials.push_back(Metal(glm::vec3(0.8f, 0.85f, 0.88f), 0.0f));
+
+    scene.quads.push_back(createQuad(glm::vec3(555, 0, 0), glm::vec3(0, 555, 0), glm::vec3(0, 0, 555), green));
+    scene.quads.push_back(createQuad(glm::vec3(0, 0, 0), glm::vec3(0, 555, 0), glm::vec3(0, 0, 555), red));
+    scene.quads.push_back(createQuad(glm::vec3(343, 554, 332), glm::vec3(-130, 0, 0), glm::vec3(0, 0, -105), light));
+    scene.quads.push_back(createQuad(glm::vec3(0, 0, 0), glm::vec3(555, 0, 0), glm::vec3(0, 0, 555), white));
+    scene.quads.push_back(createQuad(glm::vec3(555, 555, 555), glm::vec3(-555, 0, 0), glm::vec3(0, 0, -555), white));
+    scene.quads.push_back(createQuad(glm::vec3(0, 0, 555), glm::vec3(555, 0, 0), glm::vec3(0, 555, 0), white));
+
+    scene.spheres.push_back(createSphere(glm::vec3(190, 90, 190), 90.0f, glass));
+    scene.spheres.push_back(createSphere(glm::vec3(370, 90, 370), 90.0f, metal));
+
+    scene.camera.aspect_ratio = 1.0f;
+    scene.camera.image_width = 600;
+    scene.camera.vfov = 40.0f;
+    scene.camera.lookfrom = glm::vec3(278, 278, -800);
+    scene.camera.lookat = glm::vec3(278, 278, 0);
+    scene.camera.vup = glm::vec3(0, 1, 0);
+}
+
+std::map<std::string, SceneGenerator>& sceneGenerators() {
+    static std::map<std::string, SceneGenerator> generators = {
+        { "random_spheres", generateRandomSpheres },
+        { "cornell_box", generateCornellBox },
+    };
+    return generators;
+}
+
+void registerSceneGenerator(const std::string& name, SceneGenerator generator) {
+    sceneGenerators()[name] = std::move(generator);
+}
+
+bool generateScene(const std::string& name, uint32_t seed, const SceneGeneratorParams& params, Scene& scene) {
+    auto it = sceneGenerators().find(name);
+    if (it == sceneGenerators().end()) {
+        std::cerr << "Unknown scene generator " << name << ", available:";
+        for (const auto& entry : sceneGenerators())
+            std::cerr << " " << entry.first;
+        std::cerr << std::endl;
+        return false;
+    }
+    std::mt19937 random(seed);
+    it->second(scene, random, params);
+    return true;
+}
+
+/* Text format */
+
+// Cursor over one line of a text scene
+struct SceneLineReader
+{
+    const char* p;
+    const char* end;
+
+    void skipSpaces() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+    }
+
+    // True at the end of the line or at a comment
+    bool atEnd() {
+        skipSpaces();
+        return p == end || *p == '#';
+    }
+
+    bool word(std::string_view& out) {
+        skipSpaces();
+        const char* start = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+            p++;
+        out = std::string_view(start, p - start);
+        return p > start;
+    }
+
+    template <typename T>
+    bool number(T& out) {
+        skipSpaces();
+        auto [next, error] = std::from_chars(p, end, out);
+        if (error != std::errc())
+            return false;
+        p = next;
+        return true;
+    }
+
+    bool vec3(glm::vec3& out) {
+        return number(out.x) && number(out.y) && number(out.z);
+    }
+};
+
+bool parseCameraSettings(SceneLineReader& reader, CameraSettings& camera) {
+    while (!reader.atEnd()) {
+        std::string_view key;
+        reader.word(key);
+        bool ok = false;
+        if (key == "lookfrom") ok = reader.vec3(camera.lookfrom);
+        else if (key == "lookat") ok = reader.vec3(camera.lookat);
+        else if (key == "vup") ok = reader.vec3(camera.vup);
+        else if (key == "vfov") ok = reader.number(camera.vfov);
+        else if (key == "aspect_ratio") ok = reader.number(camera.aspect_ratio);
+        else if (key == "image_width") ok = reader.number(camera.image_width);
+        else if (key == "samples_per_pixel") ok = reader.number(camera.samples_per_pixel);
+        else if (key == "max_bounces") ok = reader.number(camera.max_bounces);
+        else if (key == "focus_dist") ok = reader.number(camera.focus_dist);
+        else if (key == "defocus_angle") ok = reader.number(camera.defocus_angle);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+bool parseMaterial(SceneLineReader& reader, Material& material) {
+    std::string_view type;
+    glm::vec3 color, emission;
+    float value;
+    if (!reader.word(type))
+        return false;
+    if (type == "lambertian" && reader.vec3(color))
+        material = Lambertian(color);
+    else if (type == "metal" && reader.vec3(color) && reader.number(value))
+        material = Metal(color, value);
+    else if (type == "dielectric" && reader.number(value))
+        material = Dielectric(value);
+    else if (type == "emissive" && reader.vec3(color) && reader.vec3(emission))
+        material = Emissive(color, emission);
+    else
+        return false;
+    return true;
+}
+
+// Instance transform as translate * rotate_y * scale, or an explicit matrix
+bool parseInstanceTransform(SceneLineReader& reader, glm::mat4& transform) {
+    glm::vec3 translation(0.0f);
+    float angle = 0.0f, scale = 1.0f;
+    bool hasMatrix = false;
+    while (!reader.atEnd()) {
+        std::string_view key;
+        reader.word(key);
+        bool ok = false;
+        if (key == "translate") ok = reader.vec3(translation);
+        else if (key == "rotate_y") ok = reader.number(angle);
+        else if (key == "scale") ok = reader.number(scale);
+        else if (key == "matrix") {
+            ok = true;
+            for (int column = 0; column < 4 && ok; column++)
+                for (int row = 0; row < 4 && ok; row++)
+                    ok = reader.number(transform[column][row]);
+            hasMatrix = true;
+        }
+        if (!ok)
+            return false;
+    }
+    if (!hasMatrix) {
+        transform = glm::translate(glm::mat4(1.0f), translation);
+        transform = glm::rotate(transform, glm::radians(angle), glm::vec3(0.0f, 1.0f, 0.0f));
+        transform = glm::scale(transform, glm::vec3(scale));
+    }
+    return true;
+}
+
+// Reads a text scene into scene. Generators without a seed statement use defaultSeed.
+bool loadSceneText(const std::filesystem::path& path, Scene& scene, uint32_t defaultSeed) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Failed to open scene " << path.string() << std::endl;
+        return false;
+    }
+
+    std::unordered_map<std::string, uint32_t> materialNames;
+    std::unordered_map<std::string, uint32_t> objectNames;
+    int currentObject = -1; // object being defined, -1 outside object blocks
+
+    std::string line;
+    int lineNumber = 0;
+    auto fail = [&](const std::string& message) {
+        std::cerr << path.string() << ":" << lineNumber << ": " << message << std::endl;
+        return false;
+    };
+
+    while (std::getline(in, line)) {
+        lineNumber++;
+        SceneLineReader reader = { line.data(), line.data() + line.size() };
+        if (reader.atEnd())
+            continue;
+
+        std::string_view keyword;
+        reader.word(keyword);
+        auto material = [&](uint32_t& index) {
+            std::string_view name;
+            if (!reader.word(name))
+                return false;
+            auto it = materialNames.find(std::string(name));
+            if (it == materialNames.end())
+                return false;
+            index = it->second;
+            return true;
+        };
+
+        if (keyword == "camera") {
+            if (!parseCameraSettings(reader, scene.camera))
+                return fail("bad camera setting");
+        }
+        else if (keyword == "material") {
+            std::string_view name;
+            Material parsed;
+            if (!reader.word(name) || !parseMaterial(reader, parsed))
+                return fail("expected material <name> <lambertian|metal|dielectric|emissive> <values>");
+            materialNames[std::string(name)] = scene.materials.size();
+            scene.materials.push_back(parsed);
+        }
+        else if (keyword == "sphere") {
+            glm::vec3 center;
+            float radius;
+            uint32_t index;
+            if (!reader.vec3(center) || !reader.number(radius) || !material(index))
+                return fail("expected sphere <x y z> <radius> <material>");
+            Sphere sphere = createSphere(center, radius, index);
+            if (currentObject >= 0)
+                scene.world.objects[currentObject].spheres.push_back(sphere);
+            else
+                scene.spheres.push_back(sphere);
+        }
+        else if (keyword == "quad") {
+            glm::vec3 corner, u, v;
+            uint32_t index;
+            if (!reader.vec3(corner) || !reader.vec3(u) || !reader.vec3(v) || !material(index))
+                return fail("expected quad <corner> <u> <v> <material>");
+            if (currentObject >= 0)
+                return fail("objects can only hold spheres");
+            scene.quads.push_back(createQuad(corner, u, v, index));
+        }
+        else if (keyword == "object") {
+            std::string_view name;
+            if (!reader.word(name) || currentObject >= 0)
+                return fail("expected object <name>, outside of other objects");
+            currentObject = scene.world.objects.size();
+            objectNames[std::string(name)] = currentObject;
+            scene.world.objects.emplace_back();
+        }
+        else if (keyword == "end") {
+            if (currentObject < 0)
+                return fail("end without object");
+            if (scene.world.objects[currentObject].spheres.empty())
+                return fail("object without spheres");
+            currentObject = -1;
+        }
+        else if (keyword == "instance") {
+            std::string_view name;
+            if (!reader.word(name) || !objectNames.count(std::string(name)))
+                return fail("expected instance <defined object>");
+            Instance instance = { glm::mat4(1.0f), objectNames[std::string(name)] };
+            if (!parseInstanceTransform(reader, instance.transform))
+                return fail("bad instance transform");
+            scene.world.instances.push_back(instance);
+        }
+        else if (keyword == "generate") {
+            std::string_view name, key;
+            if (!reader.word(name) || currentObject >= 0)
+                return fail("expected generate <generator>, outside of objects");
+            uint32_t seed = defaultSeed;
+            SceneGeneratorParams params;
+            while (!reader.atEnd()) {
+                reader.word(key);
+                bool ok = key == "seed" ? reader.number(seed) : reader.number(params[std::string(key)]);
+                if (!ok)
+                    return fail("expected <parameter> <value> after generate");
+            }
+            if (!generateScene(std::string(name), seed, params, scene))
+                return fail("generator failed");
+        }
+        else {
+            return fail("unknown statement " + std::string(keyword));
+        }
+
+        if (!reader.atEnd())
+            return fail("unexpected text at the end of the line");
+    }
+
+    if (currentObject >= 0)
+        return fail("object without end");
+    return true;
+}
+
+/* Binary format */
+
+const uint32_t SCENE_BINARY_MAGIC = 0x42535452; // "RTSB"
+const uint32_t SCENE_BINARY_VERSION = 2;
+
+struct SceneBinaryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t materialCount;
+    uint64_t sphereCount;
+    uint64_t quadCount;
+    uint64_t objectCount;   // each object is stored as its sphere count followed by its spheres
+    uint64_t instanceCount;
+    CameraSettings camera;
+};
+
+bool loadSceneBinary(const std::filesystem::path& path, Scene& scene) {
+    std::ifstream in(path, std::ios::binary);
+    SceneBinaryHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != SCENE_BINARY_MAGIC) {
+        std::cerr << "Failed to read scene " << path.string() << std::endl;
+        return false;
+    }
+    if (header.version != SCENE_BINARY_VERSION) {
+        std::cerr << path.string() << " is a version " << header.version << " scene, expected " << SCENE_BINARY_VERSION << std::endl;
+        return false;
+    }
+
+    // Arrays are read straight into the scene, appended to whatever it already holds. Counts come from
+    // the file, so they are checked against what is left of it before anything is allocated.
+    std::error_code sizeError;
+    uint64_t fileSize = std::filesystem::file_size(path, sizeError);
+    if (sizeError) {
+        std::cerr << "Failed to read scene " << path.string() << std::endl;
+        return false;
+    }
+    auto readArray = [&](auto& vector, uint64_t count) {
+        std::streamoff position = in.tellg();
+        if (position < 0 || count > (fileSize - (uint64_t)position) / sizeof(vector[0]))
+            return false;
+        size_t offset = vector.size();
+        vector.resize(offset + count);
+        return (bool)in.read(reinterpret_cast<char*>(vector.data() + offset), count * sizeof(vector[0]));
+    };
+
+    uint32_t materialBase = scene.materials.size();
+    uint32_t objectBase = scene.world.objects.size();
+    size_t sphereBase = scene.spheres.size(), quadBase = scene.quads.size(), instanceBase = scene.world.instances.size();
+    scene.camera = header.camera;
+    bool ok = readArray(scene.materials, header.materialCount)
+        && readArray(scene.spheres, header.sphereCount)
+        && readArray(scene.quads, header.quadCount);
+    bool emptyObject = false;
+    for (uint64_t i = 0; ok && !emptyObject && i < header.objectCount; i++) {
+        uint64_t count = 0;
+        ok = (bool)in.read(reinterpret_cast<char*>(&count), sizeof(count));
+        emptyObject = ok && count == 0;
+        scene.world.objects.emplace_back();
+        ok = ok && readArray(scene.world.objects.back().spheres, count);
+    }
+    if (emptyObject) {
+        std::cerr << path.string() << " has an object without spheres" << std::endl;
+        return false;
+    }
+    ok = ok && readArray(scene.world.instances, header.instanceCount);
+    if (!ok) {
+        std::cerr << path.string() << " is truncated" << std::endl;
+        return false;
+    }
+
+    // Indices are relative to the file, check them and shift them past what was already in the scene
+    auto fixMaterial = [&](uint32_t& index) {
+        if (index >= header.materialCount)
+            return false;
+        index += materialBase;
+        return true;
+    };
+    for (size_t i = sphereBase; ok && i < scene.spheres.size(); i++)
+        ok = fixMaterial(scene.spheres[i].material_index);
+    for (size_t i = quadBase; ok && i < scene.quads.size(); i++)
+        ok = fixMaterial(scene.quads[i].material_index);
+    for (size_t o = objectBase; o < scene.world.objects.size(); o++)
+        for (size_t i = 0; ok && i < scene.world.objects[o].spheres.size(); i++)
+            ok = fixMaterial(scene.world.objects[o].spheres[i].material_index);
+    for (size_t i = instanceBase; ok && i < scene.world.instances.size(); i++) {
+        ok = scene.world.instances[i].object < header.objectCount;
+        scene.world.instances[i].object += objectBase;
+    }
+    if (!ok) {
+        std::cerr << path.string() << " references a material or object it doesn't contain" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool saveSceneBinary(const std::filesystem::path& path, const Scene& scene) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    SceneBinaryHeader header = {};
+    header.magic = SCENE_BINARY_MAGIC;
+    header.version = SCENE_BINARY_VERSION;
+    header.materialCount = scene.materials.size();
+    header.sphereCount = scene.spheres.size();
+    header.quadCount = scene.quads.size();
+    header.objectCount = scene.world.objects.size();
+    header.instanceCount = scene.world.instances.size();
+    header.camera = scene.camera;
+
+    auto writeArray = [&](const auto& vector) {
+        out.write(reinterpret_cast<const char*>(vector.data()), vector.size() * sizeof(vector[0]));
+    };
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    writeArray(scene.materials);
+    writeArray(scene.spheres);
+    writeArray(scene.quads);
+    for (const Object& object : scene.world.objects) {
+        uint64_t count = object.spheres.size();
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        writeArray(object.spheres);
+    }
+    writeArray(scene.world.instances);
+    return (bool)out;
+}
+
+bool saveSceneText(const std::filesystem::path& path, const Scene& scene) {
+    FILE* file = fopen(path.string().c_str(), "w");
+    if (!file)
+        return false;
+
+    // %.9g prints floats exactly, so a saved scene loads back bit for bit
+    auto vec3 = [](const glm::vec3& v) {
+        char text[64];
+        snprintf(text, sizeof(text), "%.9g %.9g %.9g", v.x, v.y, v.z);
+        return std::string(text);
+    };
+    const CameraSettings& c = scene.camera;
+    fprintf(file, "camera lookfrom %s lookat %s vup %s vfov %.9g\n", vec3(c.lookfrom).c_str(), vec3(c.lookat).c_str(), vec3(c.vup).c_str(), c.vfov);
+    fprintf(file, "camera aspect_ratio %.9g image_width %d samples_per_pixel %d max_bounces %d focus_dist %.9g defocus_angle %.9g\n",
+            c.aspect_ratio, c.image_width, c.samples_per_pixel, c.max_bounces, c.focus_dist, c.defocus_angle);
+
+    for (size_t i = 0; i < scene.materials.size(); i++) {
+        const Material& m = scene.materials[i];
+        if (m.type == MAT_METAL)
+            fprintf(file, "material m%zu metal %s %.9g\n", i, vec3(m.color).c_str(), m.fuzz);
+        else if (m.type == MAT_DIELECTRIC)
+            fprintf(file, "material m%zu dielectric %.9g\n", i, m.refractive_index);
+        else if (m.type == MAT_EMISSIVE)
+            fprintf(file, "material m%zu emissive %s %s\n", i, vec3(m.color).c_str(), vec3(m.emission).c_str());
+        else
+            fprintf(file, "material m%zu lambertian %s\n", i, vec3(m.color).c_str());
+    }
+    for (const Sphere& s : scene.spheres)
+        fprintf(file, "sphere %s %.9g m%u\n", vec3(s.position).c_str(), s.radius, s.material_index);
+    for (const Quad& q : scene.quads)
+        fprintf(file, "quad %s %s %s m%u\n", vec3(q.corner_point).c_str(), vec3(q.u).c_str(), vec3(q.v).c_str(), q.material_index);
+    for (size_t o = 0; o < scene.world.objects.size(); o++) {
+        fprintf(file, "object o%zu\n", o);
+        for (const Sphere& s : scene.world.objects[o].spheres)
+            fprintf(file, "sphere %s %.9g m%u\n", vec3(s.position).c_str(), s.radius, s.material_index);
+        fprintf(file, "end\n");
+    }
+    for (const Instance& instance : scene.world.instances) {
+        fprintf(file, "instance o%u matrix", instance.object);
+        for (int column = 0; column < 4; column++)
+            for (int row = 0; row < 4; row++)
+                fprintf(file, " %.9g", instance.transform[column][row]);
+        fprintf(file, "\n");
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+/* Entry points */
+
+// Binary scenes are recognized by their magic, anything else is read as text
+bool loadScene(const std::filesystem::path& path, Scene& scene, uint32_t defaultSeed) {
+    uint32_t magic = 0;
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            std::cerr << "Failed to open scene " << path.string() << std::endl;
+            return false;
+        }
+        in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    }
+    if (magic == SCENE_BINARY_MAGIC)
+        return loadSceneBinary(path, scene);
+    return loadSceneText(path, scene, defaultSeed);
+}
+
+// Binary for the .sceneb extension, text otherwise
+bool saveScene(const std::filesystem::path& path, const Scene& scene) {
+    if (path.extension() == ".sceneb")
+        return saveSceneBinary(path, scene);
+    return saveSceneText(path, scene);
+}
+
+// Places a copy of every instanced object's spheres in world space, for traversals without a TLAS.
+// Radii scale by the cube root of the transform's determinant, exact for uniform scaling.
+void flattenInstances(const World& world, std::vector<Sphere>& spheres) {
+    for (const Instance& instance : world.instances) {
+        float scale = std::cbrt(std::abs(glm::determinant(glm::mat3(instance.transform))));
+        for (const Sphere& sphere : world.objects[instance.object].spheres) {
+            Sphere placed = sphere;
+            placed.position = glm::vec3(instance.transform * glm::vec4(sphere.position, 1.0f));
+            placed.radius = sphere.radius * scale;
+            spheres.push_back(placed);
+        }
+    }
+}
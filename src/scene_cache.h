@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "world.h"
+
+// Binary cache of a built scene: spheres in leaf order, materials and BVH nodes, each stored exactly as
+// uploaded. A hit maps the file and hands the arrays to glBufferData straight from the mapping, so
+// startup skips the AABBs, the build and any parsing. Files are named after a hash of everything the
+// build depends on (the scene, the builder settings and the layout of the GPU structs), so a changed
+// scene or option just misses and writes a new file.
+
+const uint32_t SCENE_CACHE_MAGIC = 0x43425452; // "RTBC"
+const uint32_t SCENE_CACHE_VERSION = 3;
+const uint64_t SCENE_CACHE_ALIGNMENT = 64;
+
+struct SceneCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t fileSize;
+    uint64_t sphereOffset, sphereCount;
+    uint64_t materialOffset, materialCount;
+    uint64_t nodeOffset, nodeBytes;
+    int32_t nodeCount;
+    int32_t nodeDepth; // deepest wide node, sizes the shader's traversal stack (0 for binary trees)
+};
+
+// 64 bit FNV-1a, hashes are chained by passing the previous one as hash
+const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash = FNV_OFFSET_BASIS) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+template <typename T>
+uint64_t hashValue(const T& value, uint64_t hash) {
+    return hashBytes(&value, sizeof(T), hash);
+}
+
+// Field by field, the structs have padding whose contents are undefined
+uint64_t hashScene(const std::vector<Sphere>& spheres, const std::vector<Material>& materials, uint64_t hash = FNV_OFFSET_BASIS) {
+    hash = hashValue(SCENE_CACHE_VERSION, hash);
+    hash = hashValue(sizeof(Sphere), hash);
+    hash = hashValue(sizeof(Material), hash);
+    hash = hashValue(spheres.size(), hash);
+    for (const Sphere& sphere : spheres) {
+        hash = hashValue(sphere.position, hash);
+        hash = hashValue(sphere.radius, hash);
+        hash = hashValue(sphere.material_index, hash);
+    }
+    hash = hashValue(materials.size(), hash);
+    for (const Material& material : materials) {
+        hash = hashValue(material.color, hash);
+        hash = hashValue(material.fuzz, hash);
+        hash = hashValue(material.emission, hash);
+        hash = hashValue(material.refractive_index, hash);
+        hash = hashValue(material.type, hash);
+    }
+    return hash;
+}
+
+std::filesystem::path sceneCachePath(const std::filesystem::path& directory, uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bvhcache", (unsigned long long)key);
+    return directory / name;
+}
+
+// A mapped cache file. The pointers point into the mapping and stay valid until the cache is closed.
+class SceneCache
+{
+public:
+    const Sphere* spheres = nullptr;
+    size_t sphereCount = 0;
+    const Material* materials = nullptr;
+    size_t materialCount = 0;
+    const void* nodes = nullptr;
+    size_t nodeBytes = 0;
+    int nodeCount = 0;
+    int nodeDepth = 0;
+
+    // False if the file is missing, or was written by another version or for another key
+    bool open(const std::filesystem::path& path, uint64_t key) {
+        if (!file.open(path))
+            return false;
+
+        const uint8_t* base = file.data();
+        SceneCacheHeader header;
+        if (file.size() < sizeof(header)) {
+            file.close();
+            return false;
+        }
+        memcpy(&header, base, sizeof(header));
+
+        auto fits = [&](uint64_t offset, uint64_t bytes) { return offset <= file.size() && bytes <= file.size() - offset; };
+        if (header.magic != SCENE_CACHE_MAGIC || header.version != SCENE_CACHE_VERSION || header.key != key
+            || header.fileSize != file.size()
+            || !fits(header.sphereOffset, header.sphereCount * sizeof(Sphere))
+            || !fits(header.materialOffset, header.materialCount * sizeof(Material))
+            || !fits(header.nodeOffset, header.nodeBytes)) {
+            file.close();
+            return false;
+        }
+
+        spheres = reinterpret_cast<const Sphere*>(base + header.sphereOffset);
+        sphereCount = header.sphereCount;
+        materials = reinterpret_cast<const Material*>(base + header.materialOffset);
+        materialCount = header.materialCount;
+        nodes = base + header.nodeOffset;
+        nodeBytes = header.nodeBytes;
+        nodeCount = header.nodeCount;
+        nodeDepth = header.nodeDepth;
+        return true;
+    }
+
+    void close() {
+        file.close();
+        spheres = nullptr;
+        materials = nullptr;
+        nodes = nullptr;
+    }
+
+private:
+    MappedFile file;
+};
+
+// Writes the arrays as one file, every array starting on a SCENE_CACHE_ALIGNMENT boundary. The file is
+// written under a temporary name and renamed, so a crash never leaves a truncated file with a valid name.
+bool writeSceneCache(const std::filesystem::path& path, uint64_t key, const std::vector<Sphere>& spheres,
+                     const std::vector<Material>& materials, const void* nodes, size_t nodeBytes, int nodeCount, int nodeDepth) {
+    auto align = [](uint64_t offset) { return (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT; };
+
+    SceneCacheHeader header = {};
+    header.magic = SCENE_CACHE_MAGIC;
+    header.version = SCENE_CACHE_VERSION;
+    header.key = key;
+    header.sphereOffset = align(sizeof(SceneCacheHeader));
+    header.sphereCount = spheres.size();
+    header.materialOffset = align(header.sphereOffset + spheres.size() * sizeof(Sphere));
+    header.materialCount = materials.size();
+    header.nodeOffset = align(header.materialOffset + materials.size() * sizeof(Material));
+    header.nodeBytes = nodeBytes;
+    header.nodeCount = nodeCount;
+    header.nodeDepth = nodeDepth;
+    header.fileSize = header.nodeOffset + nodeBytes;
+
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+        auto writeAt = [&](uint64_t offset, const void* data, size_t bytes) {
+            std::vector<char> zeros(offset - (uint64_t)out.tellp(), 0);
+            out.write(zeros.data(), zeros.size());
+            out.write(static_cast<const char*>(data), bytes);
+        };
+        writeAt(0, &header, sizeof(header));
+        writeAt(header.sphereOffset, spheres.data(), spheres.size() * sizeof(Sphere));
+        writeAt(header.materialOffset, materials.data(), materials.size() * sizeof(Material));
+        writeAt(header.nodeOffset, nodes, nodeBytes);
+        if (!out)
+            return false;
+    }
+    std::filesystem::rename(temporary, path, error);
+    return !error;
+}
@@ -0,0 +1,18 @@
+#include "simd_kernels.h"
+
+// 8 lanes, single rays run over BVH8 nodes. Compiled with -mavx2 -mfma (CMakeLists.txt) and only
+// called after the CPU reported both.
+
+#if defined(SIMD_AVX_KERNELS) && defined(__AVX2__) && defined(__FMA__)
+
+SimdHit traceRayAVX2(const SimdScene& scene, const float origin[3], const float direction[3], float tMin, float tMax)
+{
+    return traceRayWide<AVX2Lanes>(scene, origin, direction, tMin, tMax);
+}
+
+void tracePacketAVX2(const SimdScene& scene, const SimdPacket& packet, float tMin, SimdHit* hits)
+{
+    tracePacketBinary<AVX2Lanes>(scene, packet, tMin, hits);
+}
+
+#endif
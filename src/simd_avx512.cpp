@@ -0,0 +1,13 @@
+#include "simd_kernels.h"
+
+// 16 ray packets. Single rays keep the AVX2 kernel: BVH8 nodes have no use for 16 lanes. Compiled with
+// -mavx512f (CMakeLists.txt) and only called after the CPU reported it.
+
+#if defined(SIMD_AVX_KERNELS) && defined(__AVX512F__)
+
+void tracePacketAVX512(const SimdScene& scene, const SimdPacket& packet, float tMin, SimdHit* hits)
+{
+    tracePacketBinary<AVX512Lanes>(scene, packet, tMin, hits);
+}
+
+#endif
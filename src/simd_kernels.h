@@ -0,0 +1,346 @@
+#pragma once
+
+#include <cfloat>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "simd_lanes.h"
+#include "simd_trace.h"
+
+// The traversal and intersection kernels behind simd_trace.h, written once against the Lanes wrappers
+// of simd_lanes.h and instantiated by each instruction set's translation unit. Like the wrappers they
+// live in an unnamed namespace and call nothing from the standard library or glm, whose inline
+// functions would otherwise be shared between translation units built for different instruction sets.
+
+namespace {
+
+float minf(float a, float b) { return a < b ? a : b; }
+float maxf(float a, float b) { return a > b ? a : b; }
+
+int lowestBit(unsigned bits) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return (int)index;
+#else
+    return __builtin_ctz(bits);
+#endif
+}
+
+template <typename L>
+struct Vec3Lanes
+{
+    typename L::Float x, y, z;
+};
+
+template <typename L>
+struct RayLanes
+{
+    Vec3Lanes<L> origin;
+    Vec3Lanes<L> direction;
+    Vec3Lanes<L> invDirection;
+};
+
+template <typename L>
+typename L::Float dot(const Vec3Lanes<L>& a, const Vec3Lanes<L>& b) {
+    return L::mulAdd(a.x, b.x, L::mulAdd(a.y, b.y, L::mul(a.z, b.z)));
+}
+
+template <typename L>
+Vec3Lanes<L> loadVec3(const float* x, const float* y, const float* z, int index) {
+    return { L::load(x + index), L::load(y + index), L::load(z + index) };
+}
+
+template <typename L>
+Vec3Lanes<L> broadcastVec3(float x, float y, float z) {
+    return { L::set1(x), L::set1(y), L::set1(z) };
+}
+
+template <typename L>
+RayLanes<L> makeRay(const Vec3Lanes<L>& origin, const Vec3Lanes<L>& direction) {
+    typename L::Float one = L::set1(1.0f);
+    return { origin, direction, { L::div(one, direction.x), L::div(one, direction.y), L::div(one, direction.z) } };
+}
+
+// hitSphere in bvh_trace.h a lane at a time. t is the hit distance in the lanes of the returned mask.
+template <typename L>
+typename L::Mask hitSphereLanes(const Vec3Lanes<L>& center, typename L::Float radius, const RayLanes<L>& ray,
+                                typename L::Float tMin, typename L::Float closest, typename L::Float& t) {
+    Vec3Lanes<L> oc = { L::sub(center.x, ray.origin.x), L::sub(center.y, ray.origin.y), L::sub(center.z, ray.origin.z) };
+    typename L::Float a = dot(ray.direction, ray.direction);
+    typename L::Float h = dot(oc, ray.direction);
+    typename L::Float c = L::sub(dot(oc, oc), L::mul(radius, radius));
+
+    typename L::Float discriminant = L::sub(L::mul(h, h), L::mul(a, c));
+    typename L::Mask hit = L::greaterEqual(discriminant, L::set1(0.0f)); // false for the NaN centers of quad slots
+    typename L::Float sqrtd = L::sqrt(L::max(discriminant, L::set1(0.0f)));
+
+    typename L::Float nearRoot = L::div(L::sub(h, sqrtd), a);
+    typename L::Float farRoot = L::div(L::add(h, sqrtd), a);
+    typename L::Mask nearInRange = L::maskAnd(L::greaterEqual(nearRoot, tMin), L::lessEqual(nearRoot, closest));
+    typename L::Mask farInRange = L::maskAnd(L::greaterEqual(farRoot, tMin), L::lessEqual(farRoot, closest));
+    t = L::select(nearInRange, nearRoot, farRoot);
+    return L::maskAnd(hit, L::maskOr(nearInRange, farInRange));
+}
+
+// hitQuad of cpu_renderer.h a lane at a time
+template <typename L>
+typename L::Mask hitQuadLanes(const Vec3Lanes<L>& normal, typename L::Float planeD, const Vec3Lanes<L>& corner,
+                              const Vec3Lanes<L>& uAxis, const Vec3Lanes<L>& vAxis, const RayLanes<L>& ray,
+                              typename L::Float tMin, typename L::Float closest, typename L::Float& t) {
+    typename L::Float denom = dot(normal, ray.direction);
+    typename L::Mask facing = L::greaterEqual(L::abs(denom), L::set1(1e-8f)); // false for the zero normals of sphere slots
+
+    t = L::div(L::sub(planeD, dot(normal, ray.origin)), denom);
+    typename L::Mask inRange = L::maskAnd(L::greaterEqual(t, tMin), L::lessEqual(t, closest));
+
+    Vec3Lanes<L> planarHit = { L::sub(L::mulAdd(t, ray.direction.x, ray.origin.x), corner.x),
+                               L::sub(L::mulAdd(t, ray.direction.y, ray.origin.y), corner.y),
+                               L::sub(L::mulAdd(t, ray.direction.z, ray.origin.z), corner.z) };
+    typename L::Float alpha = dot(planarHit, uAxis);
+    typename L::Float beta = dot(planarHit, vAxis);
+    typename L::Float zero = L::set1(0.0f), one = L::set1(1.0f);
+    typename L::Mask inside = L::maskAnd(L::maskAnd(L::greaterEqual(alpha, zero), L::lessEqual(alpha, one)),
+                                         L::maskAnd(L::greaterEqual(beta, zero), L::lessEqual(beta, one)));
+    return L::maskAnd(L::maskAnd(facing, inRange), inside);
+}
+
+// Slab test of boxes against rays, as intersectAABB; nearest is the entry distance
+template <typename L>
+typename L::Mask hitBoxLanes(const Vec3Lanes<L>& boxMin, const Vec3Lanes<L>& boxMax, const RayLanes<L>& ray,
+                             typename L::Float closest, typename L::Float& nearest) {
+    typename L::Float t0x = L::mul(L::sub(boxMin.x, ray.origin.x), ray.invDirection.x);
+    typename L::Float t0y = L::mul(L::sub(boxMin.y, ray.origin.y), ray.invDirection.y);
+    typename L::Float t0z = L::mul(L::sub(boxMin.z, ray.origin.z), ray.invDirection.z);
+    typename L::Float t1x = L::mul(L::sub(boxMax.x, ray.origin.x), ray.invDirection.x);
+    typename L::Float t1y = L::mul(L::sub(boxMax.y, ray.origin.y), ray.invDirection.y);
+    typename L::Float t1z = L::mul(L::sub(boxMax.z, ray.origin.z), ray.invDirection.z);
+    nearest = L::max(L::max(L::min(t0x, t1x), L::min(t0y, t1y)), L::min(t0z, t1z));
+    typename L::Float farthest = L::min(L::min(L::max(t0x, t1x), L::max(t0y, t1y)), L::max(t0z, t1z));
+    return L::maskAnd(L::maskAnd(L::less(nearest, farthest), L::greater(farthest, L::set1(0.0f))), L::less(nearest, closest));
+}
+
+// One ray against the leaf slots [first, first + count), Width slots at a time
+template <typename L>
+void intersectLeafSlots(const SimdPrimitives& p, int first, int count, const RayLanes<L>& ray, typename L::Float tMin, SimdHit& hit) {
+    float t[L::Width];
+    for (int base = first; base < first + count; base += L::Width) {
+        typename L::Float closest = L::set1(hit.t);
+        typename L::Mask valid = L::less(L::laneIndex(), L::set1((float)(first + count - base)));
+
+        typename L::Float tSphere;
+        typename L::Mask sphereHits = hitSphereLanes<L>(loadVec3<L>(p.centerX, p.centerY, p.centerZ, base), L::load(p.radius + base),
+                                                        ray, tMin, closest, tSphere);
+        typename L::Mask hits = L::maskAnd(valid, sphereHits);
+        typename L::Float tHit = tSphere;
+        if (p.hasQuads) {
+            typename L::Float tQuad;
+            typename L::Mask quadHits = hitQuadLanes<L>(loadVec3<L>(p.normalX, p.normalY, p.normalZ, base), L::load(p.planeD + base),
+                                                        loadVec3<L>(p.cornerX, p.cornerY, p.cornerZ, base),
+                                                        loadVec3<L>(p.uAxisX, p.uAxisY, p.uAxisZ, base),
+                                                        loadVec3<L>(p.vAxisX, p.vAxisY, p.vAxisZ, base), ray, tMin, closest, tQuad);
+            quadHits = L::maskAnd(valid, quadHits);
+            tHit = L::select(quadHits, tQuad, tHit); // a slot is a sphere or a quad, never both
+            hits = L::maskOr(hits, quadHits);
+        }
+
+        unsigned bits = L::bits(hits);
+        if (!bits)
+            continue;
+        L::store(t, tHit);
+        while (bits) {
+            int lane = lowestBit(bits);
+            bits &= bits - 1;
+            if (t[lane] <= hit.t) {
+                hit.t = t[lane];
+                hit.slot = base + lane;
+            }
+        }
+    }
+}
+
+// Closest hit of one ray through a wide BVH with Width children per node. The children the ray enters
+// are pushed farthest first so the nearest is popped next, and popped nodes that start behind the
+// closest hit found since are dropped.
+template <typename L>
+SimdHit traceRayWide(const SimdScene& scene, const float origin[3], const float direction[3], float tMin, float tMax) {
+    const int stackSize = 32 * L::Width;
+    const SimdWideNode<L::Width>* nodes = static_cast<const SimdWideNode<L::Width>*>(scene.wideNodes);
+    RayLanes<L> ray = makeRay<L>(broadcastVec3<L>(origin[0], origin[1], origin[2]), broadcastVec3<L>(direction[0], direction[1], direction[2]));
+    typename L::Float tMinLanes = L::set1(tMin);
+
+    SimdHit hit = { tMax, -1 };
+    int stackNode[stackSize];
+    float stackDist[stackSize];
+    int stackCount = 0;
+    float nearest[L::Width];
+    int nodeIndex = 0;
+    for (;;) {
+        const SimdWideNode<L::Width>& node = nodes[nodeIndex];
+        typename L::Float entry;
+        typename L::Mask enters = hitBoxLanes<L>(loadVec3<L>(node.minX, node.minY, node.minZ, 0), loadVec3<L>(node.maxX, node.maxY, node.maxZ, 0),
+                                                 ray, L::set1(hit.t), entry);
+        enters = L::maskAnd(enters, L::intGreater(L::loadInt(node.child), L::setInt(-1))); // skip empty slots
+        L::store(nearest, entry);
+
+        int pushed = stackCount;
+        for (unsigned bits = L::bits(enters); bits; bits &= bits - 1) {
+            int slot = lowestBit(bits);
+            if (node.count[slot] > 0) {
+                intersectLeafSlots<L>(scene.primitives, node.child[slot], node.count[slot], ray, tMinLanes, hit);
+            }
+            else if (stackCount < stackSize) {
+                // Insertion keeps the new entries sorted farthest first
+                int i = stackCount++;
+                while (i > pushed && stackDist[i - 1] < nearest[slot]) {
+                    stackNode[i] = stackNode[i - 1];
+                    stackDist[i] = stackDist[i - 1];
+                    i--;
+                }
+                stackNode[i] = node.child[slot];
+                stackDist[i] = nearest[slot];
+            }
+        }
+
+        do {
+            if (stackCount == 0) {
+                if (hit.slot < 0)
+                    hit.t = FLT_MAX;
+                return hit;
+            }
+            stackCount--;
+        } while (stackDist[stackCount] >= hit.t);
+        nodeIndex = stackNode[stackCount];
+    }
+}
+
+// Bounds of the origins and inverse directions of a packet. When the directions of the packet point
+// the same way on every axis, every ray's slab distances to a box lie in the interval products, so a
+// box whose intervals don't overlap is missed by every ray.
+struct PacketInterval
+{
+    float originMin[3], originMax[3];
+    float invDirectionMin[3], invDirectionMax[3];
+    bool valid;
+};
+
+PacketInterval packetInterval(const SimdPacket& packet) {
+    const float* origin[3] = { packet.originX, packet.originY, packet.originZ };
+    const float* direction[3] = { packet.directionX, packet.directionY, packet.directionZ };
+    PacketInterval interval;
+    interval.valid = true;
+    for (int axis = 0; axis < 3; axis++) {
+        interval.originMin[axis] = interval.originMax[axis] = origin[axis][0];
+        interval.invDirectionMin[axis] = interval.invDirectionMax[axis] = 1.0f / direction[axis][0];
+        for (int i = 0; i < packet.count; i++) {
+            float invDirection = 1.0f / direction[axis][i];
+            interval.originMin[axis] = minf(interval.originMin[axis], origin[axis][i]);
+            interval.originMax[axis] = maxf(interval.originMax[axis], origin[axis][i]);
+            interval.invDirectionMin[axis] = minf(interval.invDirectionMin[axis], invDirection);
+            interval.invDirectionMax[axis] = maxf(interval.invDirectionMax[axis], invDirection);
+        }
+        // Mixed signs (or an axis parallel ray's infinity) make the interval useless
+        bool positive = interval.invDirectionMin[axis] > 0.0f && interval.invDirectionMax[axis] < FLT_MAX;
+        bool negative = interval.invDirectionMax[axis] < 0.0f && interval.invDirectionMin[axis] > -FLT_MAX;
+        interval.valid = interval.valid && (positive || negative);
+    }
+    return interval;
+}
+
+// Smallest and largest product of two intervals
+float productMin(float a0, float a1, float b0, float b1) {
+    return minf(minf(a0 * b0, a0 * b1), minf(a1 * b0, a1 * b1));
+}
+
+float productMax(float a0, float a1, float b0, float b1) {
+    return maxf(maxf(a0 * b0, a0 * b1), maxf(a1 * b0, a1 * b1));
+}
+
+bool intervalMissesBox(const PacketInterval& interval, const SimdBinaryNode& node, float farthestClosest) {
+    float entryMin = -FLT_MAX; // no ray enters the box before this
+    float exitMax = FLT_MAX;   // or leaves it after this
+    for (int axis = 0; axis < 3; axis++) {
+        bool positive = interval.invDirectionMin[axis] > 0.0f;
+        float nearPlane = positive ? node.aabbMin[axis] : node.aabbMax[axis];
+        float farPlane = positive ? node.aabbMax[axis] : node.aabbMin[axis];
+        entryMin = maxf(entryMin, productMin(nearPlane - interval.originMax[axis], nearPlane - interval.originMin[axis],
+                                             interval.invDirectionMin[axis], interval.invDirectionMax[axis]));
+        exitMax = minf(exitMax, productMax(farPlane - interval.originMax[axis], farPlane - interval.originMin[axis],
+                                           interval.invDirectionMin[axis], interval.invDirectionMax[axis]));
+    }
+    return entryMin >= exitMax || exitMax <= 0.0f || entryMin >= farthestClosest;
+}
+
+// Closest hits of a packet, a ray per lane, following the binary BVH's skip links like the shader.
+// The packet descends into a node when any of its rays enters it.
+template <typename L>
+void tracePacketBinary(const SimdScene& scene, const SimdPacket& packet, float tMin, SimdHit* hits) {
+    const SimdPrimitives& p = scene.primitives;
+    RayLanes<L> ray = makeRay<L>(loadVec3<L>(packet.originX, packet.originY, packet.originZ, 0),
+                                 loadVec3<L>(packet.directionX, packet.directionY, packet.directionZ, 0));
+    typename L::Mask active = L::less(L::laneIndex(), L::set1((float)packet.count));
+    typename L::Float tMinLanes = L::set1(tMin);
+    typename L::Float closest = L::set1(FLT_MAX);
+    typename L::Float slot = L::setInt(-1);
+
+    PacketInterval interval = packetInterval(packet);
+    float farthestClosest = FLT_MAX;
+    float laneClosest[L::Width];
+
+    int index = 0;
+    while (index >= 0) {
+        const SimdBinaryNode& node = scene.binaryNodes[index];
+        if (interval.valid && intervalMissesBox(interval, node, farthestClosest)) {
+            index = node.meta[3];
+            continue;
+        }
+
+        typename L::Float entry;
+        typename L::Mask enters = L::maskAnd(active, hitBoxLanes<L>(broadcastVec3<L>(node.aabbMin[0], node.aabbMin[1], node.aabbMin[2]),
+                                                                    broadcastVec3<L>(node.aabbMax[0], node.aabbMax[1], node.aabbMax[2]),
+                                                                    ray, closest, entry));
+        if (!L::bits(enters)) {
+            index = node.meta[3];
+            continue;
+        }
+        if (node.meta[2] == -1) {
+            index = node.meta[0];
+            continue;
+        }
+
+        for (int i = node.meta[2]; i < node.meta[2] + node.meta[1]; i++) {
+            typename L::Float t;
+            typename L::Mask hit;
+            if (p.radius[i] >= 0.0f) {
+                hit = hitSphereLanes<L>(broadcastVec3<L>(p.centerX[i], p.centerY[i], p.centerZ[i]), L::set1(p.radius[i]), ray, tMinLanes, closest, t);
+            }
+            else {
+                hit = hitQuadLanes<L>(broadcastVec3<L>(p.normalX[i], p.normalY[i], p.normalZ[i]), L::set1(p.planeD[i]),
+                                      broadcastVec3<L>(p.cornerX[i], p.cornerY[i], p.cornerZ[i]),
+                                      broadcastVec3<L>(p.uAxisX[i], p.uAxisY[i], p.uAxisZ[i]),
+                                      broadcastVec3<L>(p.vAxisX[i], p.vAxisY[i], p.vAxisZ[i]), ray, tMinLanes, closest, t);
+            }
+            hit = L::maskAnd(enters, hit);
+            closest = L::select(hit, t, closest);
+            slot = L::select(hit, L::setInt(i), slot);
+        }
+
+        if (interval.valid) {
+            L::store(laneClosest, closest);
+            farthestClosest = laneClosest[0];
+            for (int i = 1; i < packet.count; i++)
+                farthestClosest = maxf(farthestClosest, laneClosest[i]);
+        }
+        index = node.meta[3];
+    }
+
+    int laneSlot[L::Width];
+    L::store(laneClosest, closest);
+    L::storeInt(laneSlot, slot);
+    for (int i = 0; i < packet.count; i++)
+        hits[i] = { laneClosest[i], laneSlot[i] };
+}
+
+} // namespace
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <immintrin.h>
+
+// Thin wrappers around the intrinsics of each instruction set, so simd_kernels.h is written once for
+// any lane count. Only the ones the including translation unit is compiled for are defined.
+// Everything is in an unnamed namespace: every translation unit gets its own copy, and the linker can
+// never swap the AVX2 build of a helper in for the SSE one.
+
+namespace {
+
+#ifdef __SSE2__
+struct SSELanes
+{
+    static constexpr int Width = 4;
+    using Float = __m128;
+    using Mask = __m128;
+
+    static Float set1(float v) { return _mm_set1_ps(v); }
+    static Float setInt(int v) { return _mm_castsi128_ps(_mm_set1_epi32(v)); }
+    static Float load(const float* p) { return _mm_loadu_ps(p); }
+    static Float loadInt(const int* p) { return _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)p)); }
+    static void store(float* p, Float v) { _mm_storeu_ps(p, v); }
+    static void storeInt(int* p, Float v) { _mm_storeu_si128((__m128i*)p, _mm_castps_si128(v)); }
+    static Float laneIndex() { return _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f); }
+
+    static Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+    static Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+    static Float mulAdd(Float a, Float b, Float c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+    static Float div(Float a, Float b) { return _mm_div_ps(a, b); }
+    static Float min(Float a, Float b) { return _mm_min_ps(a, b); }
+    static Float max(Float a, Float b) { return _mm_max_ps(a, b); }
+    static Float sqrt(Float a) { return _mm_sqrt_ps(a); }
+    static Float abs(Float a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+
+    static Mask less(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+    static Mask lessEqual(Float a, Float b) { return _mm_cmple_ps(a, b); }
+    static Mask greater(Float a, Float b) { return _mm_cmpgt_ps(a, b); }
+    static Mask greaterEqual(Float a, Float b) { return _mm_cmpge_ps(a, b); }
+    static Mask intGreater(Float a, Float b) { return _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_castps_si128(a), _mm_castps_si128(b))); }
+    static Mask maskAnd(Mask a, Mask b) { return _mm_and_ps(a, b); }
+    static Mask maskOr(Mask a, Mask b) { return _mm_or_ps(a, b); }
+    static Float select(Mask m, Float a, Float b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+    static unsigned bits(Mask m) { return (unsigned)_mm_movemask_ps(m); }
+};
+#endif
+
+#if defined(__AVX2__) && defined(__FMA__)
+struct AVX2Lanes
+{
+    static constexpr int Width = 8;
+    using Float = __m256;
+    using Mask = __m256;
+
+    static Float set1(float v) { return _mm256_set1_ps(v); }
+    static Float setInt(int v) { return _mm256_castsi256_ps(_mm256_set1_epi32(v)); }
+    static Float load(const float* p) { return _mm256_loadu_ps(p); }
+    static Float loadInt(const int* p) { return _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)p)); }
+    static void store(float* p, Float v) { _mm256_storeu_ps(p, v); }
+    static void storeInt(int* p, Float v) { _mm256_storeu_si256((__m256i*)p, _mm256_castps_si256(v)); }
+    static Float laneIndex() { return _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f); }
+
+    static Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+    static Float sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+    static Float mulAdd(Float a, Float b, Float c) { return _mm256_fmadd_ps(a, b, c); }
+    static Float div(Float a, Float b) { return _mm256_div_ps(a, b); }
+    static Float min(Float a, Float b) { return _mm256_min_ps(a, b); }
+    static Float max(Float a, Float b) { return _mm256_max_ps(a, b); }
+    static Float sqrt(Float a) { return _mm256_sqrt_ps(a); }
+    static Float abs(Float a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+
+    static Mask less(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static Mask lessEqual(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static Mask greater(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static Mask greaterEqual(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static Mask intGreater(Float a, Float b) { return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_castps_si256(a), _mm256_castps_si256(b))); }
+    static Mask maskAnd(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+    static Mask maskOr(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+    static Float select(Mask m, Float a, Float b) { return _mm256_blendv_ps(b, a, m); }
+    static unsigned bits(Mask m) { return (unsigned)_mm256_movemask_ps(m); }
+};
+#endif
+
+#ifdef __AVX512F__
+struct AVX512Lanes
+{
+    static constexpr int Width = 16;
+    using Float = __m512;
+    using Mask = __mmask16;
+
+    static Float set1(float v) { return _mm512_set1_ps(v); }
+    static Float setInt(int v) { return _mm512_castsi512_ps(_mm512_set1_epi32(v)); }
+    static Float load(const float* p) { return _mm512_loadu_ps(p); }
+    static Float loadInt(const int* p) { return _mm512_castsi512_ps(_mm512_loadu_si512(p)); }
+    static void store(float* p, Float v) { _mm512_storeu_ps(p, v); }
+    static void storeInt(int* p, Float v) { _mm512_storeu_si512(p, _mm512_castps_si512(v)); }
+    static Float laneIndex() {
+        return _mm512_set_ps(15.0f, 14.0f, 13.0f, 12.0f, 11.0f, 10.0f, 9.0f, 8.0f, 7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+    }
+
+    static Float add(Float a, Float b) { return _mm512_add_ps(a, b); }
+    static Float sub(Float a, Float b) { return _mm512_sub_ps(a, b); }
+    static Float mul(Float a, Float b) { return _mm512_mul_ps(a, b); }
+    static Float mulAdd(Float a, Float b, Float c) { return _mm512_fmadd_ps(a, b, c); }
+    static Float div(Float a, Float b) { return _mm512_div_ps(a, b); }
+    // The zero masking forms: GCC 12 warns about the undefined source register of the plain ones
+    static Float min(Float a, Float b) { return _mm512_maskz_min_ps(0xffff, a, b); }
+    static Float max(Float a, Float b) { return _mm512_maskz_max_ps(0xffff, a, b); }
+    static Float sqrt(Float a) { return _mm512_maskz_sqrt_ps(0xffff, a); }
+    static Float abs(Float a) { return _mm512_abs_ps(a); }
+
+    static Mask less(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+    static Mask lessEqual(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+    static Mask greater(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+    static Mask greaterEqual(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+    static Mask intGreater(Float a, Float b) { return _mm512_cmpgt_epi32_mask(_mm512_castps_si512(a), _mm512_castps_si512(b)); }
+    static Mask maskAnd(Mask a, Mask b) { return (Mask)(a & b); }
+    static Mask maskOr(Mask a, Mask b) { return (Mask)(a | b); }
+    static Float select(Mask m, Float a, Float b) { return _mm512_mask_blend_ps(m, b, a); }
+    static unsigned bits(Mask m) { return (unsigned)m; }
+};
+#endif
+
+} // namespace
@@ -0,0 +1,17 @@
+#include "simd_kernels.h"
+
+// Baseline x86 kernels: 4 lanes, so single rays run over BVH4 nodes
+
+#ifdef SIMD_SSE_KERNELS
+
+SimdHit traceRaySSE(const SimdScene& scene, const float origin[3], const float direction[3], float tMin, float tMax)
+{
+    return traceRayWide<SSELanes>(scene, origin, direction, tMin, tMax);
+}
+
+void tracePacketSSE(const SimdScene& scene, const SimdPacket& packet, float tMin, SimdHit* hits)
+{
+    tracePacketBinary<SSELanes>(scene, packet, tMin, hits);
+}
+
+#endif
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+
+// SIMD kernels of the CPU tracer. Each instruction set has its own translation unit (simd_sse.cpp,
+// simd_avx2.cpp, simd_avx512.cpp) compiled with that instruction set enabled, and the CPU renderer
+// picks one at startup. Code compiled for AVX2 must never run on a host without it, so this header,
+// which every one of them includes, only holds plain structs and declarations.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE_KERNELS 1
+#endif
+
+enum class SimdISA
+{
+    Scalar,
+    SSE,    // 4 lanes: BVH4 nodes, 4 ray packets
+    AVX2,   // 8 lanes: BVH8 nodes, 8 ray packets
+    AVX512, // BVH8 nodes as with AVX2, 16 ray packets
+};
+
+const int SIMD_MAX_WIDTH = 16; // the widest packet, the primitive arrays are padded by this many slots
+
+// Binary node as BVHNodeFlat and wide node as BVHNodeWide, without the glm types
+struct SimdBinaryNode
+{
+    float aabbMin[4];
+    float aabbMax[4];
+    int meta[4]; // x = left, y = right (inner) or primitive count (leaf), z = first primitive (-1 for inner), w = next node
+};
+
+template <int Width>
+struct SimdWideNode
+{
+    float minX[Width];
+    float minY[Width];
+    float minZ[Width];
+    float maxX[Width];
+    float maxY[Width];
+    float maxZ[Width];
+    int child[Width];
+    int count[Width];
+};
+
+// The primitives of the leaf slots (what the leaves' primitive ranges index) as structure of arrays, so
+// a leaf's primitives load into lanes directly. Slots holding a quad have a NaN sphere center and a
+// radius of -1, slots holding a sphere a zero quad normal, so the other test always misses them.
+struct SimdPrimitives
+{
+    const float* centerX;
+    const float* centerY;
+    const float* centerZ;
+    const float* radius;
+    const float* normalX; // the quad arrays are only read when hasQuads is set
+    const float* normalY;
+    const float* normalZ;
+    const float* planeD;
+    const float* cornerX;
+    const float* cornerY;
+    const float* cornerZ;
+    const float* uAxisX;
+    const float* uAxisY;
+    const float* uAxisZ;
+    const float* vAxisX;
+    const float* vAxisY;
+    const float* vAxisZ;
+    bool hasQuads;
+};
+
+struct SimdScene
+{
+    const SimdBinaryNode* binaryNodes; // packets run the stackless traversal over the binary BVH
+    const void* wideNodes;             // single rays run over SimdWideNode<4> (SSE) or <8> nodes
+    SimdPrimitives primitives;
+};
+
+struct SimdHit
+{
+    float t;  // FLT_MAX when nothing was hit
+    int slot; // leaf slot of the closest primitive, -1 when nothing was hit
+};
+
+// Up to SIMD_MAX_WIDTH rays, one per lane, the first count used
+struct SimdPacket
+{
+    float originX[SIMD_MAX_WIDTH];
+    float originY[SIMD_MAX_WIDTH];
+    float originZ[SIMD_MAX_WIDTH];
+    float directionX[SIMD_MAX_WIDTH];
+    float directionY[SIMD_MAX_WIDTH];
+    float directionZ[SIMD_MAX_WIDTH];
+    int count;
+};
+
+// Closest hit of one ray in (tMin, tMax) through the wide BVH, testing the children of a node and the
+// primitives of a leaf a lane each
+using SimdTraceRay = SimdHit (*)(const SimdScene& scene, const float origin[3], const float direction[3], float tMin, float tMax);
+
+// Closest hits of a packet of coherent rays through the binary BVH, a ray per lane. A node the
+// packet's interval bounds miss is skipped without testing the rays one by one.
+using SimdTracePacket = void (*)(const SimdScene& scene, const SimdPacket& packet, float tMin, SimdHit* hits);
+
+#ifdef SIMD_SSE_KERNELS
+SimdHit traceRaySSE(const SimdScene& scene, const float origin[3], const float direction[3], float tMin, float tMax);
+void tracePacketSSE(const SimdScene& scene, const SimdPacket& packet, float tMin, SimdHit* hits);
+#endif
+
+// Built only when the compiler can target them, see CMakeLists.txt
+#ifdef SIMD_AVX_KERNELS
+SimdHit traceRayAVX2(const SimdScene& scene, const float origin[3], const float direction[3], float tMin, float tMax);
+void tracePacketAVX2(const SimdScene& scene, const SimdPacket& packet, float tMin, SimdHit* hits);
+void tracePacketAVX512(const SimdScene& scene, const SimdPacket& packet, float tMin, SimdHit* hits);
+#endif
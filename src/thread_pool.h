@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker owns a deque: it pushes and pops its own tasks at the back
+// (newest first, which keeps recursive builds depth first and cache friendly) while idle workers
+// steal from the front of other deques (oldest first, which are the biggest chunks of work).
+// Tasks submitted from a thread outside the pool go to an extra shared queue.
+class ThreadPool
+{
+public:
+    ThreadPool(unsigned numThreads = std::thread::hardware_concurrency())
+    {
+        if (numThreads == 0)
+            numThreads = 1;
+
+        // One queue per worker plus the shared queue used by outside threads
+        for (unsigned i = 0; i <= numThreads; i++)
+            queues.push_back(std::make_unique<WorkQueue>());
+
+        for (unsigned i = 0; i < numThreads; i++)
+            workers.emplace_back([this, i] { workerLoop(i); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        sleepCondition.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return (unsigned)workers.size(); }
+
+    void submit(std::function<void()> task)
+    {
+        WorkQueue& queue = *queues[currentQueue()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        queuedTasks.fetch_add(1, std::memory_order_release);
+        {
+            // Taking the lock orders this notify against a worker about to go to sleep
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        sleepCondition.notify_one();
+    }
+
+    // Runs one pending task on the calling thread, used by waiting threads so they help instead of blocking.
+    // Returns false if there was nothing to run.
+    bool runPendingTask()
+    {
+        std::function<void()> task;
+        if (!popTask(currentQueue(), task))
+            return false;
+        task();
+        return true;
+    }
+
+private:
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> queuedTasks{0};
+
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+    bool stopping = false;
+
+    static int& workerIndex()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    // Queue owned by the calling thread, outside threads share the last queue
+    unsigned currentQueue() const
+    {
+        int index = workerIndex();
+        return index >= 0 ? (unsigned)index : (unsigned)workers.size();
+    }
+
+    bool popTask(unsigned own, std::function<void()>& task)
+    {
+        // Own queue first, newest task
+        {
+            WorkQueue& queue = *queues[own];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+                queuedTasks.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+
+        // Steal the oldest task from everyone else
+        for (unsigned i = 1; i < queues.size(); i++) {
+            WorkQueue& queue = *queues[(own + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                queuedTasks.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(unsigned index)
+    {
+        workerIndex() = (int)index;
+        while (true) {
+            std::function<void()> task;
+            if (popTask(index, task)) {
+                task();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepCondition.wait(lock, [this] { return stopping || queuedTasks.load(std::memory_order_acquire) > 0; });
+            if (stopping)
+                return;
+        }
+    }
+};
+
+// Fork-join helper: run() forks tasks onto the pool, wait() joins them. The waiting thread keeps
+// executing pending tasks, so nested groups (recursive builds) can't deadlock the pool.
+class TaskGroup
+{
+public:
+    TaskGroup(ThreadPool& pool) : pool(pool) {}
+    ~TaskGroup() { wait(); }
+
+    template <typename F>
+    void run(F&& task)
+    {
+        pending.fetch_add(1, std::memory_order_relaxed);
+        pool.submit([this, task = std::forward<F>(task)]() mutable {
+            task();
+            pending.fetch_sub(1, std::memory_order_release);
+        });
+    }
+
+    void wait()
+    {
+        while (pending.load(std::memory_order_acquire) > 0) {
+            if (!pool.runPendingTask())
+                std::this_thread::yield();
+        }
+    }
+
+private:
+    ThreadPool& pool;
+    std::atomic<int> pending{0};
+};
+
+// Splits [begin, end) into chunks of at least grainSize and calls func(chunkBegin, chunkEnd) for each.
+// Without a pool (or for small ranges) everything runs on the calling thread.
+template <typename F>
+void parallelFor(ThreadPool* pool, int begin, int end, int grainSize, F&& func)
+{
+    int count = end - begin;
+    if (count <= 0)
+        return;
+
+    if (!pool || count <= grainSize) {
+        func(begin, end);
+        return;
+    }
+
+    int numChunks = (count + grainSize - 1) / grainSize;
+    TaskGroup group(*pool);
+    for (int c = 0; c < numChunks; c++) {
+        int chunkBegin = begin + c * grainSize;
+        int chunkEnd = std::min(chunkBegin + grainSize, end);
+        group.run([&func, chunkBegin, chunkEnd] { func(chunkBegin, chunkEnd); });
+    }
+    group.wait();
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "bvh.h"
+#include "bvh_optimize.h"
+
+// Two level acceleration structure. Every object of the World gets a bottom level BVH (BLAS) over its
+// spheres in object space, and a top level BVH (TLAS) is built over the world space bounds of the
+// instances. Rays that reach a TLAS leaf are moved into the instance's object space and traverse its
+// BLAS, so repeated geometry is stored once and moving an instance only rebuilds the small TLAS.
+
+// Matches Instance in compute_shader.glsl. Only the inverse transform is needed on the GPU: rays go
+// to object space with it, and normals come back with its transpose.
+struct alignas(16) GPUInstance {
+    glm::mat4 worldToObject;
+    int blasRoot;   // root of the object's BLAS in the shared node array
+    int padding[3];
+};
+
+// All BLASes, concatenated so they fit in the existing sphere and BVH node buffers. Node links and
+// leaf sphere offsets are absolute, so every BLAS can be traversed like the single level BVH.
+struct BLASSet {
+    std::vector<Sphere> spheres;      // every object's spheres, each object in its own leaf order
+    std::vector<BVHNodeFlat> nodes;
+    std::vector<int> roots;           // root node of every object
+    std::vector<AABB> bounds;         // object space bounds of every object
+};
+
+struct TLAS {
+    std::vector<BVHNodeFlat> nodes;   // leaves index instances
+    std::vector<GPUInstance> instances;
+};
+
+// With optimize every BLAS gets the reinsertion pass of bvh_optimize.h, worth it for objects placed many times
+void buildBLASes(const World& world, BLASSet& blas, BVHBuildContext& context, ThreadPool* pool = nullptr, bool optimize = false) {
+    blas = {};
+    std::vector<AABB> aabbs;
+    std::vector<BVHNodeFlat> flat;
+
+    for (const Object& object : world.objects) {
+        aabbs.clear();
+        for (const Sphere& sphere : object.spheres)
+            aabbs.push_back(computeAABB(sphere));
+
+        context.reset((int)aabbs.size());
+        int root = buildBVHBinned(context, aabbs, DEFAULT_SAH_BINS, pool);
+        if (optimize)
+            root = optimizeBVH(context.nodes, root).root;
+        flat.clear();
+        flattenBVH(root, context.nodes, flat, -1);
+
+        int nodeBase = (int)blas.nodes.size();
+        int sphereBase = (int)blas.spheres.size();
+        for (BVHNodeFlat node : flat) {
+            if (node.meta.z != -1) {
+                node.meta.z += sphereBase;
+            }
+            else {
+                node.meta.x += nodeBase;
+                node.meta.y += nodeBase;
+            }
+            if (node.meta.w != -1)
+                node.meta.w += nodeBase;
+            blas.nodes.push_back(node);
+        }
+
+        std::vector<Sphere> sorted = reorderPrimitives(object.spheres, context.indices);
+        blas.spheres.insert(blas.spheres.end(), sorted.begin(), sorted.end());
+        blas.roots.push_back(nodeBase); // flattenBVH puts the root first
+        blas.bounds.push_back(context.nodes[root].aabb);
+    }
+}
+
+// World space bounds of an object space box, from its 8 transformed corners
+AABB transformAABB(const AABB& box, const glm::mat4& transform) {
+    AABB result = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec3 p((corner & 1) ? box.max.x : box.min.x,
+                    (corner & 2) ? box.max.y : box.min.y,
+                    (corner & 4) ? box.max.z : box.min.z);
+        glm::vec3 world = glm::vec3(transform * glm::vec4(p, 1.0f));
+        result.min = glm::min(result.min, world);
+        result.max = glm::max(result.max, world);
+    }
+    return result;
+}
+
+// Cheap enough to run every frame for moving instances, only the instances are involved
+void buildTLAS(const World& world, const BLASSet& blas, BVHBuildContext& context, TLAS& tlas) {
+    std::vector<AABB> aabbs;
+    aabbs.reserve(world.instances.size());
+    for (const Instance& instance : world.instances)
+        aabbs.push_back(transformAABB(blas.bounds[instance.object], instance.transform));
+
+    context.reset((int)aabbs.size());
+    int root = buildBVHBinned(context, aabbs);
+    tlas.nodes.clear();
+    flattenBVH(root, context.nodes, tlas.nodes, -1);
+
+    // Leaves index instances in the builder's order
+    tlas.instances.resize(world.instances.size());
+    for (size_t i = 0; i < context.indices.size(); i++) {
+        const Instance& instance = world.instances[context.indices[i]];
+        tlas.instances[i].worldToObject = glm::inverse(instance.transform);
+        tlas.instances[i].blasRoot = blas.roots[instance.object];
+    }
+}
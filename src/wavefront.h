@@ -0,0 +1,196 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "compute_shader.h"
+
+// Wavefront path tracer: runs the paths of compute_shader.glsl's ray_color2 as a sequence of passes
+// over queues (see "Wavefront path tracing" in the shader) instead of one megakernel invocation per
+// pixel. Passes are the same shader built with WAVEFRONT and a pass define on top of the megakernel's
+// defines, and all but generate and accumulate are sized on the GPU by the queue counts and dispatched
+// indirectly, so nothing is read back between them.
+class WavefrontPathTracer
+{
+public:
+    static const int GROUP_SIZE = 64;          // matches WAVEFRONT_GROUP_SIZE
+    static const int MATERIAL_TYPES = 4;       // MAT_LAMBERTIAN ... MAT_EMISSIVE, a shade pass each
+    static const int QUEUE_SHADE = 2;          // queue of the first shade pass, after the two ray queues
+    static const int QUEUE_COUNT = QUEUE_SHADE + MATERIAL_TYPES;
+
+    WavefrontPathTracer() {}
+
+    WavefrontPathTracer(const std::filesystem::path& shaderPath, const std::vector<std::string>& defines)
+    {
+        generatePass = ComputeShader(shaderPath, withPass(defines, "WAVEFRONT_PASS_GENERATE"));
+        extendPass = ComputeShader(shaderPath, withPass(defines, "WAVEFRONT_PASS_EXTEND"));
+        for (int type = 0; type < MATERIAL_TYPES; type++) {
+            std::vector<std::string> shadeDefines = withPass(defines, "WAVEFRONT_PASS_SHADE");
+            shadeDefines.push_back("WAVEFRONT_SHADE_TYPE " + std::to_string(type));
+            shadePasses[type] = ComputeShader(shaderPath, shadeDefines);
+        }
+        queuesPass = ComputeShader(shaderPath, withPass(defines, "WAVEFRONT_PASS_QUEUES"));
+        accumulatePass = ComputeShader(shaderPath, withPass(defines, "WAVEFRONT_PASS_ACCUMULATE"));
+
+        GLint limit = 0;
+        glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &limit);
+        maxGroupsX = (GLuint)std::max(limit, 1);
+    }
+
+    // Uniforms shared with the megakernel, set on every pass
+    void setInt(const std::string& name, int value)
+    {
+        for (ComputeShader* pass : passes()) {
+            pass->use();
+            pass->setInt(name, value);
+        }
+    }
+
+    void setVec2(const std::string& name, const glm::vec2& value)
+    {
+        for (ComputeShader* pass : passes()) {
+            pass->use();
+            pass->setVec2(name, value);
+        }
+    }
+
+    // One frame of samplesPerPixel paths per pixel into the images bound to units 0 and 1, as a dispatch
+    // of the megakernel with the same uniforms would
+    void render(int width, int height, int samplesPerPixel, int maxBounces, int time, int frameIndex)
+    {
+        int pathCount = width * height;
+        if (pathCount <= 0)
+            return;
+        reserve(pathCount);
+
+        generatePass.use();
+        generatePass.setInt("time", time);
+        accumulatePass.use();
+        accumulatePass.setInt("frameIndex", frameIndex);
+
+        const int shadeQueues = ((1 << MATERIAL_TYPES) - 1) << QUEUE_SHADE;
+        for (int sample = 0; sample < samplesPerPixel; sample++) {
+            generatePass.use();
+            generatePass.setInt("wavefront_sample", sample);
+            dispatch(generatePass, groupCount(pathCount));
+            runQueues(0, 1 << 0);
+
+            // Every bounce empties the ray queue it traces and fills the other one
+            int rayQueue = 0;
+            for (int bounce = 0; bounce < maxBounces; bounce++) {
+                extendPass.use();
+                extendPass.setInt("wavefront_ray_queue", rayQueue);
+                dispatchIndirect(extendPass, rayQueue);
+                runQueues(1 << rayQueue, shadeQueues);
+
+                for (int type = 0; type < MATERIAL_TYPES; type++) {
+                    shadePasses[type].use();
+                    shadePasses[type].setInt("wavefront_ray_queue", 1 - rayQueue);
+                    dispatchIndirect(shadePasses[type], QUEUE_SHADE + type);
+                }
+                rayQueue = 1 - rayQueue;
+                runQueues(shadeQueues, 1 << rayQueue);
+            }
+            // Paths reaching max_bounces are not pushed, so the last ray queue is empty again
+        }
+
+        dispatch(accumulatePass, groupCount(pathCount));
+    }
+
+private:
+    // Queue dispatch arguments: the x, y, z groups of glDispatchComputeIndirect then the item count
+    struct QueueDispatch
+    {
+        GLuint groups[3];
+        GLuint count;
+    };
+
+    ComputeShader generatePass, extendPass, queuesPass, accumulatePass;
+    ComputeShader shadePasses[MATERIAL_TYPES];
+
+    GLuint paths = 0;       // PathState per pixel, 80 bytes
+    GLuint queueItems = 0;  // QUEUE_COUNT queues of a path index per pixel
+    GLuint queueCounts = 0; // QueueDispatch per queue, also the indirect dispatch buffer
+    GLuint radiance = 0;    // vec4 per pixel
+    int capacity = 0;
+    GLuint maxGroupsX = 65535; // GL_MAX_COMPUTE_WORK_GROUP_COUNT in x, longer dispatches are folded into rows
+
+    static std::vector<std::string> withPass(std::vector<std::string> defines, const char* pass)
+    {
+        defines.push_back("WAVEFRONT");
+        defines.push_back(pass);
+        return defines;
+    }
+
+    std::vector<ComputeShader*> passes()
+    {
+        std::vector<ComputeShader*> all = { &generatePass, &extendPass, &queuesPass, &accumulatePass };
+        for (ComputeShader& pass : shadePasses)
+            all.push_back(&pass);
+        return all;
+    }
+
+    static GLuint groupCount(int items)
+    {
+        return (GLuint)((items + GROUP_SIZE - 1) / GROUP_SIZE);
+    }
+
+    static void resizeBuffer(GLuint& buffer, size_t bytes)
+    {
+        if (buffer)
+            glDeleteBuffers(1, &buffer);
+        glCreateBuffers(1, &buffer);
+        glNamedBufferData(buffer, std::max(bytes, (size_t)16), nullptr, GL_DYNAMIC_COPY);
+    }
+
+    // Buffers only grow and keep their bindings (14 to 17, after the scene's) from then on
+    void reserve(int pathCount)
+    {
+        if (pathCount <= capacity)
+            return;
+        capacity = pathCount;
+
+        resizeBuffer(paths, (size_t)pathCount * 80);
+        resizeBuffer(queueItems, (size_t)pathCount * QUEUE_COUNT * sizeof(GLuint));
+        resizeBuffer(radiance, (size_t)pathCount * 4 * sizeof(float));
+        resizeBuffer(queueCounts, QUEUE_COUNT * sizeof(QueueDispatch));
+        QueueDispatch empty[QUEUE_COUNT];
+        for (QueueDispatch& queue : empty)
+            queue = { { 0, 1, 1 }, 0 };
+        glNamedBufferSubData(queueCounts, 0, sizeof(empty), empty);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, paths);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, queueItems);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, queueCounts);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, radiance);
+    }
+
+    // Clears the consumed queues and sizes the dispatches of the produced ones, as bit masks of queues
+    void runQueues(int consumed, int produced)
+    {
+        queuesPass.use();
+        queuesPass.setInt("wavefront_consumed", consumed);
+        queuesPass.setInt("wavefront_produced", produced);
+        dispatch(queuesPass, 1);
+    }
+
+    // Runs the pass and makes its writes, including the dispatch arguments, visible to the next one. The
+    // shader's wavefront_item() flattens the rows again, invocations past the end return.
+    void dispatch(ComputeShader& pass, GLuint groups)
+    {
+        GLuint rows = (groups + maxGroupsX - 1) / maxGroupsX;
+        pass.use();
+        glDispatchCompute(std::min(groups, maxGroupsX), std::max(rows, 1u), 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+    }
+
+    void dispatchIndirect(ComputeShader& pass, int queue)
+    {
+        pass.use();
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, queueCounts);
+        glDispatchComputeIndirect((GLintptr)(queue * sizeof(QueueDispatch)));
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+    }
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <vector>
 
 struct alignas(16) Sphere
 {
@@ -17,6 +18,24 @@ Sphere createSphere(glm::vec3 position, float radius, uint32_t material_index){
     return sphere;
 }
 
+// Sphere buffers in the SPHERE_SOA layout: 16 bytes of geometry per sphere for traversal, materials apart
+struct SphereSoA
+{
+    std::vector<glm::vec4> geometry; // xyz = center, w = radius
+    std::vector<uint32_t> materials;
+};
+
+SphereSoA splitSpheres(const Sphere* spheres, size_t count) {
+    SphereSoA soa;
+    soa.geometry.resize(count);
+    soa.materials.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        soa.geometry[i] = glm::vec4(spheres[i].position, spheres[i].radius);
+        soa.materials[i] = spheres[i].material_index;
+    }
+    return soa;
+}
+
 struct alignas(16) Quad
 {
     glm::vec3 corner_point;
@@ -35,10 +54,11 @@ Quad createQuad(glm::vec3 corner_point, glm::vec3 u, glm::vec3 v, uint32_t mater
     return quad;
 }
 
-const float MAT_LAMBERTIAN = 0.0;
-const float MAT_METAL = 1.0;
-const float MAT_DIELECTRIC = 2.0;
-const float MAT_EMISSIVE = 3.0;
+const uint32_t MAT_LAMBERTIAN = 0;
+const uint32_t MAT_METAL = 1;
+const uint32_t MAT_DIELECTRIC = 2;
+const uint32_t MAT_EMISSIVE = 3;
+const uint32_t MAT_TYPE_COUNT = 4;
 
 struct alignas(16) Material
 {
@@ -46,7 +66,7 @@ struct alignas(16) Material
     float fuzz;
     glm::vec3 emission;
     float refractive_index;
-    float type;
+    uint32_t type;
 };
 
 Material Dielectric(float refractive_index)
@@ -93,9 +113,23 @@ Material Emissive(glm::vec3 color, glm::vec3 emission)
     return material;
 }
 
+// Group of spheres in its own object space. Each object gets one bottom level BVH, built once, and is
+// placed in the scene any number of times by instances.
+struct Object
+{
+    std::vector<Sphere> spheres;
+};
+
+struct Instance
+{
+    glm::mat4 transform; // object to world, affine
+    uint32_t object;
+};
+
 struct World
 {
-    /* data */
+    std::vector<Object> objects;
+    std::vector<Instance> instances;
 };
 
 